@@ -0,0 +1,356 @@
+#pragma once
+
+#include <iostream>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <vector>
+#include <span>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <semaphore>
+#include <atomic>
+#include <algorithm>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+namespace cyber
+{
+    enum class IoOp : uint8_t
+    {
+        Read,
+        Write,
+    };
+
+    enum class IoBackend : uint8_t
+    {
+        IoUring, // falls back to ThreadPool if io_uring is not supported
+        ThreadPool,
+    };
+
+    struct IoBatch;
+
+    struct IoRequest
+    {
+        IoOp op;
+        int fd;
+        char *buf;
+        uint32_t len;
+        uint64_t off;
+        int64_t res = 0; // the bytes transferred, or -errno
+        IoBatch *batch = nullptr;
+    };
+
+    struct IoBatch
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+        size_t pending = 0;
+        // called on an I/O thread after the last request instead of notifying a waiter, it may destroy the batch
+        std::function<void()> on_complete;
+    };
+
+    /*
+    Asynchronous page I/O, any number of threads may have requests in flight.
+    */
+    class AsyncIo
+    {
+    public:
+        virtual ~AsyncIo() {}
+
+        // submit the requests at once and wait for all of them
+        void run(std::span<IoRequest> requests)
+        {
+            if (requests.empty())
+                return;
+
+            IoBatch batch;
+            batch.pending = requests.size();
+            for (IoRequest &request : requests)
+                request.batch = &batch;
+            submit(requests);
+
+            std::unique_lock lock(batch.mutex);
+            batch.cv.wait(lock, [&batch] { return batch.pending == 0; });
+        }
+        // submit the requests at once without waiting, the requests and the batch must live until it completes
+        void start(std::span<IoRequest> requests, IoBatch *batch)
+        {
+            batch->pending = requests.size();
+            for (IoRequest &request : requests)
+                request.batch = batch;
+            submit(requests);
+        }
+
+    protected:
+        virtual void submit(std::span<IoRequest> requests) = 0;
+
+        // the batch may be destroyed as soon as the last request is completed,
+        // it's notified with the mutex held so the waiter can't return before
+        static void complete(IoRequest *request, int64_t res)
+        {
+            request->res = res;
+            IoBatch *batch = request->batch;
+            if (batch->on_complete)
+            {
+                bool last;
+                {
+                    std::lock_guard lock(batch->mutex);
+                    last = --batch->pending == 0;
+                }
+                // the function may destroy itself with the batch
+                if (last)
+                    std::function<void()>(std::move(batch->on_complete))();
+                return;
+            }
+
+            std::lock_guard lock(batch->mutex);
+            if (--batch->pending == 0)
+                batch->cv.notify_one();
+        }
+    };
+
+    // blocking pread/pwrite on a pool of threads
+    class ThreadPoolIo : public AsyncIo
+    {
+    public:
+        ThreadPoolIo(size_t thread_num = 8)
+        {
+            for (size_t i = 0; i < thread_num; i++)
+                workers.emplace_back([this](std::stop_token stop) { work(stop); });
+        }
+
+        ~ThreadPoolIo()
+        {
+            for (auto &worker : workers)
+                worker.request_stop();
+            cv.notify_all();
+        }
+
+    protected:
+        void submit(std::span<IoRequest> requests) override
+        {
+            {
+                std::lock_guard lock(mutex);
+                for (IoRequest &request : requests)
+                    queue.push_back(&request);
+            }
+            cv.notify_all();
+        }
+
+    private:
+        void work(std::stop_token stop)
+        {
+            while (true)
+            {
+                IoRequest *request;
+                {
+                    std::unique_lock lock(mutex);
+                    cv.wait(lock, stop, [this] { return !queue.empty(); });
+                    if (queue.empty())
+                        return;
+                    request = queue.front();
+                    queue.pop_front();
+                }
+
+                ssize_t n = request->op == IoOp::Read
+                                ? pread64(request->fd, request->buf, request->len, request->off)
+                                : pwrite64(request->fd, request->buf, request->len, request->off);
+                complete(request, n == -1 ? -errno : n);
+            }
+        }
+
+        std::mutex mutex;
+        std::condition_variable_any cv;
+        std::deque<IoRequest *> queue;
+        std::vector<std::jthread> workers; // destroyed first
+    };
+
+    /*
+    io_uring through the raw system calls.
+    A batch is submitted by one io_uring_enter, the completions are reaped by a dedicated thread.
+    */
+    class IoUring : public AsyncIo
+    {
+    public:
+        // return nullptr if io_uring is not supported
+        static std::unique_ptr<IoUring> create(unsigned entries = 256)
+        {
+            std::unique_ptr<IoUring> ring(new IoUring());
+            if (!ring->setup(entries))
+                return nullptr;
+
+            ring->reaper = std::thread([ring = ring.get()]() { ring->reap(); });
+            return ring;
+        }
+
+        ~IoUring()
+        {
+            if (reaper.joinable())
+            {
+                // a nop without request stops the reaper
+                {
+                    std::lock_guard lock(submit_latch);
+                    slots->acquire();
+                    push_sqe(IORING_OP_NOP, nullptr);
+                    enter(1, 0, 0);
+                }
+                reaper.join();
+            }
+
+            if (sqes != nullptr)
+                munmap(sqes, sq_entries * sizeof(io_uring_sqe));
+            if (cq_ptr != nullptr && cq_ptr != sq_ptr)
+                munmap(cq_ptr, cq_size);
+            if (sq_ptr != nullptr)
+                munmap(sq_ptr, sq_size);
+            if (ring_fd != -1)
+                close(ring_fd);
+        }
+
+    protected:
+        void submit(std::span<IoRequest> requests) override
+        {
+            std::lock_guard lock(submit_latch);
+            while (!requests.empty())
+            {
+                size_t n = std::min<size_t>(requests.size(), sq_entries);
+                for (IoRequest &request : requests.first(n))
+                {
+                    // the completion queue never overflows
+                    slots->acquire();
+                    push_sqe(request.op == IoOp::Read ? IORING_OP_READ : IORING_OP_WRITE, &request);
+                }
+
+                if (enter(n, 0, 0) < 0)
+                {
+                    std::cerr << "io_uring_enter: " << strerror(errno);
+                    exit(-1);
+                }
+                requests = requests.subspan(n);
+            }
+        }
+
+    private:
+        IoUring() {}
+
+        bool setup(unsigned entries)
+        {
+            io_uring_params params;
+            std::memset(&params, 0, sizeof(params));
+            ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+            if (ring_fd < 0)
+                return false;
+
+            sq_entries = params.sq_entries;
+            sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            if (params.features & IORING_FEAT_SINGLE_MMAP)
+                sq_size = cq_size = std::max(sq_size, cq_size);
+
+            sq_ptr = map(sq_size, IORING_OFF_SQ_RING);
+            cq_ptr = params.features & IORING_FEAT_SINGLE_MMAP ? sq_ptr : map(cq_size, IORING_OFF_CQ_RING);
+            sqes = (io_uring_sqe *)map(sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES);
+            if (sq_ptr == nullptr || cq_ptr == nullptr || sqes == nullptr)
+                return false;
+
+            sq_tail = (unsigned *)(sq_ptr + params.sq_off.tail);
+            sq_mask = *(unsigned *)(sq_ptr + params.sq_off.ring_mask);
+            sq_array = (unsigned *)(sq_ptr + params.sq_off.array);
+            cq_head = (unsigned *)(cq_ptr + params.cq_off.head);
+            cq_tail = (unsigned *)(cq_ptr + params.cq_off.tail);
+            cq_mask = *(unsigned *)(cq_ptr + params.cq_off.ring_mask);
+            cqes = (io_uring_cqe *)(cq_ptr + params.cq_off.cqes);
+
+            slots = std::make_unique<std::counting_semaphore<>>(params.cq_entries);
+            return true;
+        }
+
+        char *map(size_t size, off_t offset)
+        {
+            void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+            return ptr == MAP_FAILED ? nullptr : (char *)ptr;
+        }
+
+        int enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+        {
+            return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+        }
+
+        // the caller must hold submit_latch, the kernel consumes every entry on io_uring_enter
+        void push_sqe(uint8_t opcode, IoRequest *request)
+        {
+            unsigned tail = *sq_tail;
+            unsigned index = tail & sq_mask;
+            io_uring_sqe *sqe = &sqes[index];
+            std::memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = opcode;
+            sqe->user_data = (uint64_t)request;
+            if (request != nullptr)
+            {
+                sqe->fd = request->fd;
+                sqe->addr = (uint64_t)request->buf;
+                sqe->len = request->len;
+                sqe->off = request->off;
+            }
+            sq_array[index] = index;
+            std::atomic_ref(*sq_tail).store(tail + 1, std::memory_order_release);
+        }
+
+        void reap()
+        {
+            while (true)
+            {
+                unsigned head = std::atomic_ref(*cq_head).load(std::memory_order_relaxed);
+                if (head == std::atomic_ref(*cq_tail).load(std::memory_order_acquire))
+                {
+                    if (enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+                    {
+                        std::cerr << "io_uring_enter: " << strerror(errno);
+                        exit(-1);
+                    }
+                    continue;
+                }
+
+                io_uring_cqe *cqe = &cqes[head & cq_mask];
+                IoRequest *request = (IoRequest *)cqe->user_data;
+                int64_t res = cqe->res;
+                std::atomic_ref(*cq_head).store(head + 1, std::memory_order_release);
+                slots->release();
+
+                if (request == nullptr)
+                    return;
+                complete(request, res);
+            }
+        }
+
+        int ring_fd = -1;
+        unsigned sq_entries = 0;
+        size_t sq_size = 0, cq_size = 0;
+        char *sq_ptr = nullptr, *cq_ptr = nullptr;
+        io_uring_sqe *sqes = nullptr;
+        unsigned *sq_tail, *sq_array, sq_mask;
+        unsigned *cq_head, *cq_tail, cq_mask;
+        io_uring_cqe *cqes;
+
+        std::mutex submit_latch;
+        std::unique_ptr<std::counting_semaphore<>> slots; // free entries of the completion queue
+        std::thread reaper;
+    };
+
+    inline std::unique_ptr<AsyncIo> make_async_io(IoBackend backend)
+    {
+        if (backend == IoBackend::IoUring)
+        {
+            if (auto ring = IoUring::create(); ring != nullptr)
+                return ring;
+        }
+
+        return std::make_unique<ThreadPoolIo>();
+    }
+} // namespace cyber
@@ -1,8 +1,11 @@
 #pragma once
 
 #include <list>
+#include <deque>
 #include <algorithm>
 #include <tuple>
+#include <numeric>
+#include <span>
 
 #include "engines/kv_engine.hpp"
 
@@ -11,9 +14,19 @@
 
 namespace cyber
 {
+    /*
+    BTree with optimistic lock coupling.
+    Readers never lock a node, they validate the version of every node they have read,
+    writers only lock the nodes they modify. An operation restarts from the root if any validation fails.
+    The references to resident children are swizzled to their frames, so a traversal doesn't look up the buffer manager.
+    */
     class BTree : public KvEngine
     {
     public:
+        BTree(size_t buffer_size = 2 * gb, ReplacementPolicy policy = ReplacementPolicy::TwoQueue,
+              HugePages huge_pages = HugePages::Transparent, IoBackend io_backend = IoBackend::IoUring)
+            : buffer_manager(buffer_size, policy, huge_pages, io_backend) {}
+
         virtual OpStatus open(const char *dir_path)
         {
             return buffer_manager.open(dir_path);
@@ -21,173 +34,1814 @@ namespace cyber
 
         virtual OpStatus get(std::string_view key)
         {
-            BTreeNode *node;
-            std::tie(node, std::ignore) = go_to_leaf(key);
+            while (true)
+            {
+                if (auto res = try_get(key); res.has_value())
+                    return std::move(*res);
+            }
+        };
 
-            num_t index = node->find_value_index(key);
-            if (index >= node->data_num()) // no data in the node
-                return OpStatus(OpError::KeyNotFound);
+        /*
+        The value is read in place, the handle pins the frame of the leaf until it's reset or destroyed,
+        so the frame isn't evicted meanwhile. The writers don't wait for it, a writer of the leaf moves the page
+        to another frame first, and the pinned frame is reused after the handle is released.
+        A large value spans its overflow pages, it's read into the buffer of the handle.
+        */
+        virtual OpStatus get(std::string_view key, PinnedValue &value)
+        {
+            value.reset();
+            while (true)
+            {
+                if (auto res = try_get(key, value); res.has_value())
+                    return *res;
+            }
+        }
 
-            KeyValueCell kvcell(node->key_value_cell(index));
-            if (kvcell != key) // key not found
-                return OpStatus(OpError::KeyNotFound);
+        /*
+        The keys are sorted and descend level by level, the keys under a child share one descent to it,
+        and the missing children of a level are read in parallel before any of them is visited.
+        The nodes of a level are searched before any of the results is used, so the memory accesses of
+        the searches overlap: the headers, the slots and the found cells are prefetched ahead of their use.
+        The keys under a node which fails its validation descend from the root again.
+        The large values are read from their overflow pages after all the leaves have been searched.
+        */
+        virtual std::vector<OpStatus> multi_get(std::span<const std::string_view> keys)
+        {
+            // the nodes whose slots are prefetched ahead of the current search
+            constexpr size_t PREFETCH_DISTANCE = 8;
 
-            return OpStatus(OpError::Ok, kvcell.value_str());
-        };
+            std::vector<OpStatus> results(keys.size());
+            std::vector<size_t> pending(keys.size());
+            std::iota(pending.begin(), pending.end(), 0);
+
+            // the node and its version, and the keys under it are order[first, last)
+            struct Group
+            {
+                BTreeNode *node;
+                uint64_t version;
+                size_t first, last;
+            };
+            std::vector<Group> level, next_level;
+            // the keys under the same child, the node of a run is the parent
+            std::vector<std::tuple<Group, num_t>> runs;
+            std::vector<size_t> order;
+            std::vector<num_t> indexes; // the search result of order[i]
+            std::vector<id_t> page_ids;
+            // the keys whose results hold the references to their large values
+            std::vector<size_t> large, leaf_large;
+            while (!pending.empty())
+            {
+                order.swap(pending);
+                pending.clear();
+                ranges::sort(order, ranges::less(), [&](size_t i) { return keys[i]; });
+                indexes.resize(order.size());
+                auto root = read_root();
+                if (!root.has_value())
+                {
+                    pending.swap(order);
+                    continue;
+                }
+
+                level.assign({Group{std::get<0>(*root), std::get<1>(*root), 0, order.size()}});
+                while (!level.empty())
+                {
+                    for (auto &group : level)
+                        group.node->prefetch_header();
+                    for (size_t g = 0; g < level.size(); g++)
+                    {
+                        if (g + PREFETCH_DISTANCE < level.size())
+                            level[g + PREFETCH_DISTANCE].node->prefetch_slots();
+                        auto &[node, version, first, last] = level[g];
+                        if (!node->is_valid())
+                            continue;
+                        bool is_leaf = node->type() == CellType::KeyValueCell;
+                        for (size_t i = first; i < last; i++)
+                        {
+                            indexes[i] = is_leaf ? node->find_value_index(keys[order[i]]) : node->find_child_index(keys[order[i]]);
+                            if (is_leaf)
+                                node->prefetch_cell(indexes[i]);
+                        }
+                    }
+
+                    runs.clear();
+                    page_ids.clear();
+                    for (auto &[node, version, first, last] : level)
+                    {
+                        auto group = std::span(order).subspan(first, last - first);
+                        if (!node->is_valid())
+                        {
+                            if (!node->latch.validate(version))
+                                pending.insert(pending.end(), group.begin(), group.end());
+                            else
+                            {
+                                for (size_t i : group)
+                                    results[i] = OpStatus(OpError::Corruption);
+                            }
+                            continue;
+                        }
+
+                        if (node->type() == CellType::KeyValueCell)
+                        {
+                            leaf_large.clear();
+                            for (size_t i = first; i < last; i++)
+                            {
+                                std::string_view key = keys[order[i]];
+                                if (indexes[i] < node->data_num() && node->cell_key_equals(indexes[i], key))
+                                {
+                                    results[order[i]] = OpStatus(OpError::Ok, node->cell_value(indexes[i]));
+                                    if (node->cell_overflows(indexes[i]))
+                                        leaf_large.push_back(order[i]);
+                                }
+                                else
+                                    results[order[i]] = OpStatus(OpError::KeyNotFound);
+                            }
+                            if (!node->latch.validate(version))
+                                pending.insert(pending.end(), group.begin(), group.end());
+                            else
+                                large.insert(large.end(), leaf_large.begin(), leaf_large.end());
+                            continue;
+                        }
+
+                        size_t run_num = runs.size(), page_num = page_ids.size();
+                        for (size_t i = first, run_first = first; i < last; i++)
+                        {
+                            if (i + 1 < last && indexes[i + 1] == indexes[i])
+                                continue;
+                            if (id_t ref = node->child_at(indexes[i]); !is_swizzled(ref))
+                                page_ids.push_back(ref);
+                            runs.emplace_back(Group{node, version, run_first, i + 1}, indexes[i]);
+                            run_first = i + 1;
+                        }
+                        if (!node->latch.validate(version))
+                        {
+                            runs.resize(run_num);
+                            page_ids.resize(page_num);
+                            pending.insert(pending.end(), group.begin(), group.end());
+                        }
+                    }
+
+                    if (page_ids.size() > 1)
+                        buffer_manager.prefetch(page_ids);
+                    next_level.clear();
+                    for (auto &[run, index] : runs)
+                    {
+                        auto &[node, version, first, last] = run;
+                        auto child = go_to_child(node, version, index);
+                        if (child.has_value())
+                            next_level.push_back(Group{std::get<0>(*child), std::get<1>(*child), first, last});
+                        else
+                            pending.insert(pending.end(), order.begin() + first, order.begin() + last);
+                    }
+                    level.swap(next_level);
+                }
+            }
+
+            // a value replaced since its reference was read is looked up again
+            for (size_t i : large)
+            {
+                auto res = try_read_overflow(ref_of(results[i].value));
+                results[i] = res.has_value() ? std::move(*res) : get(keys[i]);
+            }
+            return results;
+        }
 
         virtual OpStatus set(std::string_view key, std::string_view value)
         {
-            auto [node, parent_map] = go_to_leaf(key);
-            // there is still enough space
-            num_t index = node->find_value_index(key);
-            if (index < node->data_num() && node->key_value_cell(index) == key)
+            return set(key, value, durability);
+        };
+
+        virtual OpStatus remove(std::string_view key)
+        {
+            return remove(key, durability);
+        };
+
+        // a value longer than MAX_INLINE_VALUE is stored in overflow pages, see OverflowRef
+        OpStatus set(std::string_view key, std::string_view value, Durability durability)
+        {
+            if (value.size() > MAX_INLINE_VALUE)
+                return set_overflow(key, value, durability);
+            while (true)
             {
-                // new value length is greater than the old value's
-                // and the node has no enough free space
-                while (node->try_update_value(index, value) == std::nullopt)
+                if (auto res = try_set(key, value); res.has_value())
                 {
-                    id_t node_id = split(node, parent_map);
-                    std::tie(node, parent_map) = go_to_leaf(buffer_manager.get(node_id), key);
+                    buffer_manager.commit(durability);
+                    return std::move(*res);
                 }
-                buffer_manager.insert_into_dirty_pages(node);
             }
-            else
+        }
+
+        OpStatus remove(std::string_view key, Durability durability)
+        {
+            while (true)
             {
-                while (node->try_insert_value(key, value) == std::nullopt)
+                if (auto res = try_remove(key); res.has_value())
                 {
-                    id_t node_id = split(node, parent_map);
-                    std::tie(node, parent_map) = go_to_leaf(buffer_manager.get(node_id), key);
+                    if (res->err == OpError::Ok)
+                        buffer_manager.commit(durability);
+                    return std::move(*res);
+                }
+            }
+        }
+
+        virtual OpStatus write(const WriteBatch &batch)
+        {
+            return write(batch, durability);
+        }
+
+        /*
+        The updates are sorted, and the leaf of each run of them is found by one descent and locked,
+        a leaf that can't hold its run is split before anything is written.
+        The updates are applied as one action while all the leaves are locked, so recovery undoes a partial batch,
+        and the batch is committed once.
+        The leaves are locked from left to right, and the buffer must hold all of them.
+        The large values are written into overflow pages by the action before any leaf is locked.
+        */
+        OpStatus write(const WriteBatch &batch, Durability durability)
+        {
+            using Op = WriteBatch::Op;
+            std::vector<const Op *> ops;
+            for (auto &op : batch.operations())
+            {
+                if (op.type == WriteBatch::OpType::Set && op.value.size() > MAX_VALUE_SIZE)
+                    return OpStatus(OpError::InvalidArgument);
+                ops.push_back(&op);
+            }
+            // the last update of a key wins
+            ranges::stable_sort(ops, ranges::less(), [](const Op *op) { return std::string_view(op->key); });
+            auto last = [&](size_t i) { return i + 1 == ops.size() || ops[i]->key != ops[i + 1]->key; };
+            size_t n = 0;
+            for (size_t i = 0; i < ops.size(); i++)
+            {
+                if (last(i))
+                    ops[n++] = ops[i];
+            }
+            ops.resize(n);
+            if (ops.empty())
+                return OpStatus(OpError::Ok);
+
+            ActionScope action = buffer_manager.begin_action();
+            // the values stored in the cells, the references to the overflow pages of the large values
+            auto overflows = [&](size_t i) { return ops[i]->type == WriteBatch::OpType::Set && ops[i]->value.size() > MAX_INLINE_VALUE; };
+            std::vector<OverflowRef> refs;
+            std::vector<std::string_view> values;
+            refs.reserve(ops.size());
+            for (size_t i = 0; i < ops.size(); i++)
+                values.push_back(overflows(i) ? ref_value(refs.emplace_back(write_overflow(ops[i]->value))) : std::string_view(ops[i]->value));
+
+            // the locked leaf, the first update and the number of the updates in it
+            std::vector<std::tuple<BTreeNode *, size_t, size_t>> leaves;
+            auto unlock_leaves = [&]() {
+                for (auto &[leaf, first, num] : leaves)
+                    leaf->latch.unlock();
+            };
+            for (size_t i = 0; i < ops.size();)
+            {
+                auto res = try_lock_leaf(std::span(ops).subspan(i), std::span(values).subspan(i));
+                if (!res.has_value())
+                    continue;
+                auto [node, num] = *res;
+                if (node == nullptr)
+                {
+                    unlock_leaves();
+                    return OpStatus(OpError::Corruption);
+                }
+                leaves.emplace_back(node, i, num);
+                i += num;
+            }
+
+            int64_t data_num = 0;
+            // the leaves left underfull by the removals and their first keys
+            std::vector<std::tuple<id_t, std::string_view>> underfull;
+            // the overflow pages of the replaced values
+            std::vector<id_t> freed;
+            for (auto &[node, first, num] : leaves)
+            {
+                for (size_t i = first; i < first + num; i++)
+                {
+                    const Op *op = ops[i];
+                    num_t index = node->find_value_index(op->key);
+                    bool found = index < node->data_num() && node->cell_key_equals(index, op->key);
+                    if (found && node->cell_overflows(index))
+                        overflow_pages(ref_of(node->cell_value(index)), freed);
+                    if (op->type == WriteBatch::OpType::Set)
+                    {
+                        found ? node->try_update_value(index, values[i], overflows(i)) : node->try_insert_value(op->key, values[i], overflows(i));
+                        data_num += !found;
+                    }
+                    else if (found)
+                    {
+                        node->remove(index);
+                        data_num--;
+                    }
                 }
                 buffer_manager.insert_into_dirty_pages(node);
-                buffer_manager.metadata.data_num++;
+                if (node->underfull())
+                    underfull.emplace_back(node->page_id, ops[first]->key);
             }
+            BTreeNode *first_freed = buffer_manager.free_pages(freed);
+            action.end();
+            if (first_freed != nullptr)
+                first_freed->latch.unlock();
+            unlock_leaves();
 
+            std::atomic_ref(buffer_manager.metadata.data_num) += data_num;
+            for (auto [node_id, key] : underfull)
+                merge(node_id, key);
+            buffer_manager.commit(durability);
             return OpStatus(OpError::Ok);
+        }
+
+        // the value is the number of the keys in [start_key, end_key), read them by a Cursor
+        virtual OpStatus scan(std::string_view start_key, std::string_view end_key)
+        {
+            size_t n = 0;
+            Cursor cursor(*this, start_key, end_key);
+            for (; cursor.valid(); cursor.next())
+                n++;
+            if (cursor.corrupted())
+                return OpStatus(OpError::Corruption);
+            return OpStatus(OpError::Ok, std::to_string(n));
         };
 
-        virtual OpStatus remove(std::string_view key)
+        /*
+        A forward cursor over the keys in [start_key, end_key), an empty end_key means no upper bound.
+        The keys of a leaf are copied optimistically, then the cursor follows the sibling link to the next leaf,
+        it descends from the root again only if the leaf has been split since it was copied.
+        The next leaves are prefetched while the current one is consumed.
+        The large values of a leaf are read from their overflow pages after the leaf is validated.
+        */
+        class Cursor
         {
-            BTreeNode *node;
-            std::tie(node, std::ignore) = go_to_leaf(key);
+        public:
+            Cursor(BTree &tree, std::string_view start_key, std::string_view end_key = {}, size_t prefetch_num = 8)
+                : tree(tree), end_key(end_key), prefetch_num(prefetch_num), resume_key(start_key)
+            {
+                seek(true);
+            }
 
-            num_t index = node->find_value_index(key);
-            if (index < node->data_num() && key == node->key_value_cell(index))
+            bool valid() const { return pos < entries.size(); }
+            // the scan has stopped at a corrupted page
+            bool corrupted() const { return corrupt; }
+            std::string_view key() const { return std::string_view(data.data() + entries[pos].off, entries[pos].key_len); }
+            std::string_view value() const
             {
-                node->remove(index);
-                buffer_manager.insert_into_dirty_pages(node);
+                if (entries[pos].overflow)
+                    return large_values[entries[pos].large];
+                return std::string_view(data.data() + entries[pos].off + entries[pos].key_len, entries[pos].value_len);
+            }
+            void next()
+            {
+                if (++pos == entries.size())
+                    next_leaf();
             }
-            else
-                return OpStatus(OpError::KeyNotFound);
 
-            buffer_manager.metadata.data_num--;
-            return OpStatus(OpError::Ok);
+        private:
+            struct Entry
+            {
+                size_t off;
+                len_t key_len;
+                len_t value_len;
+                bool overflow = false; // the value in data is the reference, the value is large_values[large]
+                size_t large = 0;
+            };
+
+            // descend to the leaf of resume_key, the parent of the leaf is kept for prefetching
+            // the first key copied is resume_key itself only if inclusive
+            void seek(bool inclusive)
+            {
+                while (true)
+                {
+                    auto [node, version] = descend();
+                    if (!node->is_valid())
+                    {
+                        if (!node->latch.validate(version))
+                            continue;
+                        stop_at_corruption();
+                        return;
+                    }
+                    num_t index = node->find_value_index(resume_key);
+                    if (!inclusive && index < node->data_num() && node->cell_key_equals(index, resume_key))
+                        index++;
+                    if (copy(node, version, index))
+                    {
+                        prefetch();
+                        return;
+                    }
+                }
+            }
+            // return the leaf of resume_key and its version, the parent is kept
+            std::tuple<BTreeNode *, uint64_t> descend()
+            {
+                while (true)
+                {
+                    auto res = tree.read_root();
+                    parent = nullptr;
+                    while (res.has_value() && std::get<0>(*res)->is_valid() && std::get<0>(*res)->type() == CellType::KeyCell)
+                    {
+                        std::tie(parent, parent_version) = *res;
+                        res = tree.go_to_child(parent, parent_version, resume_key);
+                    }
+                    if (res.has_value())
+                        return *res;
+                }
+            }
+            // copy the keys from the index, return false if the version is invalid
+            bool copy(BTreeNode *node, uint64_t version, num_t index)
+            {
+                pos = 0;
+                entries.clear();
+                data.clear();
+                bool at_end = false;
+                std::string_view prefix = node->prefix();
+                for (num_t i = index; i < std::min(node->data_num(), MAX_CELL_NUM); i++)
+                {
+                    // the full key is the prefix of the leaf and the suffix in the cell
+                    size_t off = data.size();
+                    std::string_view suffix = node->cell_suffix(i);
+                    data.insert(data.end(), prefix.begin(), prefix.end());
+                    data.insert(data.end(), suffix.begin(), suffix.end());
+                    if (!end_key.empty() && std::string_view(data.data() + off, data.size() - off) >= end_key)
+                    {
+                        data.resize(off);
+                        at_end = true;
+                        break;
+                    }
+
+                    std::string_view value = node->cell_value(i);
+                    entries.push_back(Entry{off, len_t(data.size() - off), len_t(value.size()), node->cell_overflows(i)});
+                    data.insert(data.end(), value.begin(), value.end());
+                }
+                id_t next_id = node->next_leaf();
+                std::string_view upper = node->upper_fence();
+                upper_copy.assign(upper.begin(), upper.end());
+                if (!node->latch.validate(version))
+                    return false;
+
+                // the leaf is copied again if a large value has been replaced since then
+                large_values.clear();
+                for (Entry &entry : entries)
+                {
+                    if (!entry.overflow)
+                        continue;
+                    auto res = tree.try_read_overflow(ref_of(std::string_view(data.data() + entry.off + entry.key_len, entry.value_len)));
+                    if (!res.has_value())
+                        return false;
+                    if (res->err != OpError::Ok)
+                    {
+                        stop_at_corruption();
+                        return true;
+                    }
+                    entry.large = large_values.size();
+                    large_values.push_back(std::move(res->value));
+                }
+
+                leaf_id = node->page_id;
+                leaf_upper.swap(upper_copy);
+                this->next_id = at_end ? INVALID_PAGE_ID : next_id;
+                if (!entries.empty())
+                    resume_key = std::string_view(data.data() + entries.back().off, entries.back().key_len);
+                return true;
+            }
+            void next_leaf()
+            {
+                while (!valid() && next_id != INVALID_PAGE_ID)
+                {
+                    BTreeNode *node = tree.buffer_manager.get(next_id);
+                    uint64_t version = node->latch.read_lock();
+                    if (node->page_id == next_id && !node->is_valid() && node->latch.validate(version))
+                    {
+                        stop_at_corruption();
+                        return;
+                    }
+                    // the leaf doesn't follow the copied one any more if the boundary between them has moved,
+                    // it's checked by the fences, the pages of the merged leaves are reused
+                    if (node->page_id == next_id && node->type() == CellType::KeyValueCell && node->lower_fence() == leaf_upper &&
+                        copy(node, version, 0))
+                        prefetch();
+                    else
+                        seek(false);
+                }
+            }
+            void stop_at_corruption()
+            {
+                pos = 0;
+                entries.clear();
+                next_id = INVALID_PAGE_ID;
+                corrupt = true;
+            }
+            // keep about prefetch_num leaves after the current one read ahead, they're found in the parent,
+            // so the leaves under the next parent are read on demand until the cursor reaches it
+            void prefetch()
+            {
+                if (ahead > 0)
+                    ahead--;
+                if (prefetch_num == 0 || ahead > prefetch_num / 2)
+                    return;
+
+                for (int retry = 0; retry < 2; retry++)
+                {
+                    if (retry > 0)
+                        descend();
+                    if (parent == nullptr || !parent->latch.validate(parent_version))
+                        continue;
+
+                    // the parent may not hold the current leaf any more
+                    num_t index = parent->find_child_index(resume_key);
+                    id_t ref = parent->child_at(index);
+                    if (tree.buffer_manager.page_id_of(ref) != leaf_id)
+                        continue;
+
+                    // the resident leaves are swizzled
+                    size_t n = 0;
+                    page_ids.clear();
+                    for (num_t i = index + 1; i <= std::min(parent->data_num(), MAX_CELL_NUM) && n < prefetch_num; i++, n++)
+                    {
+                        if (ref = parent->child_at(i); !is_swizzled(ref))
+                            page_ids.push_back(ref);
+                    }
+                    if (!parent->latch.validate(parent_version))
+                        continue;
+
+                    ahead = n;
+                    tree.buffer_manager.prefetch(page_ids);
+                    return;
+                }
+            }
+
+            BTree &tree;
+            std::string end_key;
+            size_t prefetch_num;
+            std::string resume_key; // the last key copied, or the start key
+            id_t leaf_id = INVALID_PAGE_ID;
+            std::string leaf_upper, upper_copy; // the upper fence of the current leaf
+            id_t next_id = INVALID_PAGE_ID; // INVALID_PAGE_ID if the scan is done
+            std::vector<char> data;          // the keys and values of the current leaf
+            std::vector<Entry> entries;
+            std::vector<std::string> large_values;
+            size_t pos = 0;
+            BTreeNode *parent = nullptr; // the parent of the current leaf, it's validated before use
+            uint64_t parent_version = 0;
+            size_t ahead = 0; // the leaves after the current one which have been read ahead
+            std::vector<id_t> page_ids;
+            bool corrupt = false;
         };
 
-        virtual OpStatus scan(std::string_view start_key, std::string_view end_key)
+        /*
+        Read a value chunk by chunk without materializing it, a large value is read from its overflow pages one by one
+        while the next ones are prefetched, a small value is a single chunk.
+        The value may be replaced while it's read, then the reader stops and changed() is true, the chunks read are stale.
+        */
+        class ValueReader
         {
-            return OpStatus(OpError::Internal);
+        public:
+            ValueReader(BTree &tree, std::string_view key, size_t prefetch_num = 8) : tree(tree), prefetch_num(prefetch_num)
+            {
+                std::optional<OpError> res;
+                while (!(res = open(key)).has_value())
+                    ;
+                err = *res;
+                if (err == OpError::Ok && !entries.empty())
+                    next();
+            }
+
+            // Ok, KeyNotFound, or Corruption if a page of the value is corrupted
+            OpError error() const { return err; }
+            // the length of the value
+            uint64_t size() const { return length; }
+            bool valid() const { return has_chunk; }
+            bool changed() const { return replaced; }
+            // it's valid until the next call of next()
+            std::string_view chunk() const { return buf; }
+            void next()
+            {
+                has_chunk = false;
+                buf.clear();
+                if (pos == entries.size())
+                    return;
+
+                // keep about prefetch_num pages after the current one read ahead
+                if (prefetched <= pos + prefetch_num / 2)
+                {
+                    size_t end = std::min(entries.size(), pos + 1 + prefetch_num);
+                    page_ids.clear();
+                    for (size_t i = std::max(prefetched, pos + 1); i < end; i++)
+                        page_ids.push_back(entries[i].page_id);
+                    tree.buffer_manager.prefetch(page_ids);
+                    prefetched = end;
+                }
+
+                auto res = tree.try_read_chunk(entries[pos].page_id, entries[pos].page_lsn, buf);
+                if (!res.has_value())
+                    replaced = true;
+                else if (*res != OpError::Ok)
+                    err = *res;
+                else
+                {
+                    pos++;
+                    has_chunk = true;
+                }
+            }
+
+        private:
+            // find the value of the key, a small value is copied as the only chunk,
+            // std::nullopt if the leaf or the large value changed while being read
+            std::optional<OpError> open(std::string_view key)
+            {
+                auto leaf = tree.go_to_leaf(key);
+                if (!leaf.has_value())
+                    return std::nullopt;
+                auto [node, version] = *leaf;
+                if (!node->is_valid())
+                    return node->latch.validate(version) ? std::optional(OpError::Corruption) : std::nullopt;
+
+                num_t index = node->find_value_index(key);
+                bool found = index < node->data_num() && node->cell_key_equals(index, key);
+                bool overflow = found && node->cell_overflows(index);
+                buf.clear();
+                if (found)
+                    buf = node->cell_value(index);
+                if (!node->latch.validate(version))
+                    return std::nullopt;
+
+                if (!found)
+                    return OpError::KeyNotFound;
+                if (!overflow)
+                {
+                    length = buf.size();
+                    has_chunk = true;
+                    return OpError::Ok;
+                }
+
+                OverflowRef ref = ref_of(buf);
+                std::string index_chunk;
+                auto res = tree.try_read_chunk(ref.index_page, ref.index_lsn, index_chunk);
+                if (res == OpError::Ok)
+                {
+                    length = ref.length;
+                    entries = overflow_entries(index_chunk);
+                }
+                return res;
+            }
+
+            BTree &tree;
+            size_t prefetch_num;
+            OpError err = OpError::Ok;
+            uint64_t length = 0;
+            std::vector<OverflowEntry> entries; // the chunks of a large value
+            size_t pos = 0;                     // the next chunk to read
+            size_t prefetched = 0;              // the chunks before it have been read ahead
+            std::vector<id_t> page_ids;
+            std::string buf; // the current chunk
+            bool has_chunk = false;
+            bool replaced = false;
+        };
+
+        /*
+        Build a new tree from the keys added in ascending order, and swap it in for the current tree by finish().
+        The pages are filled to the fill factor and written directly into the data file in batches,
+        each inner level is built from the separators of the pages below as they're completed.
+        Nothing is logged but the new root and the freeing of the old tree, whose pages are put on the free list
+        in the same action, the new pages are made durable with the metadata,
+        so the tree mustn't be modified before finish() returns, the modifications would be lost with the old tree.
+        */
+        class BulkLoader
+        {
+        public:
+            BulkLoader(BTree &tree, double fill_factor = 0.9)
+                : tree(tree), budget(std::clamp(fill_factor, 0.1, 1.0) * (PAGE_SIZE - PAGE_HEADER_SIZE)) {}
+            BulkLoader(const BulkLoader &) = delete;
+            ~BulkLoader()
+            {
+                for (char *frame : frames)
+                    operator delete(frame, (std::align_val_t)BLOCK_SIZE);
+            }
+
+            // the key must be greater than the previous one
+            OpStatus add(std::string_view key, std::string_view value)
+            {
+                if (finished || (data_num > 0 && key <= last_key))
+                    return OpStatus(OpError::InvalidArgument);
+                if (!push(0, Entry{std::string(key), std::string(value), INVALID_PAGE_ID}))
+                    return OpStatus(OpError::InvalidArgument);
+
+                last_key = key;
+                data_num++;
+                return OpStatus(OpError::Ok);
+            }
+            // write the rest of the pages and swap the new tree in
+            OpStatus finish()
+            {
+                if (finished)
+                    return OpStatus(OpError::InvalidArgument);
+                finished = true;
+
+                // the top level is the one built into a single page
+                id_t root_id = INVALID_PAGE_ID;
+                for (size_t i = 0; root_id == INVALID_PAGE_ID; i++)
+                {
+                    if (i == levels.size())
+                        levels.emplace_back();
+                    // an empty tree is an empty leaf
+                    while (!levels[i].entries.empty() || levels[i].page_num == 0)
+                    {
+                        if (!cut(i, std::nullopt))
+                            return OpStatus(OpError::InvalidArgument);
+                    }
+                    release(levels[i], INVALID_PAGE_ID);
+                    if (levels[i].page_num == 1)
+                        root_id = levels[i].held_id;
+                }
+                write();
+
+                // the old tree is freed with the swap, so the pages are reused by the writes after the load
+                std::vector<id_t> old_pages;
+                tree.tree_pages(tree.buffer_manager.root_id(), old_pages);
+                ActionScope action = tree.buffer_manager.begin_action();
+                tree.buffer_manager.set_root_id(root_id);
+                BTreeNode *first_freed = tree.buffer_manager.free_pages(old_pages);
+                action.end();
+                if (first_freed != nullptr)
+                    first_freed->latch.unlock();
+                std::atomic_ref(tree.metadata().data_num).store(data_num);
+                tree.buffer_manager.commit(Durability::Sync);
+                tree.buffer_manager.checkpoint();
+                return OpStatus(OpError::Ok);
+            }
+
+        private:
+            // a key and a value in a leaf, or a child and its lower fence in an inner node
+            struct Entry
+            {
+                std::string key;
+                std::string value;
+                id_t child;
+            };
+            // the entries are collected until the page is full, then the page is built and held
+            // until the next page of the level is allocated, so the leaves can be linked
+            struct Level
+            {
+                std::vector<Entry> entries;
+                std::string lower;      // the lower fence of the page being collected
+                size_t cell_bytes = 0;  // the cells and the slots of the entries with the full keys
+                num_t cell_num = 0;     // the first child of an inner node has no cell
+                size_t page_num = 0;
+                char *held = nullptr;
+                id_t held_id = INVALID_PAGE_ID;
+                id_t held_prev = INVALID_PAGE_ID;
+            };
+            static constexpr size_t WRITE_BATCH = 64;
+
+            // return false if the entry doesn't fit in an empty page
+            bool push(size_t i, Entry &&entry)
+            {
+                if (i == levels.size())
+                    levels.emplace_back();
+                Level &level = levels[i];
+                bool leaf = i == 0;
+
+                if (!level.entries.empty())
+                {
+                    // the prefix if the page ended before the entry, the fences are about the size of the keys
+                    size_t prefix = ranges::mismatch(level.lower, entry.key).in1 - level.lower.begin();
+                    size_t bytes = level.cell_bytes + cell_bytes(leaf, entry) - (level.cell_num + 1) * prefix +
+                                   level.lower.size() + entry.key.size();
+                    if (bytes > budget && !cut(i, entry.key))
+                        return false;
+                }
+
+                if (leaf || !level.entries.empty())
+                {
+                    level.cell_bytes += cell_bytes(leaf, entry);
+                    level.cell_num++;
+                }
+                level.entries.push_back(std::move(entry));
+                return true;
+            }
+            static size_t cell_bytes(bool leaf, const Entry &entry)
+            {
+                return KEY_CELL_HEADER_SIZE + entry.key.size() + (leaf ? entry.value.size() : 0) + sizeof(Slot);
+            }
+            // build a page of the entries before the next key, or of all of them at the end
+            // the last entries are carried to the next page if the page can't hold them with the actual prefix
+            bool cut(size_t i, std::optional<std::string_view> next_key)
+            {
+                Level &level = levels[i];
+                bool leaf = i == 0;
+                char *frame = take_frame();
+                BTreeNode node(frame, nullptr);
+                // the lower fence of the page is its separator in the parent
+                std::string lower = level.lower;
+                std::vector<Entry> carried;
+                while (true)
+                {
+                    std::string upper;
+                    if (!carried.empty())
+                        upper = leaf ? shortest_separator(level.entries.back().key, carried.back().key) : carried.back().key;
+                    else if (next_key.has_value())
+                        upper = leaf ? shortest_separator(level.entries.back().key, *next_key) : std::string(*next_key);
+
+                    if (build(node, leaf, level, upper))
+                    {
+                        level.lower = std::move(upper);
+                        break;
+                    }
+                    if (level.entries.size() <= 1)
+                    {
+                        free_frames.push_back(frame);
+                        return false;
+                    }
+                    carried.push_back(std::move(level.entries.back()));
+                    level.entries.pop_back();
+                }
+
+                id_t page_id = tree.buffer_manager.allocate_pages(1);
+                release(level, page_id);
+                level.held = frame;
+                level.held_prev = level.held_id;
+                level.held_id = page_id;
+                level.page_num++;
+
+                level.entries.clear();
+                level.cell_bytes = 0;
+                level.cell_num = 0;
+                // the parent is filled in the order of the pages
+                push(i + 1, Entry{std::move(lower), {}, page_id});
+                for (Entry &entry : carried | views::reverse)
+                    push(i, std::move(entry));
+                return true;
+            }
+            bool build(BTreeNode &node, bool leaf, const Level &level, std::string_view upper)
+            {
+                node.format(leaf ? CellType::KeyValueCell : CellType::KeyCell, level.lower, upper);
+                if (leaf)
+                {
+                    for (const Entry &entry : level.entries)
+                        if (!node.append_value(entry.key, entry.value))
+                            return false;
+                    return true;
+                }
+
+                // the child of a separator holds the keys less than it
+                for (size_t j = 1; j < level.entries.size(); j++)
+                    if (!node.append_child(level.entries[j].key, level.entries[j - 1].child))
+                        return false;
+                node.rightmost_child() = level.entries.back().child;
+                return true;
+            }
+            // queue the held page of the level to be written, linked to the next page
+            void release(Level &level, id_t next_id)
+            {
+                if (level.held == nullptr)
+                    return;
+
+                BTreeNode node(level.held, nullptr);
+                if (node.type() == CellType::KeyValueCell)
+                    node.link(level.held_prev, next_id);
+                node.cal_checksum();
+                writes.emplace_back(level.held_id, level.held);
+                level.held = nullptr;
+                if (writes.size() >= WRITE_BATCH)
+                    write();
+            }
+            // the pages are written in the order of their ids mostly, then their frames are reused
+            void write()
+            {
+                tree.buffer_manager.write_pages(writes);
+                for (auto [page_id, frame] : writes)
+                    free_frames.push_back(frame);
+                writes.clear();
+            }
+            char *take_frame()
+            {
+                if (free_frames.empty())
+                    return frames.emplace_back((char *)operator new(PAGE_SIZE, (std::align_val_t)BLOCK_SIZE));
+                char *frame = free_frames.back();
+                free_frames.pop_back();
+                return frame;
+            }
+
+            BTree &tree;
+            size_t budget; // the bytes of a page to fill
+            std::deque<Level> levels; // the leaves first, a level is never moved
+            std::vector<std::tuple<id_t, char *>> writes;
+            std::vector<char *> frames; // all of the frames
+            std::vector<char *> free_frames;
+            std::string last_key;
+            uint64_t data_num = 0;
+            bool finished = false;
         };
 
         Metadata &metadata() { return buffer_manager.metadata; }
+        // the number of levels, all leaves are at the same depth
+        size_t height()
+        {
+            while (true)
+            {
+                size_t levels = 1;
+                auto res = read_root();
+                while (res.has_value() && std::get<0>(*res)->type() == CellType::KeyCell)
+                {
+                    res = go_to_child(std::get<0>(*res), std::get<1>(*res), "");
+                    levels++;
+                }
+                if (res.has_value())
+                    return levels;
+            }
+        }
+        BufferStats buffer_stats() { return buffer_manager.buffer_stats(); }
+        void reset_buffer_stats() { buffer_manager.reset_buffer_stats(); }
+        // the swizzled references are kept if it's disabled
+        void set_swizzling(bool enabled) { swizzling = enabled; }
+        void checkpoint() { buffer_manager.checkpoint(); }
+        // the durability of set() and remove() without one
+        void set_durability(Durability durability) { this->durability = durability; }
+        // how long a GroupSync leader waits for other committers
+        void set_group_commit_delay(std::chrono::microseconds delay) { buffer_manager.set_group_commit_delay(delay); }
+        void set_writer_options(const WriterOptions &options) { buffer_manager.set_writer_options(options); }
+        // call it before open()
+        void set_log_segment_size(lsn_t size) { buffer_manager.set_log_segment_size(size); }
+        size_t log_segment_num() { return buffer_manager.log_segment_num(); }
 
     private:
-        // BTree operations
-        // return the highest effected node id
-        id_t split(BTreeNode *node, std::unordered_map<uint32_t, uint32_t> &parent_map)
+        // all try_* methods return std::nullopt if the operation should restart
+
+        std::optional<OpStatus> try_get(std::string_view key)
+        {
+            auto leaf = go_to_leaf(key);
+            if (!leaf.has_value())
+                return std::nullopt;
+            auto [node, version] = *leaf;
+            if (!node->is_valid())
+                return node->latch.validate(version) ? std::optional(OpStatus(OpError::Corruption)) : std::nullopt;
+
+            num_t index = node->find_value_index(key);
+            bool found = index < node->data_num() && node->cell_key_equals(index, key);
+            bool overflow = found && node->cell_overflows(index);
+            std::string value;
+            if (found)
+                value = node->cell_value(index);
+
+            if (!node->latch.validate(version))
+                return std::nullopt;
+
+            if (!found)
+                return OpStatus(OpError::KeyNotFound);
+            if (overflow)
+                return try_read_overflow(ref_of(value));
+            return OpStatus(OpError::Ok, std::move(value));
+        }
+
+        std::optional<OpStatus> try_get(std::string_view key, PinnedValue &value)
         {
-            buffer_manager.pin(node->page_id);
+            auto leaf = go_to_leaf(key);
+            if (!leaf.has_value())
+                return std::nullopt;
+            auto [node, version] = *leaf;
+            if (!node->is_valid())
+                return node->latch.validate(version) ? std::optional(OpStatus(OpError::Corruption)) : std::nullopt;
+
+            num_t index = node->find_value_index(key);
+            bool found = index < node->data_num() && node->cell_key_equals(index, key);
+            bool overflow = found && node->cell_overflows(index);
+            std::string_view cell = found ? node->cell_value(index) : std::string_view();
+            OverflowRef ref = overflow ? ref_of(cell) : OverflowRef{};
+
+            if (!found || overflow)
+            {
+                if (!node->latch.validate(version))
+                    return std::nullopt;
+                if (!found)
+                    return OpStatus(OpError::KeyNotFound);
 
+                auto res = try_read_overflow(ref);
+                if (res.has_value() && res->err == OpError::Ok)
+                    value.assign(std::move(res->value));
+                return res.has_value() ? std::optional(OpStatus(res->err)) : std::nullopt;
+            }
+
+            // the cell hasn't been modified since the version if it's still valid after pinning
+            buffer_manager.pin(node);
+            if (!node->latch.validate(version))
+            {
+                buffer_manager.unpin(node);
+                return std::nullopt;
+            }
+            value.pin(cell, [](void *manager, void *node) { ((BufferManager *)manager)->unpin((BTreeNode *)node); }, &buffer_manager, node);
+            return OpStatus(OpError::Ok);
+        }
+
+        // the value is an OverflowRef if the action writing its overflow pages is given, the action ends with the update
+        std::optional<OpStatus> try_set(std::string_view key, std::string_view value, ActionScope *overflow = nullptr)
+        {
+            auto leaf = go_to_leaf(key);
+            if (!leaf.has_value())
+                return std::nullopt;
+            auto [node, version] = *leaf;
+            if (!node->is_valid())
+                return node->latch.validate(version) ? std::optional(OpStatus(OpError::Corruption)) : std::nullopt;
+
+            if (!node->latch.upgrade(version) || (node = buffer_manager.copy_on_write(node)) == nullptr)
+                return std::nullopt;
+
+            num_t index = node->find_value_index(key);
+            bool found = index < node->data_num() && node->cell_key_equals(index, key);
+            std::optional<OverflowRef> old_ref;
+            if (found && node->cell_overflows(index))
+                old_ref = ref_of(node->cell_value(index));
+            auto update = [&]() {
+                return (found ? node->try_update_value(index, value, overflow != nullptr) : node->try_insert_value(key, value, overflow != nullptr)).has_value();
+            };
+
+            // the overflow pages of the old value are freed by the same action as the update
+            std::vector<id_t> freed;
+            BTreeNode *first_freed = nullptr;
+            bool updated;
+            if (old_ref.has_value() && overflow == nullptr)
+            {
+                ActionScope action = buffer_manager.begin_action();
+                if ((updated = update()))
+                {
+                    overflow_pages(*old_ref, freed);
+                    first_freed = buffer_manager.free_pages(freed);
+                    action.end();
+                }
+            }
+            else if ((updated = update()))
+            {
+                if (old_ref.has_value())
+                {
+                    overflow_pages(*old_ref, freed);
+                    first_freed = buffer_manager.free_pages(freed);
+                }
+                if (overflow != nullptr)
+                    overflow->end();
+            }
+
+            // the node has no enough free space
+            if (!updated)
+            {
+                id_t node_id = node->page_id;
+                node->latch.unlock();
+                split(node_id, key);
+                return std::nullopt;
+            }
+
+            buffer_manager.insert_into_dirty_pages(node);
+            if (first_freed != nullptr)
+                first_freed->latch.unlock();
+            node->latch.unlock();
+
+            if (!found)
+                std::atomic_ref(buffer_manager.metadata.data_num)++;
+            return OpStatus(OpError::Ok);
+        }
+
+        std::optional<OpStatus> try_remove(std::string_view key)
+        {
+            auto leaf = go_to_leaf(key);
+            if (!leaf.has_value())
+                return std::nullopt;
+            auto [node, version] = *leaf;
+            if (!node->is_valid())
+                return node->latch.validate(version) ? std::optional(OpStatus(OpError::Corruption)) : std::nullopt;
+
+            if (!node->latch.upgrade(version) || (node = buffer_manager.copy_on_write(node)) == nullptr)
+                return std::nullopt;
+
+            num_t index = node->find_value_index(key);
+            if (index >= node->data_num() || !node->cell_key_equals(index, key))
+            {
+                node->latch.unlock();
+                return OpStatus(OpError::KeyNotFound);
+            }
+
+            // the overflow pages of the value are freed by the same action as the removal
+            BTreeNode *first_freed = nullptr;
+            if (node->cell_overflows(index))
+            {
+                std::vector<id_t> freed;
+                overflow_pages(ref_of(node->cell_value(index)), freed);
+                ActionScope action = buffer_manager.begin_action();
+                node->remove(index);
+                first_freed = buffer_manager.free_pages(freed);
+                action.end();
+            }
+            else
+                node->remove(index);
+            buffer_manager.insert_into_dirty_pages(node);
             id_t node_id = node->page_id;
-            id_t sibling_id = buffer_manager.allocate_page(node->type());
+            bool underfull = node->underfull();
+            if (first_freed != nullptr)
+                first_freed->latch.unlock();
+            node->latch.unlock();
 
-            buffer_manager.pin(sibling_id);
-            BTreeNode *sibling = buffer_manager.get(sibling_id);
+            std::atomic_ref(buffer_manager.metadata.data_num)--;
+            if (underfull)
+                merge(node_id, key);
+            return OpStatus(OpError::Ok);
+        }
 
-            num_t n = node->data_num();
-            std::string_view key;
-            uint32_t index = n / 2 + 1;
-            for (auto i : iota(index, n))
+        // lock the leaf of the first update, return it and the number of the updates in its fences,
+        // or a null leaf if it's corrupted, it's split first if it can't hold the values of the updates
+        std::optional<std::tuple<BTreeNode *, size_t>> try_lock_leaf(std::span<const WriteBatch::Op *const> ops, std::span<const std::string_view> values)
+        {
+            auto leaf = go_to_leaf(ops[0]->key);
+            if (!leaf.has_value())
+                return std::nullopt;
+            auto [node, version] = *leaf;
+            if (!node->is_valid())
+                return node->latch.validate(version) ? std::optional(std::make_tuple((BTreeNode *)nullptr, size_t(0))) : std::nullopt;
+
+            if (!node->latch.upgrade(version) || (node = buffer_manager.copy_on_write(node)) == nullptr)
+                return std::nullopt;
+
+            std::string_view upper = node->upper_fence();
+            size_t n = 0, cells_size = 0;
+            num_t slot_num = 0;
+            for (; n < ops.size() && (upper.empty() || ops[n]->key < upper); n++)
+            {
+                if (ops[n]->type == WriteBatch::OpType::Remove)
+                    continue;
+                // an updated value may not reuse its cell, the removed cells are not counted either
+                cells_size += node->kvcell_size(ops[n]->key, values[n]);
+                num_t index = node->find_value_index(ops[n]->key);
+                slot_num += index >= node->data_num() || !node->cell_key_equals(index, ops[n]->key);
+            }
+            if (node->reserve(cells_size, slot_num))
+                return std::make_tuple(node, n);
+
+            id_t node_id = node->page_id;
+            num_t data_num = node->data_num();
+            node->latch.unlock();
+            // the cells of a leaf too small to split are split by the separator of the middle updates
+            if (data_num < 2 && n > 1)
+                split(node_id, ops[0]->key, shortest_separator(ops[n / 2 - 1]->key, ops[n / 2]->key));
+            else
+                split(node_id, ops[0]->key);
+            return std::nullopt;
+        }
+
+        // the large value is written into overflow pages first, then its reference is set by the same action
+        OpStatus set_overflow(std::string_view key, std::string_view value, Durability durability)
+        {
+            if (value.size() > MAX_VALUE_SIZE)
+                return OpStatus(OpError::InvalidArgument);
+
+            ActionScope action = buffer_manager.begin_action();
+            OverflowRef ref = write_overflow(value);
+            while (true)
+            {
+                if (auto res = try_set(key, ref_value(ref), &action); res.has_value())
+                {
+                    buffer_manager.commit(durability);
+                    return std::move(*res);
+                }
+            }
+        }
+
+        // overflow pages
+        static std::string_view ref_value(const OverflowRef &ref) { return std::string_view((const char *)&ref, sizeof(ref)); }
+        // the value may be read optimistically, it's validated before the reference is used
+        static OverflowRef ref_of(std::string_view value)
+        {
+            OverflowRef ref{};
+            std::memcpy(&ref, value.data(), std::min(value.size(), sizeof(ref)));
+            return ref;
+        }
+        static std::vector<OverflowEntry> overflow_entries(std::string_view index)
+        {
+            std::vector<OverflowEntry> entries(index.size() / sizeof(OverflowEntry));
+            std::memcpy(entries.data(), index.data(), entries.size() * sizeof(OverflowEntry));
+            return entries;
+        }
+        // write the chunks of the value and their index as a part of the caller's action, return the reference,
+        // the pages are unreachable until the reference is stored, so they're unlocked once written
+        OverflowRef write_overflow(std::string_view value)
+        {
+            std::vector<OverflowEntry> entries;
+            for (size_t off = 0; off < value.size(); off += OVERFLOW_CAPACITY)
+                entries.push_back(write_chunk(value.substr(off, OVERFLOW_CAPACITY)));
+            OverflowEntry index = write_chunk(std::string_view((const char *)entries.data(), entries.size() * sizeof(OverflowEntry)));
+            return OverflowRef{value.size(), index.page_lsn, index.page_id, num_t(entries.size())};
+        }
+        OverflowEntry write_chunk(std::string_view chunk)
+        {
+            BTreeNode *node = buffer_manager.new_page(buffer_manager.take_frame(), CellType::Overflow);
+            node->write_chunk(chunk);
+            buffer_manager.insert_into_dirty_pages(node);
+            OverflowEntry entry{node->page_lsn(), node->page_id, len_t(chunk.size())};
+            node->latch.unlock();
+            return entry;
+        }
+        // append the chunk of the page at the page lsn to the buffer,
+        // std::nullopt if the page has been freed or reused since then, the value has been replaced
+        std::optional<OpError> try_read_chunk(id_t page_id, lsn_t page_lsn, std::string &buf)
+        {
+            size_t size = buf.size();
+            while (true)
             {
+                BTreeNode *node = buffer_manager.get(page_id);
+                uint64_t version = node->latch.read_lock();
+                if (node->page_id != page_id)
+                    continue;
+
+                bool valid = node->is_valid(), held = node->page_lsn() == page_lsn && node->type() == CellType::Overflow;
+                if (valid && held)
+                    buf.append(node->chunk());
+                if (!node->latch.validate(version))
+                {
+                    buf.resize(size);
+                    continue;
+                }
+
+                if (!valid)
+                    return OpError::Corruption;
+                if (!held)
+                    return std::nullopt;
+                return OpError::Ok;
+            }
+        }
+        // read the large value of the reference, the data pages are read in parallel,
+        // std::nullopt if the value has been replaced since the reference was read
+        std::optional<OpStatus> try_read_overflow(const OverflowRef &ref)
+        {
+            std::string index, value;
+            auto err = try_read_chunk(ref.index_page, ref.index_lsn, index);
+            if (!err.has_value() || *err != OpError::Ok)
+                return err.has_value() ? std::optional(OpStatus(*err)) : std::nullopt;
+
+            std::vector<OverflowEntry> entries = overflow_entries(index);
+            std::vector<id_t> page_ids;
+            for (auto &entry : entries)
+                page_ids.push_back(entry.page_id);
+            buffer_manager.prefetch(page_ids);
+
+            value.reserve(ref.length);
+            for (auto &entry : entries)
+            {
+                err = try_read_chunk(entry.page_id, entry.page_lsn, value);
+                if (!err.has_value() || *err != OpError::Ok)
+                    return err.has_value() ? std::optional(OpStatus(*err)) : std::nullopt;
+            }
+            return OpStatus(OpError::Ok, std::move(value));
+        }
+        // collect the pages of the large value to free them,
+        // the caller holds the latch of the leaf referencing it, so the pages still hold it
+        void overflow_pages(const OverflowRef &ref, std::vector<id_t> &page_ids)
+        {
+            std::string index;
+            try_read_chunk(ref.index_page, ref.index_lsn, index);
+            page_ids.push_back(ref.index_page);
+            for (auto &entry : overflow_entries(index))
+                page_ids.push_back(entry.page_id);
+        }
+
+        // collect the pages of the subtree and of its large values, nobody may modify the subtree meanwhile
+        void tree_pages(id_t root_id, std::vector<id_t> &page_ids)
+        {
+            std::vector<id_t> stack{root_id};
+            while (!stack.empty())
+            {
+                id_t page_id = stack.back();
+                stack.pop_back();
+                page_ids.push_back(page_id);
+                BTreeNode *node = buffer_manager.lock_page(page_id);
                 if (node->type() == CellType::KeyCell)
                 {
-                    KeyCell kcell(node->key_cell(index));
-                    if (i == index)
-                        key = kcell.key_str();
-                    else
-                        sibling->try_insert_child(kcell.key_str(), kcell.child());
+                    for (num_t i = 0; i <= node->data_num(); i++)
+                        stack.push_back(buffer_manager.page_id_of(node->child_at(i)));
                 }
                 else
                 {
-                    KeyValueCell kvcell(node->key_value_cell(index));
-                    sibling->try_insert_value(kvcell.key_str(), kvcell.value_str());
-                    if (i == index)
-                        key = kvcell.key_str();
+                    for (num_t i = 0; i < node->data_num(); i++)
+                        if (node->cell_overflows(i))
+                            overflow_pages(ref_of(node->cell_value(i)), page_ids);
                 }
-                node->remove(index);
+                node->latch.unlock();
+            }
+        }
+
+        // BTree operations
+
+        // split the node on the path of the key,
+        // it's done if the node is not on the path any more (split by others).
+        // a leaf is split at the middle cell, or by the separator in its fences if one is given
+        void split(id_t node_id, std::string_view key, std::string_view separator = {})
+        {
+            while (true)
+            {
+                auto res = try_split(node_id, key, separator);
+                if (!res.has_value())
+                    continue;
+                if (*res == node_id)
+                    return;
+
+                // the parent has no enough space, split it first
+                split(*res, key);
+            }
+        }
+        // return node_id if done, or the parent id if the parent should be split first
+        std::optional<id_t> try_split(id_t node_id, std::string_view key, std::string_view separator = {})
+        {
+            BTreeNode *parent = nullptr, *node;
+            uint64_t parent_version = 0, version;
+
+            auto root = read_root();
+            if (!root.has_value())
+                return std::nullopt;
+            std::tie(node, version) = *root;
+
+            while (node->page_id != node_id)
+            {
+                // the operation retrying the split finds the corrupted page
+                if (!node->is_valid() || node->type() != CellType::KeyCell)
+                    return node_id;
+
+                auto child = go_to_child(node, version, key);
+                if (!child.has_value())
+                    return std::nullopt;
+
+                parent = node;
+                parent_version = version;
+                std::tie(node, version) = *child;
+            }
+
+            // the next leaf links back to the sibling, it's read before taking the frames, which may evict it
+            BTreeNode *next = nullptr;
+            uint64_t next_version = 0;
+            if (node->type() == CellType::KeyValueCell)
+            {
+                id_t next_id = node->next_leaf();
+                if (!node->latch.validate(version))
+                    return std::nullopt;
+                if (next_id != INVALID_PAGE_ID)
+                {
+                    next = buffer_manager.get(next_id);
+                    next_version = next->latch.read_lock();
+                    if (next->page_id != next_id)
+                        return std::nullopt;
+                }
+            }
+
+            // take the frames of the new pages before locking, see BufferManager::take_frame()
+            BTreeNode *frames[2] = {buffer_manager.take_frame(), parent == nullptr ? buffer_manager.take_frame() : nullptr};
+            auto put_frames = [&]() {
+                for (BTreeNode *frame : frames)
+                {
+                    if (frame != nullptr)
+                        buffer_manager.put_frame(frame);
+                }
+            };
+
+            if (parent != nullptr && !parent->latch.upgrade(parent_version))
+            {
+                put_frames();
+                return std::nullopt;
+            }
+            // the next leaf only has its links updated, they're not pinned
+            if (!node->latch.upgrade(version) || (node = buffer_manager.copy_on_write(node, parent)) == nullptr)
+            {
+                if (parent != nullptr)
+                    parent->latch.unlock();
+                put_frames();
+                return std::nullopt;
             }
+            if (next != nullptr && !next->latch.upgrade(next_version))
+            {
+                node->latch.unlock();
+                if (parent != nullptr)
+                    parent->latch.unlock();
+                put_frames();
+                return std::nullopt;
+            }
+
+            auto unlock = [&]() {
+                if (next != nullptr)
+                    next->latch.unlock();
+                node->latch.unlock();
+                if (parent != nullptr)
+                    parent->latch.unlock();
+            };
 
-            bool is_root = false;
-            id_t parent_id = 0;
-            if (auto it = parent_map.find(node_id); it != parent_map.end())
-                parent_id = it->second;
+            num_t n = node->data_num();
+            bool by_separator = !separator.empty() && node->type() == CellType::KeyValueCell;
+            // can't split, or the separator is out of the fences after the node was split by others
+            if (by_separator ? separator <= node->lower_fence() || (!node->upper_fence().empty() && separator >= node->upper_fence())
+                             : n < 2)
+            {
+                unlock();
+                put_frames();
+                return node_id;
+            }
+
+            // the node keeps the lower half, and the sibling takes the upper half
+            num_t index = by_separator ? node->find_value_index(separator) : n / 2;
+            std::string sep_key = by_separator                          ? std::string(separator)
+                                  : node->type() == CellType::KeyCell ? node->cell_key(index)
+                                                                      : shortest_separator(node->cell_key(index - 1), node->cell_key(index));
+            if (parent != nullptr && !parent->can_hold_kcell(sep_key))
+            {
+                id_t parent_id = parent->page_id;
+                unlock();
+                put_frames();
+                return parent_id;
+            }
+
+            // the records of the split are undone together if it's interrupted by a crash
+            ActionScope action = buffer_manager.begin_action();
+            BTreeNode *sibling = buffer_manager.new_page(frames[0], node->type());
+            id_t sibling_id = sibling->page_id;
+
+            // the node covers the keys less than the separator, and the sibling covers the others
+            sibling->set_fences(sep_key, node->upper_fence());
+            if (node->type() == CellType::KeyCell)
+            {
+                // the moved children would keep the node as their parent
+                buffer_manager.unswizzle_children(node);
+
+                // the child of the separator becomes the rightmost child of the node
+                for (auto i : iota(index + 1, n))
+                    sibling->try_insert_child(node->cell_key(i), node->cell_child(i));
+                sibling->try_update_child(sibling->data_num(), node->rightmost_child());
+                node->try_update_child(node->data_num(), node->cell_child(index));
+            }
             else
             {
-                is_root = true;
-                parent_id = buffer_manager.allocate_page(CellType::KeyCell);
-                buffer_manager.metadata.root_id = parent_id;
+                for (auto i : iota(index, n))
+                    sibling->try_insert_value(node->cell_key(i), node->cell_value(i), node->cell_overflows(i));
+
+                // the sibling is linked between the node and the next leaf
+                sibling->set_links(node_id, node->next_leaf());
+                node->set_links(node->prev_leaf(), sibling_id);
+                if (next != nullptr)
+                {
+                    next->set_links(sibling_id, next->next_leaf());
+                    buffer_manager.insert_into_dirty_pages(next);
+                }
             }
+            for (auto i : iota(index, n) | views::reverse)
+                node->remove(i);
+            node->set_fences(node->lower_fence(), sep_key);
 
-            buffer_manager.pin(parent_id);
-            BTreeNode *parent = buffer_manager.get(parent_id);
-            if (is_root)
-                parent->rightmost_child() = sibling_id;
+            BTreeNode *new_root = nullptr;
+            if (parent == nullptr)
+            {
+                new_root = buffer_manager.new_page(frames[1], CellType::KeyCell);
+                new_root->try_update_child(0, sibling_id);
+                new_root->try_insert_child(sep_key, node_id);
+                buffer_manager.set_root_id(new_root->page_id);
+                buffer_manager.insert_into_dirty_pages(new_root);
+            }
             else
             {
-                if (node_id == parent->rightmost_child())
-                    parent->rightmost_child() = sibling_id;
-                else
-                    parent->try_update_child(parent->find_child_index(key), sibling_id);
+                // the slot pointing to the node now points to the sibling,
+                // its before image is logged as a page id
+                buffer_manager.unswizzle_children(parent);
+                parent->try_update_child(parent->find_child_index(key), sibling_id);
+                parent->try_insert_child(sep_key, node_id);
+                buffer_manager.insert_into_dirty_pages(parent);
             }
 
-            buffer_manager.unpin(node_id);
-            buffer_manager.unpin(sibling_id);
             buffer_manager.insert_into_dirty_pages(node);
             buffer_manager.insert_into_dirty_pages(sibling);
+            action.end();
+            if (new_root != nullptr)
+                new_root->latch.unlock();
+            sibling->latch.unlock();
+            unlock();
+
+            return node_id;
+        }
+
+        // merge the underfull node on the path of the key with a sibling, or move cells from the sibling to it,
+        // it's done if the node is not underfull or not on the path any more.
+        // the merged node or the parent may be underfull after a merge, and a root left with a single child is replaced by the child
+        void merge(id_t node_id, std::string_view key)
+        {
+            while (node_id != INVALID_PAGE_ID)
+            {
+                if (auto res = try_merge(node_id, key); res.has_value())
+                    node_id = *res;
+            }
+        }
+        // return the id of the node on the path of the key to merge next, or INVALID_PAGE_ID if done
+        std::optional<id_t> try_merge(id_t node_id, std::string_view key)
+        {
+            BTreeNode *parent = nullptr, *node;
+            uint64_t parent_version = 0, version;
+
+            auto root = read_root();
+            if (!root.has_value())
+                return std::nullopt;
+            std::tie(node, version) = *root;
+
+            while (node->page_id != node_id)
+            {
+                if (!node->is_valid() || node->type() != CellType::KeyCell)
+                    return INVALID_PAGE_ID;
+
+                auto child = go_to_child(node, version, key);
+                if (!child.has_value())
+                    return std::nullopt;
+
+                parent = node;
+                parent_version = version;
+                std::tie(node, version) = *child;
+            }
+            if (!node->is_valid())
+                return INVALID_PAGE_ID;
+            if (parent == nullptr)
+                return try_collapse_root(node, version);
+
+            // the node and its sibling under the parent, the separator between them is the cell sep of the parent
+            bool underfull = node->underfull();
+            num_t index = parent->find_child_index(key), n = parent->data_num();
+            if (!parent->latch.validate(parent_version))
+                return std::nullopt;
+            if (!underfull)
+                return INVALID_PAGE_ID;
+            // the node has no sibling under the parent, the parent is merged first
+            if (n == 0)
+                return parent->page_id;
+
+            num_t sep = index < n ? index : index - 1;
+            auto sibling = go_to_child(parent, parent_version, index < n ? sep + 1 : sep);
+            if (!sibling.has_value())
+                return std::nullopt;
+            auto [left, left_version] = index < n ? std::make_tuple(node, version) : *sibling;
+            auto [right, right_version] = index < n ? *sibling : std::make_tuple(node, version);
+            if (!std::get<0>(*sibling)->is_valid())
+                return INVALID_PAGE_ID;
+
+            // the next leaf links back to the right one
+            BTreeNode *next = nullptr;
+            uint64_t next_version = 0;
+            if (node->type() == CellType::KeyValueCell)
+            {
+                id_t next_id = right->next_leaf();
+                if (!right->latch.validate(right_version))
+                    return std::nullopt;
+                if (next_id != INVALID_PAGE_ID)
+                {
+                    next = buffer_manager.get(next_id);
+                    next_version = next->latch.read_lock();
+                    if (next->page_id != next_id)
+                        return std::nullopt;
+                }
+            }
+
+            std::tuple<BTreeNode *, uint64_t> latches[] = {{parent, parent_version}, {left, left_version}, {right, right_version}, {next, next_version}};
+            size_t locked = 0;
+            auto unlock = [&]() {
+                for (auto [latched, _] : std::span(latches, locked) | views::reverse)
+                {
+                    if (latched != nullptr)
+                        latched->latch.unlock();
+                }
+            };
+            for (auto &[latched, latched_version] : latches)
+            {
+                if (latched != nullptr && !latched->latch.upgrade(latched_version))
+                {
+                    unlock();
+                    return std::nullopt;
+                }
+                // the next leaf only has its links updated, they're not pinned
+                if (locked == 1 || locked == 2)
+                {
+                    if ((latched = buffer_manager.copy_on_write(latched, parent)) == nullptr)
+                    {
+                        unlock();
+                        return std::nullopt;
+                    }
+                    (locked == 1 ? left : right) = latched;
+                }
+                locked++;
+            }
 
-            if (parent->try_insert_child(key, node_id) == std::nullopt)
+            bool leaf = left->type() == CellType::KeyValueCell;
+            std::string sep_key = parent->cell_key(sep);
+            // the left node would cover the keys of both, the separator moves down into an inner node
+            size_t prefix_len = BTreeNode::prefix_len_of(left->lower_fence(), right->upper_fence());
+            size_t merged = left->cells_bytes(0, left->data_num(), prefix_len) + right->cells_bytes(0, right->data_num(), prefix_len) +
+                            left->lower_fence().size() + right->upper_fence().size() +
+                            (leaf ? 0 : KEY_CELL_HEADER_SIZE + sep_key.size() - prefix_len + sizeof(Slot));
+            auto move = merged > MAX_MERGE_FILL && leaf ? plan_move(parent, left, right) : std::nullopt;
+            if (merged > MAX_MERGE_FILL && !move.has_value())
             {
-                uint32_t anc = split(parent, parent_map);
-                buffer_manager.get(parent_id)->try_insert_child(key, node_id);
-                parent->try_insert_child(key, node_id);
-                return anc;
+                unlock();
+                return INVALID_PAGE_ID;
+            }
+
+            // the records of the merge are undone together if it's interrupted by a crash
+            ActionScope action = buffer_manager.begin_action();
+            // the slots of the parent are logged as page ids
+            buffer_manager.unswizzle_children(parent);
+            id_t res = INVALID_PAGE_ID;
+            if (move.has_value())
+            {
+                auto [to_left, k, new_sep] = *move;
+                num_t left_n = left->data_num();
+                if (to_left)
+                {
+                    left->set_fences(left->lower_fence(), new_sep);
+                    for (auto i : iota(num_t(0), k))
+                        left->try_insert_value(right->cell_key(i), right->cell_value(i), right->cell_overflows(i));
+                    for (auto i : iota(num_t(0), k) | views::reverse)
+                        right->remove(i);
+                    right->set_fences(new_sep, right->upper_fence());
+                }
+                else
+                {
+                    right->set_fences(new_sep, right->upper_fence());
+                    for (auto i : iota(left_n - k, left_n))
+                        right->try_insert_value(left->cell_key(i), left->cell_value(i), left->cell_overflows(i));
+                    for (auto i : iota(left_n - k, left_n) | views::reverse)
+                        left->remove(i);
+                    left->set_fences(left->lower_fence(), new_sep);
+                }
+                parent->remove(sep);
+                parent->try_insert_child(new_sep, left->page_id);
+            }
+            else
+            {
+                left->set_fences(left->lower_fence(), right->upper_fence());
+                if (leaf)
+                {
+                    for (auto i : iota(num_t(0), right->data_num()))
+                        left->try_insert_value(right->cell_key(i), right->cell_value(i), right->cell_overflows(i));
+
+                    left->set_links(left->prev_leaf(), right->next_leaf());
+                    if (next != nullptr)
+                    {
+                        next->set_links(left->page_id, next->next_leaf());
+                        buffer_manager.insert_into_dirty_pages(next);
+                    }
+                }
+                else
+                {
+                    // the moved children would keep the right node as their parent
+                    buffer_manager.unswizzle_children(left);
+                    buffer_manager.unswizzle_children(right);
+
+                    // the rightmost child of the left node takes the separator
+                    left->try_insert_child(sep_key, left->rightmost_child());
+                    for (auto i : iota(num_t(0), right->data_num()))
+                        left->try_insert_child(right->cell_key(i), right->cell_child(i));
+                    left->try_update_child(left->data_num(), right->rightmost_child());
+                }
+                for (auto i : iota(num_t(0), right->data_num()) | views::reverse)
+                    right->remove(i);
+
+                // the slot of the right node points to the left one, and the separator is removed with the old slot of the left one
+                parent->try_update_child(sep + 1, left->page_id);
+                parent->remove(sep);
+                buffer_manager.free_page(right);
+                if (left->underfull())
+                    res = left->page_id;
+                else if (parent->underfull())
+                    res = parent->page_id;
             }
 
-            buffer_manager.unpin(parent_id);
             buffer_manager.insert_into_dirty_pages(parent);
-            return parent_id;
+            buffer_manager.insert_into_dirty_pages(left);
+            buffer_manager.insert_into_dirty_pages(right);
+            action.end();
+            unlock();
+
+            return res;
         }
+        // the leaves end up about equally full, the fuller one gives its cells next to the other one,
+        // return the direction, the number of the moved cells and the new separator,
+        // or std::nullopt if the receiver or the parent can't hold them, the caller must hold the latches
+        std::optional<std::tuple<bool, num_t, std::string>> plan_move(BTreeNode *parent, BTreeNode *left, BTreeNode *right)
+        {
+            bool to_left = left->used_space() < right->used_space();
+            BTreeNode *from = to_left ? right : left, *to = to_left ? left : right;
+            size_t give = (from->used_space() - to->used_space()) / 2, moved = 0;
+            num_t n = from->data_num(), k = 0;
+            for (; k + 1 < n && moved < give; k++)
+            {
+                num_t i = to_left ? k : n - 1 - k;
+                moved += from->cells_bytes(i, i + 1, from->prefix().size());
+            }
+            if (k == 0)
+                return std::nullopt;
+
+            std::string sep = to_left ? shortest_separator(right->cell_key(k - 1), right->cell_key(k))
+                                      : shortest_separator(left->cell_key(n - k - 1), left->cell_key(n - k));
+            std::string_view lower = to_left ? left->lower_fence() : sep, upper = to_left ? std::string_view(sep) : right->upper_fence();
+            size_t prefix_len = BTreeNode::prefix_len_of(lower, upper);
+            size_t bytes = to->cells_bytes(0, to->data_num(), prefix_len) +
+                           (to_left ? from->cells_bytes(0, k, prefix_len) : from->cells_bytes(n - k, n, prefix_len)) +
+                           lower.size() + upper.size();
+            if (bytes > PAGE_SIZE - PAGE_HEADER_SIZE || !parent->can_hold_kcell(sep))
+                return std::nullopt;
+            return std::make_tuple(to_left, k, std::move(sep));
+        }
+        // the root of a single child is replaced by the child, return the new root, or INVALID_PAGE_ID if it's kept
+        std::optional<id_t> try_collapse_root(BTreeNode *root, uint64_t version)
+        {
+            bool collapse = root->type() == CellType::KeyCell && root->data_num() == 0;
+            if (!root->latch.validate(version))
+                return std::nullopt;
+            if (!collapse)
+                return INVALID_PAGE_ID;
+            if (!root->latch.upgrade(version))
+                return std::nullopt;
+
+            ActionScope action = buffer_manager.begin_action();
+            id_t child_id = buffer_manager.page_id_of(root->rightmost_child());
+            buffer_manager.set_root_id(child_id);
+            buffer_manager.free_page(root);
+            action.end();
+            root->latch.unlock();
+
+            return child_id;
+        }
+
         // utils
-        std::tuple<BTreeNode *, std::unordered_map<uint32_t, uint32_t>> go_to_leaf(std::string_view key)
+        // suffix truncation, the shortest key greater than the left key and not greater than the right key
+        static std::string shortest_separator(std::string_view left, std::string_view right)
         {
+            size_t n = ranges::mismatch(left, right).in2 - right.begin();
+            return std::string(right.substr(0, n + 1));
+        }
+        std::optional<std::tuple<BTreeNode *, uint64_t>> read_root()
+        {
+            id_t root_id = buffer_manager.root_id();
             BTreeNode *node = buffer_manager.get_root();
-            return go_to_leaf(node, key);
+            uint64_t version = node->latch.read_lock();
+            // the root may be split after root_id was read
+            if (node->page_id != root_id || buffer_manager.root_id() != root_id)
+                return std::nullopt;
+
+            return std::make_tuple(node, version);
         }
-        std::tuple<BTreeNode *, std::unordered_map<uint32_t, uint32_t>> go_to_leaf(BTreeNode *node, std::string_view key)
+        std::optional<std::tuple<BTreeNode *, uint64_t>> go_to_child(BTreeNode *node, uint64_t version, std::string_view key)
         {
-            std::unordered_map<uint32_t, uint32_t> parent_map;
+            return go_to_child(node, version, node->find_child_index(key));
+        }
+        // the child of the index, which is read under the version
+        std::optional<std::tuple<BTreeNode *, uint64_t>> go_to_child(BTreeNode *node, uint64_t version, num_t index)
+        {
+            id_t child_ref = node->child_at(index);
+            if (!node->latch.validate(version))
+                return std::nullopt;
 
-            // node is not a leaf
-            while (node->type() == CellType::KeyCell)
+            // the reference is unswizzled before the child is evicted, which changes the version of the node
+            if (is_swizzled(child_ref))
             {
-                int32_t child = node->find_child(key);
-                parent_map[child] = node->page_id;
+                BTreeNode *child = buffer_manager.frame_of(child_ref);
+                uint64_t child_version = child->latch.read_lock();
+                if (!node->latch.validate(version))
+                    return std::nullopt;
 
-                node = buffer_manager.get(child);
+                if (!child->referenced.load(std::memory_order_relaxed))
+                    child->referenced.store(true, std::memory_order_relaxed);
+                return std::make_tuple(child, child_version);
             }
 
-            return std::make_tuple(node, std::move(parent_map));
+            BTreeNode *child = buffer_manager.get(child_ref);
+            uint64_t child_version = child->latch.read_lock();
+            if (child->page_id != child_ref || !node->latch.validate(version))
+                return std::nullopt;
+
+            if (swizzling && swizzle(node, version, index, child, child_version))
+                return std::nullopt;
+            return std::make_tuple(child, child_version);
+        }
+        // replace the reference to the child by its frame, return true iff both versions have changed
+        bool swizzle(BTreeNode *node, uint64_t version, num_t index, BTreeNode *child, uint64_t child_version)
+        {
+            if (!node->latch.upgrade(version))
+                return false;
+            if (!child->latch.upgrade(child_version))
+            {
+                node->latch.unlock();
+                return true;
+            }
+
+            node->child_slot(index) = buffer_manager.swizzled_ref(child);
+            child->parent = node;
+            child->latch.unlock();
+            node->latch.unlock();
+            return true;
+        }
+        // return the leaf and its version, the leaf is not locked
+        // the descent stops at a corrupted page, which is returned instead
+        std::optional<std::tuple<BTreeNode *, uint64_t>> go_to_leaf(std::string_view key)
+        {
+            auto res = read_root();
+            // node is not a leaf
+            while (res.has_value() && std::get<0>(*res)->is_valid() && std::get<0>(*res)->type() == CellType::KeyCell)
+                res = go_to_child(std::get<0>(*res), std::get<1>(*res), key);
+
+            return res;
         }
 
         BufferManager buffer_manager;
+        bool swizzling = true;
+        Durability durability = Durability::Sync;
     };
 } // namespace cyber
\ No newline at end of file
@@ -1,25 +1,36 @@
 #pragma once
 
 #include <iostream>
-#include <unordered_set>
 #include <unordered_map>
 #include <filesystem>
 #include <thread>
 #include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <span>
+#include <memory>
+#include <utility>
+#include <deque>
+#include <tuple>
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
 
 #include "engines/type.h"
 #include "engines/kv_engine.hpp"
 
 #include "page.hpp"
+#include "page_table.hpp"
+#include "replacer.hpp"
+#include "async_io.hpp"
 
 namespace cyber
 {
     namespace fs = std::filesystem;
 
-    uint64_t file_size(int fd)
+    inline uint64_t file_size(int fd)
     {
         uint64_t offset = lseek64(fd, 0, SEEK_SET);
         uint64_t size = lseek(fd, 0, SEEK_END);
@@ -29,48 +40,115 @@ namespace cyber
 
     struct Metadata
     {
-        id_t root_id;
-        uint32_t node_num;
-        uint64_t data_num;
+        id_t root_id = 0;
+        uint32_t node_num = 0;
+        uint64_t data_num = 0;
+        lsn_t checkpoint_lsn = INVALID_LSN; // the last checkpoint record
+        id_t free_head = INVALID_PAGE_ID;   // the first page of the free list
     };
 
     constexpr size_t METADATA_SIZE = sizeof(Metadata);
 
+    enum class HugePages : uint8_t
+    {
+        None,
+        Transparent, // madvise(MADV_HUGEPAGE)
+        Explicit,    // MAP_HUGETLB, falls back to Transparent if no huge page is reserved
+    };
+
+    constexpr size_t HUGE_PAGE_SIZE = 2 * mb;
+    // a split latches 4 frames at most
+    constexpr size_t MIN_FRAME_NUM = 16;
+
+    // map the memory of the frames, the frames are aligned to the OS page
+    inline char *map_frames(size_t size, HugePages huge_pages)
+    {
+        void *frames = MAP_FAILED;
+        if (huge_pages == HugePages::Explicit)
+            frames = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (frames == MAP_FAILED)
+        {
+            frames = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (frames == MAP_FAILED)
+            {
+                std::cerr << "map frames: " << strerror(errno);
+                exit(-1);
+            }
+            if (huge_pages != HugePages::None)
+                madvise(frames, size, MADV_HUGEPAGE);
+        }
+
+        return (char *)frames;
+    }
+
+    // the background writer trickles the dirty pages out, the oldest first
+    struct WriterOptions
+    {
+        std::chrono::milliseconds interval{100};
+        size_t pages_per_second = 1000; // the I/O budget
+        double max_dirty_ratio = 0.5;    // the pages dirty beyond it are written regardless of the budget
+        std::chrono::seconds checkpoint_interval{60};
+        lsn_t checkpoint_log_size = 64 * mb; // take a checkpoint once the log has grown by it
+    };
+
+    struct BufferStats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        uint64_t prefetches = 0; // the pages read ahead, they're not counted as misses
+
+        double hit_ratio() const { return hits + misses == 0 ? 0 : double(hits) / double(hits + misses); }
+    };
+
     class BufferManager
     {
     public:
         Metadata metadata;
 
         // TODO: modify the default buffer size
-        BufferManager(size_t size = 2 * gb) : buffer_size(size)
+        // the whole buffer is allocated once, a miss reuses a free or evicted frame
+        BufferManager(size_t size = 2 * gb, ReplacementPolicy policy = ReplacementPolicy::TwoQueue,
+                      HugePages huge_pages = HugePages::Transparent, IoBackend io_backend = IoBackend::IoUring)
+            : frame_num(std::max(size / PAGE_SIZE, MIN_FRAME_NUM)),
+              frames_size((frame_num * PAGE_SIZE + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE),
+              frames(map_frames(frames_size, huge_pages)),
+              nodes(std::allocator<BTreeNode>().allocate(frame_num)),
+              buffer_map(frame_num),
+              replacer(make_replacer(policy, nodes, frame_num)),
+              io(make_async_io(io_backend))
         {
-            std::thread(&BufferManager::flush, this).detach();
+            free_nodes.reserve(frame_num);
+            for (size_t i = frame_num; i-- > 0;)
+                free_nodes.push_back(std::construct_at(nodes + i, frames + i * PAGE_SIZE, &wal));
         }
 
         ~BufferManager()
         {
-            offset_t max_wal_end_off = 0;
-            for (BTreeNode *node : dirty_pages)
-            {
-                if (node->wal_end_off() > max_wal_end_off)
-                    max_wal_end_off = node->wal_end_off();
+            for (size_t n = prefetching.load(); n > 0; n = prefetching.load())
+                prefetching.wait(n);
 
-                store_page(node);
+            if (writer.joinable())
+            {
+                writer.request_stop();
+                writer.join();
             }
-            wal.set_trim_off(max_wal_end_off);
 
-            close(data_file);
-
-            fs::path metadata_path = dir / "metadata";
-            int metadata_file = open64(metadata_path.c_str(), O_CREAT | O_WRONLY | O_SYNC, S_IRUSR | S_IWUSR);
-            if (metadata_file == -1)
-                exit(-1);
-            if (pwrite64(metadata_file, &metadata, METADATA_SIZE, 0) == -1)
+            std::vector<BTreeNode *> dirty_nodes;
+            for (BTreeNode &node : std::span(nodes, frame_num))
             {
-                std::cerr << "write metadata_file: " << strerror(errno);
-                exit(-1);
+                if (node.dirty)
+                    dirty_nodes.push_back(&node);
             }
-            close(metadata_file);
+            store_pages(dirty_nodes);
+            // every page has been written, the log is dropped but the lsns go on
+            checkpoint();
+
+            std::destroy_n(nodes, frame_num);
+            std::allocator<BTreeNode>().deallocate(nodes, frame_num);
+            munmap(frames, frames_size);
+
+            close(data_file);
         }
 
         OpStatus open(const char *dir_path)
@@ -110,83 +188,355 @@ namespace cyber
                 exit(-1);
             }
             close(metadata_file);
+            // the pages allocated after the metadata was written
+            metadata.node_num = std::max<uint32_t>(metadata.node_num, file_size(data_file) / PAGE_SIZE);
+
+            recover();
+
+            writer = std::jthread([this](std::stop_token stop) { write_back(stop); });
+            return OpStatus(OpError::Ok);
+        }
 
-            wal.for_each_record([&](const Record &rec) {
-                LogicalRecord *record = (LogicalRecord *)rec.redo;
-                BTreeNode *node = get(rec.page_id);
+        // fuzzy checkpoint, the dirty page table and the active action table are recorded
+        // without writing back or blocking anything, the log is truncated before the minimum recovery lsn
+        // and the first records of the active actions, which may be undone by recovery
+        void checkpoint()
+        {
+            std::lock_guard lock(checkpoint_latch);
 
-                if (record->type == RecordType::Insert)
+            // an action started after it has no record before it
+            lsn_t begin_lsn = wal.next_lsn();
+            std::vector<ActiveActionEntry> action_table;
+            wal.for_each_action([&](id_t action_id, lsn_t first_lsn) {
+                action_table.push_back(ActiveActionEntry{action_id, first_lsn});
+            });
+            std::vector<DirtyPageEntry> dirty_page_table;
+            {
+                std::lock_guard lock(buffer_latch);
+                for (BTreeNode &node : std::span(nodes, frame_num))
                 {
-                    if (node->type() == CellType::KeyCell)
-                    {
-                        id_t *child_id = (id_t *)(record->record + record->key_len);
-                        node->try_insert_child(record->key_string(), *child_id);
-                    }
-                    else
-                    {
-                        len_t value_len = rec.redo_len - record->key_len;
-                        node->try_insert_value(record->key_string(),
-                                               record->value_string(value_len));
-                    }
+                    if (lsn_t rec_lsn = std::atomic_ref(node.rec_lsn).load(std::memory_order_relaxed); rec_lsn != INVALID_LSN)
+                        dirty_page_table.push_back(DirtyPageEntry{node.page_id, rec_lsn});
                 }
-                else if (record->type == RecordType::Update)
+            }
+
+            lsn_t min_rec_lsn = begin_lsn;
+            for (auto &entry : dirty_page_table)
+                min_rec_lsn = std::min(min_rec_lsn, entry.rec_lsn);
+            lsn_t min_lsn = min_rec_lsn;
+            for (auto &entry : action_table)
+                min_lsn = std::min(min_lsn, entry.first_lsn);
+
+            CheckpointHeader header{min_rec_lsn, begin_lsn, action_table.size()};
+            size_t action_bytes = action_table.size() * sizeof(ActiveActionEntry);
+            std::vector<char> value(sizeof(header) + action_bytes + dirty_page_table.size() * sizeof(DirtyPageEntry));
+            std::memcpy(value.data(), &header, sizeof(header));
+            std::memcpy(value.data() + sizeof(header), action_table.data(), action_bytes);
+            std::memcpy(value.data() + sizeof(header) + action_bytes, dirty_page_table.data(),
+                        dirty_page_table.size() * sizeof(DirtyPageEntry));
+            Record *rec = LogicalRecord::new_record(wal.gen_id(), INVALID_PAGE_ID,
+                                                    RecordType::Checkpoint, 0, value.size(),
+                                                    "", value.data());
+            lsn_t checkpoint_lsn = wal.log(*rec);
+            delete[]((char *)rec);
+            wal.flush(wal.next_lsn());
+
+            std::atomic_ref(metadata.checkpoint_lsn).store(checkpoint_lsn);
+            store_metadata();
+            wal.truncate(min_lsn);
+        }
+        void set_writer_options(const WriterOptions &options)
+        {
+            std::lock_guard lock(writer_latch);
+            writer_options = options;
+        }
+
+        // wait for the records logged so far as the durability requires
+        inline void commit(Durability durability) { wal.commit(wal.next_lsn(), durability); }
+        inline void set_group_commit_delay(std::chrono::microseconds delay) { wal.set_group_commit_delay(delay); }
+        // call it before open(), an existing log keeps its segment size
+        inline void set_log_segment_size(lsn_t size) { wal.set_segment_size(size); }
+        inline size_t log_segment_num() { return wal.segment_num(); }
+
+        // node methods
+
+        // the returned node is not latched, it may be evicted and reused for another page at any time,
+        // so check the page_id after locking or reading the version of its latch
+        BTreeNode *get(const id_t page_id)
+        {
+            {
+                std::lock_guard lock(buffer_latch);
+                if (uint32_t i = buffer_map.find(page_id); i != PageTable::NONE)
+                {
+                    stats.hits++;
+                    replacer->access(nodes + i);
+                    return nodes + i;
+                }
+            }
+
+            BTreeNode *node = take_frame();
+            {
+                std::lock_guard lock(buffer_latch);
+                if (uint32_t i = buffer_map.find(page_id); i != PageTable::NONE)
+                {
+                    // another thread has loaded the page
+                    free_frame(node);
+                    return nodes + i;
+                }
+
+                stats.misses++;
+                map_frame(node, page_id);
+            }
+
+            read_page(page_id, node->raw_page());
+            node->reload(page_id);
+            node->latch.unlock();
+
+            return node;
+        }
+        // take a free frame, or evict one, the frame is locked exclusively
+        // a thread holding latches should take its frames in advance,
+        // a node can't be evicted if the parent holding its swizzled reference is locked
+        // return nullptr rather than waiting if every frame is latched or pinned and wait is false
+        BTreeNode *take_frame(bool wait = true)
+        {
+            BTreeNode *node = nullptr;
+            bool dirty = false;
+            {
+                std::unique_lock lock(buffer_latch);
+                while (true)
                 {
-                    num_t *index = (num_t *)(record->record);
-                    if (node->type() == CellType::KeyCell)
+                    if (!free_nodes.empty())
                     {
-                        id_t *child_id = (id_t *)(record->record + record->key_len);
-                        node->try_update_child(*index, *child_id);
+                        node = free_nodes.back();
+                        free_nodes.pop_back();
+                        node->latch.lock();
+                        return node;
                     }
-                    else
+                    if ((node = evict()) != nullptr)
                     {
-                        len_t value_len = rec.redo_len - record->key_len;
-                        node->try_update_value(*index, record->value_string(value_len));
+                        dirty = std::exchange(node->dirty, false);
+                        stats.evictions++;
+                        break;
                     }
+
+                    // every frame is latched or pinned
+                    if (!wait)
+                        return nullptr;
+                    lock.unlock();
+                    std::this_thread::yield();
+                    lock.lock();
                 }
-                else if (record->type == RecordType::Remove)
-                {
-                    num_t *index = (num_t *)(record->record);
-                    node->remove(*index);
-                }
-            });
+            }
 
-            return OpStatus(OpError::Ok);
+            // the victim stays in buffer_map until it has been written back,
+            // so nobody can read the stale page from disk
+            if (dirty)
+                store_page(node);
+
+            std::lock_guard lock(buffer_latch);
+            buffer_map.erase(node->page_id);
+            node->page_id = INVALID_PAGE_ID;
+            return node;
         }
+        // give back a frame taken by take_frame()
+        void put_frame(BTreeNode *node)
+        {
+            std::lock_guard lock(buffer_latch);
+            free_frame(node);
+        }
+        // load a page allocated just now into a frame taken by take_frame(), the node stays locked
+        BTreeNode *load_new_page(BTreeNode *node, const id_t page_id)
+        {
+            {
+                std::lock_guard lock(buffer_latch);
+                stats.misses++;
+                map_frame(node, page_id);
+            }
 
-        // node methods
-        BTreeNode *get(const id_t page_id)
+            read_page(page_id, node->raw_page());
+            node->reload(page_id);
+            return node;
+        }
+        // read the pages in the background, the resident ones are skipped,
+        // a page being read is latched exclusively, so its readers wait for it rather than reading it again
+        void prefetch(std::span<const id_t> page_ids)
         {
-            BTreeNode *res = nullptr;
+            struct Prefetch
+            {
+                IoBatch batch;
+                std::vector<BTreeNode *> nodes;
+                std::vector<IoRequest> requests;
+            };
+            auto prefetch = std::make_unique<Prefetch>();
 
-            if (buffer_map.find(page_id) == buffer_map.end())
+            for (id_t page_id : page_ids)
             {
-                char *page = load(page_id);
-                if (page == nullptr) // can't load
                 {
-                    return nullptr;
+                    std::lock_guard lock(buffer_latch);
+                    if (buffer_map.contains(page_id))
+                        continue;
                 }
 
-                res = new BTreeNode(page_id, page, &wal);
-                buffer_map[page_id] = res;
+                BTreeNode *node = take_frame(false);
+                if (node == nullptr)
+                    break;
+                {
+                    std::lock_guard lock(buffer_latch);
+                    if (buffer_map.contains(page_id))
+                    {
+                        free_frame(node);
+                        continue;
+                    }
+
+                    stats.prefetches++;
+                    map_frame(node, page_id);
+                }
+                prefetch->nodes.push_back(node);
+                prefetch->requests.push_back(IoRequest{IoOp::Read, data_file, node->raw_page(), PAGE_SIZE, page_off(page_id)});
             }
+            if (prefetch->nodes.empty())
+                return;
+
+            prefetching++;
+            Prefetch *p = prefetch.release();
+            p->batch.on_complete = [this, p]() {
+                for (size_t i = 0; i < p->nodes.size(); i++)
+                {
+                    if (p->requests[i].res != PAGE_SIZE)
+                    {
+                        std::cerr << "read data_file: " << (p->requests[i].res < 0 ? strerror(-p->requests[i].res) : "short read");
+                        exit(-1);
+                    }
+                    p->nodes[i]->reload(p->nodes[i]->page_id);
+                    p->nodes[i]->latch.unlock();
+                }
+                delete p;
+
+                prefetching--;
+                prefetching.notify_all();
+            };
+            io->start(p->requests, &p->batch);
+        }
+        // the root is never evicted, its frame is cached
+        BTreeNode *get_root()
+        {
+            id_t page_id = root_id();
+            BTreeNode *node = root_node.load(std::memory_order_acquire);
+            if (node == nullptr || node->page_id != page_id)
+                root_node.store(node = get(page_id), std::memory_order_release);
+            return node;
+        }
+        BufferStats buffer_stats()
+        {
+            std::lock_guard lock(buffer_latch);
+            return stats;
+        }
+        void reset_buffer_stats()
+        {
+            std::lock_guard lock(buffer_latch);
+            stats = BufferStats();
+        }
+        inline id_t root_id() { return std::atomic_ref(metadata.root_id).load(); }
+        // it's logged, recovery replays the root changes
+        void set_root_id(const id_t page_id)
+        {
+            id_t old_root_id = root_id();
+            Record *rec = LogicalRecord::new_record(wal.gen_id(), page_id,
+                                                    RecordType::SetRoot, 0, 0, nullptr, nullptr,
+                                                    sizeof(old_root_id), (char *)&old_root_id);
+            log_in_context(wal, rec);
+            delete[]((char *)rec);
 
-            if (res == nullptr)
-                res = buffer_map[page_id];
+            std::atomic_ref(metadata.root_id).store(page_id);
+        }
+        // the records logged by this thread belong to the action until the scope ends
+        ActionScope begin_action() { return ActionScope(wal); }
+        // pointer swizzling
+        // a swizzled reference is SWIZZLED | the frame index of the child, it's replaced by the page id
+        // before the child is evicted, and it never reaches the disk or the WAL
+        inline BTreeNode *frame_of(const id_t ref) { return nodes + (ref & ~SWIZZLED); }
+        inline id_t swizzled_ref(BTreeNode *node) { return SWIZZLED | id_t(node - nodes); }
+        inline id_t page_id_of(const id_t ref) { return is_swizzled(ref) ? frame_of(ref)->page_id : ref; }
+        // the caller must hold the latch of the node exclusively
+        void unswizzle_children(BTreeNode *node)
+        {
+            if (node->type() != CellType::KeyCell)
+                return;
+
+            for (auto i : iota(0u, node->data_num() + 1))
+                node->child_slot(i) = page_id_of(node->child_slot(i));
+        }
 
-            return res;
+        // pinning
+        // a pinned node is never evicted, a reader keeps pointers into it without holding its latch,
+        // and a writer modifies a copy of it instead, see copy_on_write(), only the leaves are pinned
+        // pin the node read optimistically, then validate the version of its latch
+        void pin(BTreeNode *node)
+        {
+            node->pin_count.fetch_add(1, std::memory_order_relaxed);
+            // pairs with the fence of pinned(), a writer locking the node sees the pin, or the version changes
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+        inline void unpin(BTreeNode *node) { node->pin_count.fetch_sub(1, std::memory_order_release); }
+        // the caller must hold the latch of the node exclusively
+        bool pinned(BTreeNode *node)
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            return node->pin_count.load(std::memory_order_acquire) > 0;
+        }
+        // a pinned leaf is copied into another frame, which takes its page, before it's modified,
+        // the old frame keeps the pinned values until it's evicted once the pins are released,
+        // the caller must hold the latch of the node exclusively, and the latch of the parent if it's given,
+        // return the node to modify locked exclusively, or nullptr with the node unlocked if the caller should restart
+        BTreeNode *copy_on_write(BTreeNode *node, BTreeNode *locked_parent = nullptr)
+        {
+            if (!pinned(node))
+                return node;
+
+            // the frame isn't taken in advance, so don't wait for it
+            BTreeNode *frame = take_frame(false);
+            if (frame == nullptr || !unswizzle_parent(node, locked_parent))
+            {
+                if (frame != nullptr)
+                    put_frame(frame);
+                node->latch.unlock();
+                return nullptr;
+            }
+
+            frame->copy(node);
+            {
+                // the checkpoints find the recovery lsn in either frame
+                std::lock_guard lock(buffer_latch);
+                frame->dirty = std::exchange(node->dirty, false);
+                std::atomic_ref(frame->rec_lsn).store(node->rec_lsn, std::memory_order_relaxed);
+                std::atomic_ref(node->rec_lsn).store(INVALID_LSN, std::memory_order_relaxed);
+                map_frame(frame, node->page_id);
+                node->page_id = INVALID_PAGE_ID;
+            }
+            // the optimistic readers of the old frame fail to validate
+            node->latch.unlock();
+            return frame;
+        }
+        inline void insert_into_dirty_pages(BTreeNode *node)
+        {
+            std::lock_guard lock(buffer_latch);
+            node->dirty = true;
         }
-        inline BTreeNode *get_root() { return get(metadata.root_id); }
-        inline void pin(const id_t page_id) { pinned_page.insert(page_id); }
-        inline void unpin(const id_t page_id) { pinned_page.erase(page_id); }
-        inline void insert_into_dirty_pages(BTreeNode *node) { dirty_pages.insert(node); }
         id_t allocate_page(CellType cell_type)
         {
-            static char *buf = (char *)operator new(BLOCK_SIZE, (std::align_val_t)BLOCK_SIZE);
+            std::lock_guard lock(allocate_latch);
+
+            // the checksum covers the whole page, the rest of the page is zeros after fallocate
+            static char *buf = (char *)operator new(PAGE_SIZE, (std::align_val_t)BLOCK_SIZE);
+            std::memset(buf, 0, PAGE_SIZE);
             PageHeader *header = (PageHeader *)buf;
             header->type = cell_type;
             header->cell_end = PAGE_SIZE;
             header->rightmost_child = metadata.node_num;
-            header->checksum = header->header_checksum();
+            header->prev_leaf = header->next_leaf = INVALID_PAGE_ID;
+            header->fence_off = PAGE_SIZE;
+            header->checksum = page_checksum(buf);
 
             fallocate64(data_file, 0, page_off(metadata.node_num), PAGE_SIZE);
 
@@ -197,109 +547,621 @@ namespace cyber
                 exit(-1);
             }
 
-            return metadata.node_num++;
+            return std::atomic_ref(metadata.node_num)++;
         }
-        void deallocate_page(id_t page_id)
+        // allocate the pages without initializing them, the caller writes them by write_pages()
+        id_t allocate_pages(size_t n)
         {
-            fallocate64(data_file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, page_off(page_id), PAGE_SIZE);
+            std::lock_guard lock(allocate_latch);
+            return std::atomic_ref(metadata.node_num).fetch_add(n);
+        }
+        // write the pages bypassing the buffer in one submission, they mustn't be resident
+        // the checksums must have been calculated
+        void write_pages(std::span<const std::tuple<id_t, char *>> pages)
+        {
+            thread_local std::vector<IoRequest> requests;
+            requests.clear();
+            for (auto [page_id, page] : pages)
+                requests.push_back(IoRequest{IoOp::Write, data_file, page, PAGE_SIZE, page_off(page_id)});
+
+            io->run(requests);
+            for (IoRequest &request : requests)
+            {
+                if (request.res != PAGE_SIZE)
+                {
+                    std::cerr << "write data_file: " << (request.res < 0 ? strerror(-request.res) : "short write");
+                    exit(-1);
+                }
+            }
+        }
+        /*
+        The freed pages are linked by next_leaf from the head in the metadata, the head of the list is reused first.
+        Freeing and reusing a page are logged as a part of the caller's action,
+        the page is formatted by a Format record and the head is changed by a SetFreeHead record.
+        */
+        inline id_t free_head() { return std::atomic_ref(metadata.free_head).load(); }
+        // a page for a new node of the type, the node is locked exclusively,
+        // a free page is loaded into the frame taken by take_frame() unless it's resident, then the frame is given back
+        BTreeNode *new_page(BTreeNode *frame, CellType cell_type)
+        {
+            std::unique_lock lock(allocate_latch);
+            id_t page_id = free_head();
+            if (page_id == INVALID_PAGE_ID)
+            {
+                lock.unlock();
+                return load_new_page(frame, allocate_page(cell_type));
+            }
+
+            BTreeNode *node = lock_free_page(frame, page_id);
+            set_free_head(node->next_leaf());
+            node->reformat(cell_type);
+            insert_into_dirty_pages(node);
+            return node;
+        }
+        // put the empty node at the head of the free list, the caller must hold its latch exclusively
+        void free_page(BTreeNode *node)
+        {
+            std::lock_guard lock(allocate_latch);
+            // the rightmost child is logged as a page id
+            unswizzle_children(node);
+            node->reformat(CellType::Free, free_head());
+            set_free_head(node->page_id);
+            insert_into_dirty_pages(node);
+        }
+        // free the unreachable pages, they're linked in order and put at the head of the list at once,
+        // so only the first one is locked until the caller's action ends, the pages after it can't be reused before it,
+        // return the first one, the caller mustn't allocate or free pages before unlocking it
+        BTreeNode *free_pages(std::span<const id_t> page_ids)
+        {
+            if (page_ids.empty())
+                return nullptr;
+
+            prefetch(page_ids.subspan(1));
+            BTreeNode *first = nullptr;
+            // the values of a freed leaf may still be pinned, its parent may be the first one
+            auto lock = [&](id_t page_id) {
+                while (true)
+                {
+                    if (BTreeNode *node = copy_on_write(lock_page(page_id), first); node != nullptr)
+                        return node;
+                }
+            };
+            first = lock(page_ids[0]);
+            for (size_t i = 0; i < page_ids.size(); i++)
+            {
+                BTreeNode *node = i == 0 ? first : lock(page_ids[i]);
+                // the rightmost child of an inner node is logged as a page id
+                unswizzle_children(node);
+                if (i + 1 < page_ids.size())
+                    node->reformat(CellType::Free, page_ids[i + 1]);
+                else
+                {
+                    std::lock_guard lock(allocate_latch);
+                    node->reformat(CellType::Free, free_head());
+                    set_free_head(first->page_id);
+                }
+                insert_into_dirty_pages(node);
+                if (i > 0)
+                    node->latch.unlock();
+            }
+            return first;
+        }
+
+        // the page is loaded and locked exclusively
+        // the log holds no full page images, so recovery can't repair a corrupted page
+        BTreeNode *lock_page(const id_t page_id)
+        {
+            while (true)
+            {
+                BTreeNode *node = get(page_id);
+                node->latch.lock();
+                if (node->page_id == page_id && !node->is_valid())
+                {
+                    std::cerr << "read data_file: page " << page_id << " is corrupted";
+                    exit(-1);
+                }
+                if (node->page_id == page_id)
+                    return node;
+                node->latch.unlock();
+            }
         }
 
     private:
-        // read page from disk
-        char *load_page(const id_t page_id)
+        // it's logged, recovery replays the changes of the head
+        void set_free_head(const id_t page_id)
         {
-            char *page;
-            try
+            id_t old_head = free_head();
+            Record *rec = LogicalRecord::new_record(wal.gen_id(), page_id,
+                                                    RecordType::SetFreeHead, 0, 0, nullptr, nullptr,
+                                                    sizeof(old_head), (char *)&old_head);
+            log_in_context(wal, rec);
+            delete[]((char *)rec);
+
+            std::atomic_ref(metadata.free_head).store(page_id);
+        }
+        // lock the free page, it's read into the frame unless it's resident,
+        // nobody else locks a free page for long, the evictions and the writes release it soon
+        BTreeNode *lock_free_page(BTreeNode *frame, const id_t page_id)
+        {
+            while (true)
             {
-                page = (char *)operator new(PAGE_SIZE, (std::align_val_t)BLOCK_SIZE);
+                BTreeNode *node = frame;
+                {
+                    std::lock_guard lock(buffer_latch);
+                    if (uint32_t i = buffer_map.find(page_id); i != PageTable::NONE)
+                        node = nodes + i;
+                    else
+                    {
+                        stats.misses++;
+                        map_frame(frame, page_id);
+                    }
+                }
+
+                if (node == frame)
+                {
+                    read_page(page_id, frame->raw_page());
+                    frame->reload(page_id);
+                }
+                else
+                {
+                    node->latch.lock();
+                    if (node->page_id != page_id)
+                    {
+                        node->latch.unlock();
+                        continue;
+                    }
+                    put_frame(frame);
+                }
+
+                if (!node->is_valid() || node->type() != CellType::Free)
+                {
+                    std::cerr << "read data_file: free page " << page_id << " is corrupted";
+                    exit(-1);
+                }
+                return node;
             }
-            catch (const std::exception &e)
+        }
+        // the caller must hold buffer_latch
+        void map_frame(BTreeNode *node, const id_t page_id)
+        {
+            node->page_id = page_id;
+            buffer_map.assign(page_id, node - nodes);
+            replacer->insert(node);
+        }
+        void free_frame(BTreeNode *node)
+        {
+            node->page_id = INVALID_PAGE_ID;
+            node->latch.unlock();
+            free_nodes.push_back(node);
+        }
+        // read page from disk
+        void read_page(const id_t page_id, char *page)
+        {
+            IoRequest request{IoOp::Read, data_file, page, PAGE_SIZE, page_off(page_id)};
+            io->run(std::span(&request, 1));
+            if (request.res != PAGE_SIZE)
             {
-                std::cerr << e.what() << '\n';
+                std::cerr << "read data_file: " << (request.res < 0 ? strerror(-request.res) : "short read");
                 exit(-1);
             }
+        }
+        // write a page to disk
+        // the caller must hold the latch of the node exclusively
+        inline void store_page(BTreeNode *node) { store_pages(std::span(&node, 1)); }
+        // write the pages in one submission, the swizzled children are written as page ids
+        // the caller must hold the latches of the nodes exclusively
+        void store_pages(std::span<BTreeNode *const> nodes)
+        {
+            if (nodes.empty())
+                return;
+            // write ahead, the records of the latched pages have been logged
+            wal.flush(wal.next_lsn());
 
-            ssize_t n = pread64(data_file, page, PAGE_SIZE, page_off(page_id));
-            if (n == -1)
-                puts(strerror(errno));
+            thread_local std::vector<std::tuple<BTreeNode *, num_t, id_t>> swizzled;
+            thread_local std::vector<IoRequest> requests;
+            swizzled.clear();
+            requests.clear();
+            for (BTreeNode *node : nodes)
+            {
+                if (node->type() == CellType::KeyCell)
+                {
+                    for (auto i : iota(0u, node->data_num() + 1))
+                    {
+                        if (id_t &slot = node->child_slot(i); is_swizzled(slot))
+                        {
+                            swizzled.emplace_back(node, i, slot);
+                            slot = frame_of(slot)->page_id;
+                        }
+                    }
+                }
+
+                node->cal_checksum();
+                requests.push_back(IoRequest{IoOp::Write, data_file, node->raw_page(), PAGE_SIZE, page_off(node->page_id)});
+            }
+
+            io->run(requests);
+            for (IoRequest &request : requests)
+            {
+                if (request.res != PAGE_SIZE)
+                {
+                    std::cerr << "write data_file: " << (request.res < 0 ? strerror(-request.res) : "short write");
+                    exit(-1);
+                }
+            }
 
-            return page;
+            for (auto [node, i, ref] : swizzled)
+                node->child_slot(i) = ref;
+            for (BTreeNode *node : nodes)
+                std::atomic_ref(node->rec_lsn).store(INVALID_LSN, std::memory_order_relaxed);
         }
-        // write a page to disk
-        bool store_page(BTreeNode *node)
+
+        // choose an unpinned node to evict by the replacement policy, and lock it exclusively
+        // the node is never freed, it will be reused for another page,
+        // so an optimistic reader holding the pointer reads valid memory and fails to validate
+        // a node with swizzled children is not evictable, its children go first
+        BTreeNode *evict()
         {
-            node->cal_checksum();
-            ssize_t n = pwrite64(data_file, node->raw_page(), PAGE_SIZE, page_off(node->page_id));
-            if (n == -1)
+            return replacer->victim([this](BTreeNode *node) {
+                if (node->page_id == root_id() || node->pin_count.load(std::memory_order_relaxed) > 0 ||
+                    has_swizzled_child(node) || !node->latch.try_lock())
+                    return false;
+
+                if (pinned(node) || has_swizzled_child(node) || !unswizzle_parent(node))
+                {
+                    node->latch.unlock();
+                    return false;
+                }
+                return true;
+            });
+        }
+        // it's checked optimistically before the node is locked
+        bool has_swizzled_child(BTreeNode *node)
+        {
+            if (node->type() != CellType::KeyCell)
+                return false;
+
+            return ranges::any_of(iota(0u, std::min(node->data_num(), MAX_CELL_NUM) + 1), [node](num_t i) {
+                return is_swizzled(node->child_at(i));
+            });
+        }
+        // replace the swizzled reference to the node by its page id,
+        // the caller must hold the latch of the node exclusively, and the latch of the parent if it's given
+        bool unswizzle_parent(BTreeNode *node, BTreeNode *locked_parent = nullptr)
+        {
+            BTreeNode *parent = node->parent;
+            if (parent == nullptr)
+                return true;
+            if (parent != locked_parent && !parent->latch.try_lock())
+                return false;
+
+            id_t ref = swizzled_ref(node);
+            if (parent->type() == CellType::KeyCell)
             {
-                std::cerr << "write data_file: " << strerror(errno);
-                exit(-1);
+                for (auto i : iota(0u, parent->data_num() + 1))
+                {
+                    if (parent->child_slot(i) == ref)
+                        parent->child_slot(i) = node->page_id;
+                }
             }
+            if (parent != locked_parent)
+                parent->latch.unlock();
 
-            delete node;
+            node->parent = nullptr;
             return true;
         }
 
-        // load page to buffer pool
-        char *load(const id_t page_id)
+        // ARIES restart
+        // analysis finds the pages to redo and the actions to undo from the last checkpoint,
+        // redo repeats the history since the minimum recovery lsn,
+        // and undo rolls back the actions without End records, the latest record first
+        void recover()
         {
-            // need to evict a page
-            if (current_size + PAGE_SIZE > buffer_size)
+            std::unordered_map<id_t, lsn_t> dirty_pages; // the dirty page table, from page id to rec_lsn
+            // analysis starts from the first records of the actions active at the checkpoint, which are kept by the log
+            lsn_t redo_lsn = 0, begin_lsn = 0, analysis_lsn = 0;
+            if (std::vector<char> buf; metadata.checkpoint_lsn != INVALID_LSN && wal.read_record(metadata.checkpoint_lsn, buf))
             {
-                if (!evict()) // failed to evict
+                const Record &rec = *(Record *)buf.data();
+                const char *value = logical_record(rec)->record;
+                // the value isn't aligned in the record
+                CheckpointHeader header;
+                std::memcpy(&header, value, sizeof(header));
+                redo_lsn = analysis_lsn = header.min_rec_lsn;
+                begin_lsn = header.begin_lsn;
+
+                std::vector<ActiveActionEntry> actions(header.action_num);
+                size_t action_bytes = actions.size() * sizeof(ActiveActionEntry);
+                std::memcpy(actions.data(), value + sizeof(header), action_bytes);
+                for (auto &entry : actions)
+                    analysis_lsn = std::min(analysis_lsn, entry.first_lsn);
+
+                std::vector<DirtyPageEntry> entries((redo_value_len(rec) - sizeof(header) - action_bytes) / sizeof(DirtyPageEntry));
+                std::memcpy(entries.data(), value + sizeof(header) + action_bytes, entries.size() * sizeof(DirtyPageEntry));
+                for (auto &entry : entries)
+                    dirty_pages.emplace(entry.page_id, entry.rec_lsn);
+            }
+
+            // analysis
+            struct Action
+            {
+                std::vector<lsn_t> records; // the records to undo
+                size_t compensated = 0;     // the latest records have been undone
+                bool ended = false;
+            };
+            std::unordered_map<id_t, Action> actions;
+            lsn_t end_lsn = wal.for_each_record(analysis_lsn, [&](const Record &rec, lsn_t lsn) {
+                LogicalRecord *record = logical_record(rec);
+                if (record->flags & RECORD_ACTION)
                 {
-                    // TODO: now, do nothing
-                    // return nullptr;
+                    Action &action = actions[rec.seq_num];
+                    if (record->type == RecordType::End)
+                        action.ended = true;
+                    else if (record->flags & RECORD_COMPENSATION)
+                        action.compensated++;
+                    else
+                        action.records.push_back(lsn);
                 }
+
+                if (record->type == RecordType::SetRoot)
+                    metadata.root_id = rec.page_id;
+                else if (record->type == RecordType::SetFreeHead)
+                    metadata.free_head = rec.page_id;
+                // the pages modified since the checkpoint began may be missing in its dirty page table
+                else if (is_page_record(*record) && lsn >= begin_lsn)
+                    dirty_pages.try_emplace(rec.page_id, lsn);
+            });
+            wal.set_end(end_lsn);
+
+            redo(redo_lsn, dirty_pages);
+
+            // undo
+            std::vector<std::tuple<lsn_t, id_t>> undo_records;
+            for (auto &[action_id, action] : actions)
+            {
+                if (action.ended)
+                    continue;
+                size_t n = action.records.size() - std::min(action.compensated, action.records.size());
+                for (lsn_t lsn : std::span(action.records).first(n))
+                    undo_records.emplace_back(lsn, action_id);
             }
+            ranges::sort(undo_records, ranges::greater());
+
+            for (std::vector<char> buf; auto [lsn, action_id] : undo_records)
+            {
+                if (!wal.read_record(lsn, buf))
+                {
+                    std::cerr << "read log_file: the record at " << lsn << " is missing";
+                    exit(-1);
+                }
 
-            current_size += PAGE_SIZE;
+                const Record &rec = *(Record *)buf.data();
+                LogicalRecord *record = logical_record(rec);
+                ActionScope compensation(wal, action_id, RECORD_ACTION | RECORD_COMPENSATION);
+                if (record->type == RecordType::SetRoot)
+                {
+                    set_root_id(*(id_t *)record->undo_string(rec.redo_len).data());
+                    continue;
+                }
+                if (record->type == RecordType::SetFreeHead)
+                {
+                    set_free_head(*(id_t *)record->undo_string(rec.redo_len).data());
+                    continue;
+                }
 
-            return load_page(page_id);
+                BTreeNode *node = lock_page(rec.page_id);
+                node->undo(rec);
+                insert_into_dirty_pages(node);
+                node->latch.unlock();
+            }
+            for (auto &[action_id, action] : actions)
+            {
+                if (!action.ended)
+                    ActionScope(wal, action_id, RECORD_ACTION).end();
+            }
+            wal.flush(wal.next_lsn());
         }
-        bool evict()
+        // the records of a page are applied in order by one worker, the pages are partitioned among the workers,
+        // a record is skipped without reading its page unless it's newer than the rec_lsn of the page
+        void redo(lsn_t redo_lsn, const std::unordered_map<id_t, lsn_t> &dirty_pages)
         {
-            for (auto it : iota(buffer_map.begin(), buffer_map.end()))
+            // a batch is a sequence of the lsn and the record
+            struct RedoQueue
             {
-                if (const id_t id = it->second->page_id;
-                    pinned_page.find(id) == pinned_page.end())
-                {
-                    if (!store_page(it->second))
-                        return false;
+                std::mutex mutex;
+                std::condition_variable cv;
+                std::deque<std::vector<char>> batches;
+                bool closed = false;
+            };
+            constexpr size_t BATCH_SIZE = 64 * kb, MAX_QUEUED_BATCHES = 16;
 
-                    current_size -= PAGE_SIZE;
-                    buffer_map.erase(it);
-                    return true;
-                }
+            size_t worker_num = std::max(1u, std::thread::hardware_concurrency());
+            std::vector<RedoQueue> queues(worker_num);
+            std::vector<std::vector<char>> batches(worker_num);
+            std::vector<std::jthread> workers;
+            for (RedoQueue &queue : queues)
+            {
+                workers.emplace_back([this, &queue]() {
+                    while (true)
+                    {
+                        std::vector<char> batch;
+                        {
+                            std::unique_lock lock(queue.mutex);
+                            queue.cv.wait(lock, [&queue] { return !queue.batches.empty() || queue.closed; });
+                            if (queue.batches.empty())
+                                return;
+                            batch = std::move(queue.batches.front());
+                            queue.batches.pop_front();
+                        }
+                        queue.cv.notify_all();
+
+                        for (size_t off = 0; off < batch.size();)
+                        {
+                            lsn_t lsn = *(lsn_t *)(batch.data() + off);
+                            const Record &rec = *(Record *)(batch.data() + off + sizeof(lsn_t));
+                            off += sizeof(lsn_t) + ROUND_UP(RECORD_HEADER_SIZE + rec.redo_len, sizeof(lsn_t));
+
+                            BTreeNode *node = lock_page(rec.page_id);
+                            if (lsn >= node->page_lsn())
+                            {
+                                node->redo(rec, lsn);
+                                insert_into_dirty_pages(node);
+                            }
+                            node->latch.unlock();
+                        }
+                    }
+                });
             }
 
-            return false;
-        }
+            auto push = [&](size_t i) {
+                std::unique_lock lock(queues[i].mutex);
+                queues[i].cv.wait(lock, [&] { return queues[i].batches.size() < MAX_QUEUED_BATCHES; });
+                queues[i].batches.push_back(std::move(batches[i]));
+                batches[i].clear();
+                queues[i].cv.notify_all();
+            };
+            wal.for_each_record(redo_lsn, [&](const Record &rec, lsn_t lsn) {
+                if (!is_page_record(*logical_record(rec)))
+                    return;
+                if (auto it = dirty_pages.find(rec.page_id); it == dirty_pages.end() || lsn < it->second)
+                    return;
+
+                // the entries are 8-byte aligned in the batch
+                size_t i = rec.page_id % worker_num, len = RECORD_HEADER_SIZE + rec.redo_len;
+                std::vector<char> &batch = batches[i];
+                batch.insert(batch.end(), (char *)&lsn, (char *)&lsn + sizeof(lsn_t));
+                batch.insert(batch.end(), (char *)&rec, (char *)&rec + len);
+                batch.resize(ROUND_UP(batch.size(), sizeof(lsn_t)));
+                if (batch.size() >= BATCH_SIZE)
+                    push(i);
+            });
 
-        // background flush
-        void flush()
+            for (size_t i = 0; i < worker_num; i++)
+            {
+                if (!batches[i].empty())
+                    push(i);
+                std::lock_guard lock(queues[i].mutex);
+                queues[i].closed = true;
+                queues[i].cv.notify_all();
+            }
+        }
+        static bool is_page_record(const LogicalRecord &record)
         {
+            return record.type == RecordType::Insert || record.type == RecordType::Update || record.type == RecordType::Remove ||
+                   record.type == RecordType::SetLinks || record.type == RecordType::SetFences || record.type == RecordType::Format ||
+                   record.type == RecordType::SetChunk;
+        }
+        // background writer
+        void write_back(std::stop_token stop)
+        {
+            std::mutex mutex;
+            std::condition_variable_any cv;
+            auto last_checkpoint = std::chrono::steady_clock::now();
             while (true)
             {
-                std::this_thread::sleep_for(std::chrono::minutes(5));
+                WriterOptions options;
+                {
+                    std::lock_guard lock(writer_latch);
+                    options = writer_options;
+                }
 
-                std::erase_if(dirty_pages, [&](BTreeNode *node) {
-                    if (pinned_page.contains(node->page_id))
-                        return false;
+                {
+                    std::unique_lock lock(mutex);
+                    cv.wait_for(lock, stop, options.interval, [] { return false; });
+                    if (stop.stop_requested())
+                        return;
+                }
 
-                    return this->store_page(node);
-                });
+                // the records committed asynchronously
+                wal.flush(wal.next_lsn());
+                write_dirty_pages(std::max<size_t>(options.pages_per_second * options.interval.count() / 1000, 1),
+                                  options.max_dirty_ratio);
+
+                lsn_t checkpoint_lsn = std::atomic_ref(metadata.checkpoint_lsn).load();
+                lsn_t log_size = wal.next_lsn() - (checkpoint_lsn == INVALID_LSN ? 0 : checkpoint_lsn);
+                if (std::chrono::steady_clock::now() - last_checkpoint >= options.checkpoint_interval ||
+                    log_size >= options.checkpoint_log_size)
+                {
+                    checkpoint();
+                    last_checkpoint = std::chrono::steady_clock::now();
+                }
+            }
+        }
+        // write the dirty pages with the oldest recovery lsn, they hold back the truncation of the log
+        void write_dirty_pages(size_t budget, double max_dirty_ratio)
+        {
+            std::vector<std::pair<lsn_t, BTreeNode *>> candidates;
+            std::vector<BTreeNode *> victims;
+            {
+                std::lock_guard lock(buffer_latch);
+                for (BTreeNode &node : std::span(nodes, frame_num))
+                {
+                    if (node.dirty)
+                        candidates.emplace_back(node.rec_lsn, &node);
+                }
+
+                size_t max_dirty_num = frame_num * max_dirty_ratio;
+                if (candidates.size() > max_dirty_num)
+                    budget = std::max(budget, candidates.size() - max_dirty_num);
+                ranges::sort(candidates);
+
+                for (auto [rec_lsn, node] : candidates)
+                {
+                    if (victims.size() == budget)
+                        break;
+                    if (!node->latch.try_lock())
+                        continue;
+
+                    node->dirty = false;
+                    victims.push_back(node);
+                }
+            }
+
+            store_pages(victims);
+            for (BTreeNode *node : victims)
+                node->latch.unlock();
+        }
+        void store_metadata()
+        {
+            Metadata snapshot{std::atomic_ref(metadata.root_id).load(), std::atomic_ref(metadata.node_num).load(),
+                              std::atomic_ref(metadata.data_num).load(), std::atomic_ref(metadata.checkpoint_lsn).load(),
+                              std::atomic_ref(metadata.free_head).load()};
+
+            fs::path metadata_path = dir / "metadata";
+            int metadata_file = open64(metadata_path.c_str(), O_CREAT | O_WRONLY | O_SYNC, S_IRUSR | S_IWUSR);
+            if (metadata_file == -1)
+            {
+                std::cerr << "open metadata_file: " << strerror(errno);
+                exit(-1);
             }
+            if (pwrite64(metadata_file, &snapshot, METADATA_SIZE, 0) == -1)
+            {
+                std::cerr << "write metadata_file: " << strerror(errno);
+                exit(-1);
+            }
+            close(metadata_file);
         }
 
         // data members
         int data_file;
         fs::path dir;
         WriteAheadLog wal;
-        size_t buffer_size;
-        size_t current_size;
-        std::unordered_map<uint32_t, BTreeNode *> buffer_map;
-        std::unordered_set<BTreeNode *> dirty_pages;
-        std::unordered_set<uint32_t> pinned_page;
+        size_t frame_num;
+        size_t frames_size;
+        char *frames;     // frame_num pages
+        BTreeNode *nodes; // the descriptors of the frames
+        std::mutex buffer_latch; // protect buffer_map, free_nodes, the pin counts and dirty bits, replacer and stats
+        std::mutex allocate_latch;
+        PageTable buffer_map; // page id -> frame index
+        std::vector<BTreeNode *> free_nodes;
+        std::unique_ptr<Replacer> replacer;
+        // the prefetches in flight, the threads completing them are joined by destroying io first
+        std::atomic<size_t> prefetching = 0;
+        std::unique_ptr<AsyncIo> io;
+        std::atomic<BTreeNode *> root_node = nullptr;
+        BufferStats stats;
+        std::mutex checkpoint_latch;
+        std::mutex writer_latch;
+        WriterOptions writer_options;
+        std::jthread writer;
     };
 } // namespace cyber
\ No newline at end of file
@@ -0,0 +1,154 @@
+#pragma once
+
+/*
+CRC32C (Castagnoli) of the pages.
+The SSE4.2 crc32 instruction is used if the CPU supports it, it's detected once at runtime,
+otherwise the portable slicing-by-8 implementation is used.
+*/
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace cyber
+{
+    namespace crc32c_detail
+    {
+        constexpr uint32_t POLY = 0x82f63b78; // reflected Castagnoli polynomial
+
+        // TABLES[k][b] is the crc of the byte b followed by k zero bytes
+        constexpr std::array<std::array<uint32_t, 256>, 8> make_tables()
+        {
+            std::array<std::array<uint32_t, 256>, 8> tables{};
+            for (uint32_t b = 0; b < 256; b++)
+            {
+                uint32_t crc = b;
+                for (int i = 0; i < 8; i++)
+                    crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+                tables[0][b] = crc;
+            }
+            for (uint32_t b = 0; b < 256; b++)
+                for (size_t k = 1; k < 8; k++)
+                    tables[k][b] = (tables[k - 1][b] >> 8) ^ tables[0][tables[k - 1][b] & 0xff];
+            return tables;
+        }
+        inline constexpr auto TABLES = make_tables();
+
+        // the crc instruction has a latency of 3 cycles, so 3 stripes are computed at once and combined
+        constexpr size_t STRIPE_SIZE = 256;
+
+        // the same as the portable extension, without the tables of slicing-by-8
+        constexpr uint32_t extend_bytewise(uint32_t crc, const char *data, size_t n)
+        {
+            for (; n > 0; data++, n--)
+                crc = (crc >> 8) ^ TABLES[0][(crc ^ uint8_t(*data)) & 0xff];
+            return crc;
+        }
+        // extending a crc by zeros is linear, SHIFT[k][b] extends the byte b at k of the crc by STRIPE_SIZE zeros
+        constexpr std::array<std::array<uint32_t, 256>, 4> make_shift_tables()
+        {
+            std::array<uint32_t, 32> bits{};
+            char zeros[STRIPE_SIZE] = {};
+            for (int i = 0; i < 32; i++)
+                bits[i] = extend_bytewise(uint32_t(1) << i, zeros, STRIPE_SIZE);
+
+            std::array<std::array<uint32_t, 256>, 4> tables{};
+            for (int k = 0; k < 4; k++)
+                for (uint32_t b = 0; b < 256; b++)
+                    for (int i = 0; i < 8; i++)
+                        if (b >> i & 1)
+                            tables[k][b] ^= bits[k * 8 + i];
+            return tables;
+        }
+        inline constexpr auto SHIFT = make_shift_tables();
+
+        inline uint32_t shift(uint32_t crc)
+        {
+            return SHIFT[0][crc & 0xff] ^ SHIFT[1][(crc >> 8) & 0xff] ^ SHIFT[2][(crc >> 16) & 0xff] ^ SHIFT[3][crc >> 24];
+        }
+
+#if defined(__x86_64__)
+        __attribute__((target("sse4.2"))) inline uint32_t extend_hardware(uint32_t crc, const char *data, size_t n)
+        {
+            for (; n >= 3 * STRIPE_SIZE; data += 3 * STRIPE_SIZE, n -= 3 * STRIPE_SIZE)
+            {
+                uint64_t crc0 = crc, crc1 = 0, crc2 = 0;
+                for (size_t i = 0; i < STRIPE_SIZE; i += sizeof(uint64_t))
+                {
+                    uint64_t words[3];
+                    std::memcpy(&words[0], data + i, sizeof(uint64_t));
+                    std::memcpy(&words[1], data + STRIPE_SIZE + i, sizeof(uint64_t));
+                    std::memcpy(&words[2], data + 2 * STRIPE_SIZE + i, sizeof(uint64_t));
+                    crc0 = _mm_crc32_u64(crc0, words[0]);
+                    crc1 = _mm_crc32_u64(crc1, words[1]);
+                    crc2 = _mm_crc32_u64(crc2, words[2]);
+                }
+                // extend(crc, a b) = shift(extend(crc, a)) ^ extend(0, b) for a stripe a
+                crc = shift(shift(uint32_t(crc0)) ^ uint32_t(crc1)) ^ uint32_t(crc2);
+            }
+
+            uint64_t crc64 = crc;
+            for (; n >= sizeof(uint64_t); data += sizeof(uint64_t), n -= sizeof(uint64_t))
+            {
+                uint64_t word;
+                std::memcpy(&word, data, sizeof(word));
+                crc64 = _mm_crc32_u64(crc64, word);
+            }
+            crc = uint32_t(crc64);
+            for (; n > 0; data++, n--)
+                crc = _mm_crc32_u8(crc, uint8_t(*data));
+            return crc;
+        }
+#endif
+    } // namespace crc32c_detail
+
+    // extend the crc by the data, the crc isn't inverted at either end
+    inline uint32_t crc32c_extend_portable(uint32_t crc, const char *data, size_t n)
+    {
+        using crc32c_detail::TABLES;
+        // little endian only, the words are read byte by byte otherwise
+        if constexpr (std::endian::native == std::endian::little)
+        {
+            for (; n >= sizeof(uint64_t); data += sizeof(uint64_t), n -= sizeof(uint64_t))
+            {
+                uint64_t word;
+                std::memcpy(&word, data, sizeof(word));
+                word ^= crc;
+                crc = TABLES[7][word & 0xff] ^ TABLES[6][(word >> 8) & 0xff] ^
+                      TABLES[5][(word >> 16) & 0xff] ^ TABLES[4][(word >> 24) & 0xff] ^
+                      TABLES[3][(word >> 32) & 0xff] ^ TABLES[2][(word >> 40) & 0xff] ^
+                      TABLES[1][(word >> 48) & 0xff] ^ TABLES[0][word >> 56];
+            }
+        }
+        for (; n > 0; data++, n--)
+            crc = (crc >> 8) ^ TABLES[0][(crc ^ uint8_t(*data)) & 0xff];
+        return crc;
+    }
+
+    inline bool crc32c_hardware_supported()
+    {
+#if defined(__x86_64__)
+        static const bool supported = __builtin_cpu_supports("sse4.2");
+        return supported;
+#else
+        return false;
+#endif
+    }
+
+    inline uint32_t crc32c_extend(uint32_t crc, const char *data, size_t n)
+    {
+#if defined(__x86_64__)
+        if (crc32c_hardware_supported())
+            return crc32c_detail::extend_hardware(crc, data, n);
+#endif
+        return crc32c_extend_portable(crc, data, n);
+    }
+
+    inline uint32_t crc32c(const char *data, size_t n) { return ~crc32c_extend(~0u, data, n); }
+} // namespace cyber
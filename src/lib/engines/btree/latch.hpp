@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+
+namespace cyber
+{
+    /*
+    Version latch for optimistic lock coupling.
+    Readers never write the latch, they remember the version and validate it after reading,
+    writers lock it exclusively, and the version is increased on unlock.
+    */
+    class OptLatch
+    {
+        static constexpr uint64_t LOCKED = 0b10;
+
+        std::atomic<uint64_t> word = 0;
+
+    public:
+        // spin until the latch is unlocked, return the version
+        uint64_t read_lock() const
+        {
+            uint64_t version = word.load(std::memory_order_acquire);
+            while (version & LOCKED)
+            {
+                std::this_thread::yield();
+                version = word.load(std::memory_order_acquire);
+            }
+
+            return version;
+        }
+        // true iff nobody locked the latch since read_lock() returned the version
+        bool validate(uint64_t version) const
+        {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return word.load(std::memory_order_relaxed) == version;
+        }
+        // lock exclusively iff the version is still valid
+        bool upgrade(uint64_t version)
+        {
+            return word.compare_exchange_strong(version, version + LOCKED, std::memory_order_acquire);
+        }
+        bool try_lock()
+        {
+            uint64_t version = word.load(std::memory_order_relaxed);
+            return !(version & LOCKED) && upgrade(version);
+        }
+        void lock()
+        {
+            while (!upgrade(read_lock()))
+                ;
+        }
+        void unlock() { word.fetch_add(LOCKED, std::memory_order_release); }
+        bool is_locked() const { return word.load(std::memory_order_relaxed) & LOCKED; }
+    };
+} // namespace cyber
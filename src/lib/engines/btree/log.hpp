@@ -1,3 +1,5 @@
+#pragma once
+
 #include <string>
 
 #include "engines/type.h"
@@ -10,38 +12,149 @@ namespace cyber
         Insert = 1,
         Update = 2,
         Remove = 3,
+        Checkpoint = 4,
+        SetRoot = 5, // the page id is the new root, the before image is the old root
+        End = 6,     // the action of the sequence number is done
+        SetLinks = 7, // the value is the previous and the next leaf, the before image is the old ones
+        SetFences = 8, // the value is the fence keys, the before image is the old ones
+        SetFreeHead = 9, // the page id is the new head of the free list, the before image is the old head
+        Format = 10,     // the value is the header fields and the fences of an empty page, the before image is the old ones
+        SetChunk = 11,   // the value is the chunk of an overflow page, it's undone by undoing the Format record before it
     };
 
+    // record flags
+    // the record belongs to a multi-record action, which is undone if its End record is missing
+    constexpr uint8_t RECORD_ACTION = 1;
+    // the record undoes a record of the action, it's never undone
+    constexpr uint8_t RECORD_COMPENSATION = 2;
+    // the value of an Insert or an Update is the reference to the overflow pages of a large value,
+    // and so is the before image of an Update with RECORD_OVERFLOW_BEFORE
+    constexpr uint8_t RECORD_OVERFLOW = 4, RECORD_OVERFLOW_BEFORE = 8;
+
     struct LogicalRecord
     {
         RecordType type;
+        uint8_t flags;
         len_t key_len;
+        len_t undo_len; // the before image at the end of the record
 
         char record[1];
 
         std::string key_string() { return std::string(record, key_len); }
         std::string value_string(len_t len) { return std::string(record + key_len, len); }
+        std::string_view undo_string(len_t redo_len) const
+        {
+            return std::string_view(record + redo_len - offsetof(LogicalRecord, record[0]) - undo_len, undo_len);
+        }
 
         static Record *new_record(id_t seq_num, id_t page_id,
                                   RecordType type, len_t key_len, len_t value_len,
-                                  const char *raw_key, const char *raw_value)
+                                  const char *raw_key, const char *raw_value,
+                                  len_t undo_len = 0, const char *raw_undo = nullptr)
         {
-            len_t total_size = RECORD_HEADER_SIZE + offsetof(LogicalRecord, record[0]) + key_len + value_len;
+            len_t total_size = RECORD_HEADER_SIZE + offsetof(LogicalRecord, record[0]) + key_len + value_len + undo_len;
             char *raw_log = new char[total_size];
             Record *rec = (Record *)raw_log;
             LogicalRecord *lr = (LogicalRecord *)(raw_log + RECORD_HEADER_SIZE);
             lr->type = type;
+            lr->flags = 0;
             lr->key_len = key_len;
+            lr->undo_len = undo_len;
             std::memcpy(lr->record, raw_key, key_len);
             std::memcpy(lr->record + key_len, raw_value, value_len);
+            std::memcpy(lr->record + key_len + value_len, raw_undo, undo_len);
 
             rec->seq_num = seq_num;
             rec->page_id = page_id;
-            rec->redo_len = offsetof(LogicalRecord, record[0]) + key_len + value_len;
+            rec->redo_len = offsetof(LogicalRecord, record[0]) + key_len + value_len + undo_len;
 
             return rec;
         }
     };
 
     constexpr size_t LOGICAL_RECORD_HEADER_SIZE = offsetof(LogicalRecord, record[0]);
-} // namespace cyber
\ No newline at end of file
+
+    inline LogicalRecord *logical_record(const Record &rec) { return (LogicalRecord *)rec.redo; }
+    // the length of the value logged for redo
+    inline len_t redo_value_len(const Record &rec)
+    {
+        LogicalRecord *record = logical_record(rec);
+        return rec.redo_len - LOGICAL_RECORD_HEADER_SIZE - record->key_len - record->undo_len;
+    }
+
+    // the value of a checkpoint record is the header, the active action table and then the dirty page table
+    struct CheckpointHeader
+    {
+        lsn_t min_rec_lsn; // redo starts from it
+        lsn_t begin_lsn;   // the lsn when the checkpoint began
+        uint64_t action_num;
+    };
+    struct ActiveActionEntry
+    {
+        id_t action_id;
+        lsn_t first_lsn; // the records of the action aren't before it
+    };
+    struct DirtyPageEntry
+    {
+        id_t page_id;
+        lsn_t rec_lsn;
+    };
+
+    // the action of the records logged by this thread
+    struct LogContext
+    {
+        id_t action_id = 0;
+        uint8_t flags = 0; // 0 if every record is an action by itself
+    };
+
+    inline thread_local LogContext log_context;
+
+    // log the record as a part of the action of this thread, return its lsn
+    inline lsn_t log_in_context(WriteAheadLog &wal, Record *rec)
+    {
+        if (log_context.flags != 0)
+        {
+            rec->seq_num = log_context.action_id;
+            logical_record(*rec)->flags |= log_context.flags;
+        }
+        return wal.log(*rec);
+    }
+
+    /*
+    The records logged by this thread in the scope belong to one action,
+    the action is undone by recovery unless end() has been called.
+    */
+    class ActionScope
+    {
+    public:
+        ActionScope(WriteAheadLog &wal, uint8_t flags = RECORD_ACTION) : ActionScope(wal, wal.gen_id(), flags) {}
+        ActionScope(WriteAheadLog &wal, id_t action_id, uint8_t flags)
+            : wal(wal), outer(log_context), handle(wal.begin_action(action_id))
+        {
+            log_context = LogContext{action_id, flags};
+        }
+        ActionScope(const ActionScope &) = delete;
+        ~ActionScope()
+        {
+            log_context = outer;
+            wal.end_action(handle);
+        }
+
+        // the caller must still hold the latches of the pages modified by the action,
+        // so no later record of the pages precedes the End record
+        void end()
+        {
+            // it's about no page
+            Record *rec = LogicalRecord::new_record(log_context.action_id, std::numeric_limits<id_t>::max(),
+                                                    RecordType::End, 0, 0, nullptr, nullptr);
+            logical_record(*rec)->flags = RECORD_ACTION;
+            wal.log(*rec);
+            delete[]((char *)rec);
+        }
+
+    private:
+        WriteAheadLog &wal;
+        LogContext outer;
+        WriteAheadLog::ActionHandle handle; // the action is active for the checkpoints until the scope ends
+    };
+} // namespace cyber
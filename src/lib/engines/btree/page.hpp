@@ -9,11 +9,19 @@ Should always use them by row pointer, except you try to create a new region.
 #include <cstring>
 #include <ranges>
 #include <cmath>
+#include <vector>
+#include <optional>
+#include <tuple>
+#include <algorithm>
+#include <bit>
+#include <span>
 
 #include "engines/type.h"
 #include "engines/write_ahead_log.hpp"
 
 #include "log.hpp"
+#include "latch.hpp"
+#include "checksum.hpp"
 
 namespace cyber
 {
@@ -23,6 +31,7 @@ namespace cyber
 
     constexpr size_t BLOCK_SIZE = 512;
     constexpr size_t PAGE_SIZE = 16 << 10; // 16KiB
+    constexpr size_t CACHE_LINE_SIZE = 64;
 
     static_assert(std::numeric_limits<num_t>::max() >= PAGE_SIZE);
     static_assert(std::numeric_limits<offset_t>::max() >= PAGE_SIZE);
@@ -31,10 +40,18 @@ namespace cyber
     // utils
     inline uint64_t page_off(const id_t id) { return id * PAGE_SIZE; }
 
+    constexpr id_t INVALID_PAGE_ID = std::numeric_limits<id_t>::max();
+    // a child reference with this bit is swizzled, it's the frame index of the resident child
+    constexpr id_t SWIZZLED = id_t(1) << 31;
+
+    inline bool is_swizzled(const id_t ref) { return ref & SWIZZLED; }
+
     enum struct CellType : uint8_t
     {
         KeyCell = 1,
         KeyValueCell = 2,
+        Free = 3, // a freed page, next_leaf links the next one of the free list
+        Overflow = 4, // a chunk of a large value, or the index of the chunks
     };
 
     struct KeyCellHeader
@@ -46,6 +63,9 @@ namespace cyber
                                                                     child_id(child_id) {}
     };
 
+    // the value of a cell whose value_size has this bit is an OverflowRef
+    constexpr len_t OVERFLOW_VALUE = len_t(1) << 31;
+
     struct KeyValueCellHeader
     {
         len_t key_size;
@@ -55,6 +75,15 @@ namespace cyber
                                                                            value_size(static_cast<len_t>(value.length())) {}
     };
 
+    // a freed cell between the cells, it's linked into the bin of its size class
+    struct FreeBlock
+    {
+        offset_t next; // 0 ends the list
+        len_t size;
+    };
+    constexpr size_t FREE_BLOCK_SIZE = sizeof(FreeBlock),
+                     FREE_BIN_NUM = 12; // the sizes in [8, 16), [16, 32), ..., [16Ki, 32Ki)
+
     struct PageHeader
     {
         checksum_t checksum = 0;
@@ -62,17 +91,17 @@ namespace cyber
         num_t data_num = 0;
         offset_t cell_end;    // cells grow left, cell_end is the offset of the last cell.
         id_t rightmost_child; // equal to the own id if no rightmost_child
-
-        checksum_t header_checksum()
-        {
-            checksum_t checksum = 0;
-            checksum_t *data = (checksum_t *)this;
-            int n = sizeof(PageHeader) / sizeof(checksum);
-            for (auto i : iota(1, n))
-                checksum ^= data[i];
-
-            return checksum;
-        }
+        lsn_t page_lsn = 0;   // the end lsn of the last record applied to the page
+        id_t prev_leaf;       // the sibling links of a leaf, INVALID_PAGE_ID at the ends
+        id_t next_leaf;
+        // the keys of the page are in [lower fence, upper fence), an empty upper fence means no bound,
+        // the fences are stored from fence_off to the end of the page
+        offset_t fence_off;
+        len_t lower_fence_len;
+        len_t upper_fence_len;
+        len_t prefix_len; // the common prefix of the fences, it's stripped from the keys of the cells
+        offset_t free_bins[FREE_BIN_NUM];
+        len_t free_bytes; // the free space between the cells, the blocks and the fragments too small for a block
     };
 
     constexpr size_t KEY_CELL_HEADER_SIZE = sizeof(KeyCellHeader),
@@ -80,6 +109,82 @@ namespace cyber
                      PAGE_HEADER_SIZE = sizeof(PageHeader); // Must be multiple of 8
     static_assert(PAGE_HEADER_SIZE <= BLOCK_SIZE, "PageHeader too large");
     static_assert(PAGE_HEADER_SIZE % 8 == 0, "PAGE_HEADER_SIZE can't be divided by 8");
+    static_assert(offsetof(KeyCellHeader, key_size) == 0 && offsetof(KeyValueCellHeader, key_size) == 0,
+                  "cell headers must start with the key size");
+    static_assert(KEY_CELL_HEADER_SIZE == KEY_VALUE_CELL_HEADER_SIZE);
+    static_assert(KEY_CELL_HEADER_SIZE >= FREE_BLOCK_SIZE, "a freed cell must hold a free block");
+    static_assert(std::bit_width(PAGE_SIZE) - std::bit_width(FREE_BLOCK_SIZE) < FREE_BIN_NUM);
+
+    using head_t = uint32_t;
+    // an entry of the slot array, the head is the first bytes of the key in the cell as a big-endian integer,
+    // a smaller head means a smaller key, so the full keys are compared only if the heads are equal
+    struct Slot
+    {
+        offset_t offset;
+        head_t head;
+    };
+
+    // the missing bytes of a short key are zeros
+    inline head_t key_head(std::string_view key)
+    {
+        head_t head = 0;
+        if (key.size() >= sizeof(head_t))
+        {
+            std::memcpy(&head, key.data(), sizeof(head_t));
+            return std::endian::native == std::endian::little ? __builtin_bswap32(head) : head;
+        }
+        for (auto i : iota(0u, sizeof(head_t)))
+            head = head << 8 | (i < key.size() ? uint8_t(key[i]) : 0);
+        return head;
+    }
+
+    constexpr num_t MAX_CELL_NUM = (PAGE_SIZE - PAGE_HEADER_SIZE) / sizeof(Slot);
+    // a node using less space for its cells, slots and fences is underfull,
+    // two nodes are merged if the result uses no more than MAX_MERGE_FILL, so it isn't split again soon
+    constexpr size_t MIN_FILL = (PAGE_SIZE - PAGE_HEADER_SIZE) / 4,
+                     MAX_MERGE_FILL = (PAGE_SIZE - PAGE_HEADER_SIZE) * 3 / 4;
+
+    // the header of an empty page without its fences, Format records log it
+    struct EmptyPage
+    {
+        CellType type;
+        id_t rightmost_child;
+        id_t prev_leaf;
+        id_t next_leaf;
+    };
+
+    /*
+    A value longer than MAX_INLINE_VALUE is cut into chunks stored in overflow pages, one chunk a page,
+    and an index page lists the chunks, the cell holds a reference to the index page.
+    The pages are never modified until they're freed, and freeing or reusing a page changes its page lsn,
+    so a reader holding a reference checks the page lsns to tell whether the pages still hold the value.
+    */
+    struct OverflowRef
+    {
+        uint64_t length;
+        lsn_t index_lsn; // the page lsn of the index page
+        id_t index_page;
+        num_t page_num; // the chunks
+    };
+    struct OverflowEntry
+    {
+        lsn_t page_lsn;
+        id_t page_id;
+        len_t chunk_len;
+    };
+    // an overflow page holds the length of its chunk and the chunk after the header
+    constexpr size_t OVERFLOW_CAPACITY = PAGE_SIZE - PAGE_HEADER_SIZE - sizeof(len_t),
+                     MAX_INLINE_VALUE = PAGE_SIZE / 8,
+                     MAX_OVERFLOW_PAGES = OVERFLOW_CAPACITY / sizeof(OverflowEntry),
+                     MAX_VALUE_SIZE = MAX_OVERFLOW_PAGES * OVERFLOW_CAPACITY;
+    static_assert(sizeof(OverflowRef) == 24 && sizeof(OverflowEntry) == 16, "overflow references must have no padding");
+
+    // the crc32c of the page except the checksum itself
+    inline checksum_t page_checksum(const char *page)
+    {
+        static_assert(offsetof(PageHeader, checksum) == 0);
+        return crc32c(page + sizeof(checksum_t), PAGE_SIZE - sizeof(checksum_t));
+    }
 
     class Cell
     {
@@ -94,22 +199,10 @@ namespace cyber
         virtual std::string_view key_str() = 0;
         virtual void write_key(const char *key, const len_t n) = 0;
         virtual void write_key(std::string_view key) { write_key(key.data(), static_cast<len_t>(key.length())); }
+        // keys are compared as unsigned bytes, the same as std::string_view
         friend auto operator<=>(const Cell &lhs, std::string_view rhs)
         {
-            for (auto i : iota(0ul, lhs.key_len() < rhs.length() ? lhs.key_len()
-                                                                 : rhs.length()))
-            {
-                if (lhs.key[i] < rhs[i])
-                    return std::partial_ordering::less;
-                else if (lhs.key[i] > rhs[i])
-                    return std::partial_ordering::greater;
-            }
-
-            if (lhs.key_len() == rhs.length())
-                return std::partial_ordering::equivalent;
-
-            return lhs.key_len() < rhs.length() ? std::partial_ordering::less
-                                                : std::partial_ordering::greater;
+            return std::string_view(lhs.key, lhs.key_len()) <=> rhs;
         }
         friend auto operator==(const Cell &lhs, std::string_view rhs) { return lhs <=> rhs == 0; }
     };
@@ -157,110 +250,200 @@ namespace cyber
         }
 
         len_t key_len() const override { return header->key_size; }
-        size_t size() const override { return KEY_CELL_HEADER_SIZE + header->key_size + header->value_size; }
+        size_t size() const override { return KEY_CELL_HEADER_SIZE + header->key_size + value_len(); }
         std::string_view key_str() override { return std::string_view(key, header->key_size); }
         void write_key(const char *key, const len_t n) override { memcpy(this->key, key, header->key_size = n); }
         // void write_key(std::string_view key) override { Cell::write_key(key); }
         using Cell::write_key;
 
-        inline len_t value_len() const { return header->value_size; }
-        std::string_view value_str() const { return std::string_view(value, header->value_size); }
-        inline void write_value(const char *value, const len_t n) { memcpy(this->value, value, header->value_size = n); }
-        inline void write_value(std::string_view value) { write_value(value.data(), static_cast<len_t>(value.length())); }
+        inline len_t value_len() const { return header->value_size & ~OVERFLOW_VALUE; }
+        // the value is an OverflowRef
+        inline bool overflows() const { return header->value_size & OVERFLOW_VALUE; }
+        std::string_view value_str() const { return std::string_view(value, value_len()); }
+        inline void write_value(const char *value, const len_t n, bool overflow = false)
+        {
+            memcpy(this->value, value, n);
+            header->value_size = n | (overflow ? OVERFLOW_VALUE : 0);
+        }
+        inline void write_value(std::string_view value, bool overflow = false) { write_value(value.data(), static_cast<len_t>(value.length()), overflow); }
     };
 
     class BTreeNode
     {
     public:
-        const id_t page_id;
+        // frame descriptor, dirty is protected by the latch of the buffer manager,
+        // pin_count is updated without it, see BufferManager::pin()
+        id_t page_id;
+        OptLatch latch;
+        std::atomic<uint32_t> pin_count = 0;
+        bool dirty = false;
+        // the node holding a swizzled reference to this node, protected by the latch of this node,
+        // it may be stale, the reference is looked up in the parent before unswizzling
+        BTreeNode *parent = nullptr;
+        // set by the accesses through swizzled references, which bypass the buffer manager
+        std::atomic<bool> referenced = false;
+        // the lsn of the first record since the page was written, INVALID_LSN if it's clean,
+        // it's written with the latch held and read by checkpoints without the latch
+        lsn_t rec_lsn = INVALID_LSN;
+
+        // the frame is owned by the buffer manager and doesn't contain a page yet,
+        // call reload() after reading a page into it
+        BTreeNode(char *frame, WriteAheadLog *wal) : page_id(INVALID_PAGE_ID), page(frame), wal(wal)
+        {
+            header = (PageHeader *)frame;
+            slots = (Slot *)(frame + PAGE_HEADER_SIZE);
+        }
 
-        // BTreeNode(uint32_t page_id) : page_id(page_id) {}
-        BTreeNode(id_t page_id, char *buf, WriteAheadLog *wal) : page_id(page_id), page(buf), wal(wal)
+        // a page has been read into the buffer, rebuild the in-memory state
+        // the caller must hold the latch exclusively
+        void reload(id_t page_id)
         {
-            header = (PageHeader *)buf;
-            pointers = (offset_t *)(buf + PAGE_HEADER_SIZE);
+            this->page_id = page_id;
+            parent = nullptr;
+            referenced.store(false, std::memory_order_relaxed);
+            std::atomic_ref(rec_lsn).store(INVALID_LSN, std::memory_order_relaxed);
 
             init_check();
-            init_available_list();
         }
-        ~BTreeNode() { operator delete(page, (std::align_val_t)BLOCK_SIZE); }
+        // copy the page of another frame, its checksum is stale until the page is written
+        // the caller must hold both latches exclusively
+        void copy(BTreeNode *node)
+        {
+            std::memcpy(page, node->page, PAGE_SIZE);
+            reload(node->page_id);
+            valid = node->valid;
+        }
 
-        inline const char *raw_page() { return this->page; }
-        inline offset_t wal_end_off() { return this->max_wal_end_off; }
+        inline char *raw_page() { return this->page; }
+
+        // a batch of searches prefetches its pages in two steps, the header first,
+        // then the fences and the slots located by the header, so the searches don't wait for the memory one by one
+        inline void prefetch_header() const { __builtin_prefetch(page); }
+        void prefetch_slots() const
+        {
+            __builtin_prefetch(page + std::min<offset_t>(header->fence_off, PAGE_SIZE - 1));
+            const char *end = (const char *)(slots + safe_data_num());
+            for (const char *line = (const char *)slots; line < end; line += CACHE_LINE_SIZE)
+                __builtin_prefetch(line);
+        }
+        // the first lines of the cell found by a search
+        void prefetch_cell(num_t i) const
+        {
+            if (i >= safe_data_num())
+                return;
+            offset_t off = safe_cell_offset(i);
+            __builtin_prefetch(page + off);
+            __builtin_prefetch(page + std::min<size_t>(off + CACHE_LINE_SIZE, PAGE_SIZE - 1));
+        }
 
         // header methods
         inline CellType type() const { return header->type; }
         inline num_t data_num() const { return header->data_num; }
         inline id_t &rightmost_child() { return header->rightmost_child; }
-        // re-calculate the checksum
-        // if you try to check, save the header->checksum first
-        checksum_t cal_checksum()
-        {
-            header->checksum = header->header_checksum();
-            auto n = PAGE_SIZE / sizeof(header->checksum);
-            checksum_t *data = (checksum_t *)page;
-            for (auto i : iota(PAGE_HEADER_SIZE / sizeof(checksum_t), n))
-                header->checksum ^= data[i];
-
-            return header->checksum;
-        }
-        inline len_t free_space() const { return header->cell_end - static_cast<len_t>(PAGE_HEADER_SIZE) - header->data_num * static_cast<len_t>(sizeof(offset_t)); }
+        // re-calculate the checksum, it's called before the page is written
+        checksum_t cal_checksum() { return header->checksum = page_checksum(page); }
+        // false if the checksum didn't match when the page was loaded, the page mustn't be used or written
+        inline bool is_valid() const { return valid; }
+        inline len_t free_space() const { return header->cell_end - static_cast<len_t>(PAGE_HEADER_SIZE) - header->data_num * static_cast<len_t>(sizeof(Slot)); }
+        // the bytes of the cells, the slots and the fences
+        inline size_t used_space() const { return PAGE_SIZE - PAGE_HEADER_SIZE - free_space() - header->free_bytes; }
+        inline bool underfull() const { return used_space() < MIN_FILL; }
 
         // cell methods
         inline KeyCell key_cell(num_t i) { return KeyCell(raw_cell(i)); }
         inline KeyCell key_cell_at(offset_t off) { return KeyCell(page + off); }
         inline KeyValueCell key_value_cell(num_t i) { return KeyValueCell(raw_cell(i)); }
         inline KeyValueCell key_value_cell_at(offset_t off) { return KeyValueCell(page + off); }
+
+        // bounds-checked accessors, they never read outside of the page even if a writer is modifying it,
+        // an optimistic reader must validate the latch version before trusting the result
+        std::string_view lower_fence() const
+        {
+            offset_t off = std::clamp<offset_t>(header->fence_off, PAGE_HEADER_SIZE, PAGE_SIZE);
+            return std::string_view(page + off, std::min<len_t>(header->lower_fence_len, PAGE_SIZE - off));
+        }
+        std::string_view upper_fence() const
+        {
+            offset_t off = std::clamp<offset_t>(header->fence_off + lower_fence().size(), PAGE_HEADER_SIZE, PAGE_SIZE);
+            return std::string_view(page + off, std::min<len_t>(header->upper_fence_len, PAGE_SIZE - off));
+        }
+        std::string_view prefix() const { return lower_fence().substr(0, header->prefix_len); }
+        // the key stored in the cell, without the prefix
+        std::string_view cell_suffix(num_t i) const
+        {
+            offset_t off = safe_cell_offset(i);
+            len_t len = std::min<len_t>(*(len_t *)(page + off), PAGE_SIZE - off - KEY_CELL_HEADER_SIZE);
+            return std::string_view(page + off + KEY_CELL_HEADER_SIZE, len);
+        }
+        std::string cell_key(num_t i) const
+        {
+            std::string key(prefix());
+            key += cell_suffix(i);
+            return key;
+        }
+        bool cell_key_equals(num_t i, std::string_view key) const
+        {
+            std::string_view prefix = this->prefix();
+            return key.starts_with(prefix) && key.substr(prefix.size()) == cell_suffix(i);
+        }
+        std::string_view cell_value(num_t i) const
+        {
+            offset_t off = safe_cell_offset(i);
+            const KeyValueCellHeader *cell_header = (const KeyValueCellHeader *)(page + off);
+            offset_t value_off = off + KEY_VALUE_CELL_HEADER_SIZE + std::min<len_t>(cell_header->key_size, PAGE_SIZE - off - KEY_VALUE_CELL_HEADER_SIZE);
+            len_t len = std::min<len_t>(cell_header->value_size & ~OVERFLOW_VALUE, PAGE_SIZE - value_off);
+            return std::string_view(page + value_off, len);
+        }
+        // the value of the cell is an OverflowRef
+        bool cell_overflows(num_t i) const { return ((const KeyValueCellHeader *)(page + safe_cell_offset(i)))->value_size & OVERFLOW_VALUE; }
+        id_t cell_child(num_t i) const { return ((const KeyCellHeader *)(page + safe_cell_offset(i)))->child_id; }
+
         void remove(num_t index)
         {
+            // the removed cell with the full key is the before image
+            std::string before = full_cell(index);
             Record *rec = LogicalRecord::new_record(wal->gen_id(), page_id,
                                                     RecordType::Remove, sizeof(index), 0,
-                                                    (char *)&index, nullptr);
-            max_wal_end_off = wal->log(*rec);
+                                                    (char *)&index, nullptr,
+                                                    before.size(), before.data());
+            log(rec);
             delete[]((char *)rec);
 
             remove_cell(index);
-            std::memmove(pointers + index, pointers + index + 1, (header->data_num - index - 1) * sizeof(uint32_t));
+            std::memmove(slots + index, slots + index + 1, (header->data_num - index - 1) * sizeof(Slot));
             header->data_num--;
         }
 
         // KeyCell methods
-        num_t find_child_index(std::string_view key)
+        num_t find_child_index(std::string_view key) const
         {
-            return static_cast<num_t>(std::upper_bound(pointers, pointers + header->data_num, key, [&](std::string_view key, const offset_t offset) {
-                                          return KeyCell(page + offset) > key;
-                                      }) -
-                                      pointers);
+            return search<true>(key);
         }
-        id_t find_child(std::string_view key)
+        id_t find_child(std::string_view key) const { return child_at(find_child_index(key)); }
+        // the child of the index, or the rightmost child if the index is data_num
+        id_t child_at(num_t index) const
         {
-            num_t index = find_child_index(key);
-            if (index < header->data_num)
-                return key_cell(index).child();
+            if (index < safe_data_num())
+                return cell_child(index);
             return header->rightmost_child;
         }
-        bool can_hold_kcell(std::string_view key)
+        // the caller must hold the latch exclusively, it's not logged
+        // unswizzle the children before a logged update, the before image must be a page id
+        inline id_t &child_slot(num_t index)
         {
-            size_t kcell_size = KEY_CELL_HEADER_SIZE + key.length();
-
-            if (free_space() >= kcell_size + sizeof(offset_t))
-                return true;
-
-            auto it = ranges::find_if(available_list, [kcell_size](const AvailableEntry &entry) {
-                return entry.len >= kcell_size;
-            });
-
-            if (it != available_list.end() && free_space() >= sizeof(offset_t))
-                return true;
-
-            return false;
+            if (index < header->data_num)
+                return ((KeyCellHeader *)raw_cell(index))->child_id;
+            return header->rightmost_child;
         }
+        bool can_hold_kcell(std::string_view key) { return can_hold(KEY_CELL_HEADER_SIZE + suffix_of(key).length()); }
         std::optional<offset_t> try_update_child(num_t index, const id_t child)
         {
+            id_t old_child = child_slot(index);
             Record *rec = LogicalRecord::new_record(wal->gen_id(), page_id,
                                                     RecordType::Update, sizeof(index), sizeof(child),
-                                                    (char *)&index, (char *)&child);
-            max_wal_end_off = wal->log(*rec);
+                                                    (char *)&index, (char *)&child,
+                                                    sizeof(old_child), (char *)&old_child);
+            log(rec);
             delete[]((char *)rec);
 
             if (index >= header->data_num)
@@ -270,281 +453,574 @@ namespace cyber
             }
 
             key_cell(index).write_child(child);
-            return pointers[index];
+            return slots[index].offset;
         }
         std::optional<offset_t> try_insert_child(std::string_view key, const id_t child)
         {
-            Record *rec = LogicalRecord::new_record(wal->gen_id(), page_id,
-                                                    RecordType::Insert, key.length(), sizeof(child),
-                                                    key.data(), (char *)&child);
-            max_wal_end_off = wal->log(*rec);
-            delete[]((char *)rec);
-
             num_t index = find_child_index(key);
-            if (index >= header->data_num && header->data_num > 0)
-                return std::nullopt;
 
-            offset_t cell_offset = insert_kcell(key, child);
+            offset_t cell_offset = insert_kcell(suffix_of(key), child);
             if (cell_offset == 0)
                 return std::nullopt;
 
-            if (header->cell_end > cell_offset)
-                header->cell_end = cell_offset;
+            Record *rec = LogicalRecord::new_record(wal->gen_id(), page_id,
+                                                    RecordType::Insert, key.length(), sizeof(child),
+                                                    key.data(), (char *)&child);
+            log(rec);
+            delete[]((char *)rec);
 
-            pointers[header->data_num] = cell_offset;
+            std::memmove(slots + index + 1, slots + index, (header->data_num - index) * sizeof(Slot));
+            slots[index] = Slot{cell_offset, key_head(suffix_of(key))};
             header->data_num++;
 
-            KeyCell kcell(page + cell_offset);
-            for (auto i : views::iota(index + 1, header->data_num) | views::reverse)
-                std::swap(pointers[i - 1], pointers[i]);
-
             return cell_offset;
         }
         // KeyValueCell methods
 
-        // equal to lower_bound
-        // return value -1 means there is no entry.
-        num_t find_value_index(std::string_view key)
+        // an optimistic reader must validate the latch version before following a link
+        inline id_t prev_leaf() const { return header->prev_leaf; }
+        inline id_t next_leaf() const { return header->next_leaf; }
+        void set_links(const id_t prev, const id_t next)
         {
-            return std::lower_bound(pointers, pointers + header->data_num, key, [&](const offset_t offset, std::string_view key) {
-                       return KeyValueCell(page + offset) < key;
-                   }) -
-                   pointers;
+            id_t links[2] = {prev, next}, old_links[2] = {header->prev_leaf, header->next_leaf};
+            Record *rec = LogicalRecord::new_record(wal->gen_id(), page_id,
+                                                    RecordType::SetLinks, 0, sizeof(links),
+                                                    nullptr, (char *)links,
+                                                    sizeof(old_links), (char *)old_links);
+            log(rec);
+            delete[]((char *)rec);
+
+            header->prev_leaf = prev;
+            header->next_leaf = next;
         }
-        bool can_hold_kvcell(std::string_view key, std::string_view value)
+
+        // the cells are rebuilt without the common prefix of the new fences,
+        // the caller must make sure the keys are in the fences and the page can hold them
+        void set_fences(std::string_view lower, std::string_view upper)
         {
-            size_t kvcell_size = KEY_VALUE_CELL_HEADER_SIZE + key.length() + value.length();
+            std::string fences = encode_fences(lower, upper), old_fences = encode_fences(lower_fence(), upper_fence());
+            Record *rec = LogicalRecord::new_record(wal->gen_id(), page_id,
+                                                    RecordType::SetFences, 0, fences.size(),
+                                                    nullptr, fences.data(),
+                                                    old_fences.size(), old_fences.data());
+            log(rec);
+            delete[]((char *)rec);
 
-            if (free_space() >= kvcell_size + sizeof(offset_t))
-                return true;
+            rebuild(fences);
+        }
 
-            auto it = ranges::find_if(available_list, [kvcell_size](const AvailableEntry &entry) {
-                return entry.len >= kvcell_size;
-            });
+        // the page becomes an empty page of the type without fences, a free page is linked to the next one,
+        // the caller must have removed the cells
+        void reformat(CellType type, const id_t next = INVALID_PAGE_ID)
+        {
+            EmptyPage empty{type, page_id, INVALID_PAGE_ID, next};
+            std::string image((char *)&empty, sizeof(empty));
+            image += encode_fences({}, {});
+            format_empty(image);
+        }
 
-            if (it != available_list.end() && free_space() >= sizeof(offset_t))
-                return true;
+        // the cells in [begin, end) and their slots, if the keys were stored without a prefix of the length
+        size_t cells_bytes(num_t begin, num_t end, size_t prefix_len)
+        {
+            size_t bytes = 0;
+            for (auto i : iota(begin, end))
+                bytes += cell_size(i) + header->prefix_len - prefix_len + sizeof(Slot);
+            return bytes;
+        }
+        // the common prefix of the fences
+        static size_t prefix_len_of(std::string_view lower, std::string_view upper)
+        {
+            return upper.empty() ? 0 : ranges::mismatch(lower, upper).in1 - lower.begin();
+        }
 
-            return false;
+        // bulk loading, nothing is logged, the loader writes the page before the tree is swapped in
+        // an empty page of the type in the fences
+        void format(CellType type, std::string_view lower, std::string_view upper)
+        {
+            std::memset(page, 0, PAGE_HEADER_SIZE);
+            header->type = type;
+            header->cell_end = header->fence_off = PAGE_SIZE;
+            header->prev_leaf = header->next_leaf = INVALID_PAGE_ID;
+            rebuild(encode_fences(lower, upper));
         }
-        std::optional<offset_t> try_update_value(num_t index, std::string_view value)
+        // the key must be greater than the keys in the page, return false if the page can't hold the cell
+        bool append_value(std::string_view key, std::string_view value)
         {
-            Record *rec = LogicalRecord::new_record(wal->gen_id(), page_id,
-                                                    RecordType::Update, sizeof(index), value.length(),
-                                                    (char *)&index, value.data());
-            max_wal_end_off = wal->log(*rec);
-            delete[]((char *)rec);
+            offset_t cell_offset = insert_kvcell(suffix_of(key), value);
+            if (cell_offset == 0)
+                return false;
+            slots[header->data_num++] = Slot{cell_offset, key_head(suffix_of(key))};
+            return true;
+        }
+        bool append_child(std::string_view key, const id_t child)
+        {
+            offset_t cell_offset = insert_kcell(suffix_of(key), child);
+            if (cell_offset == 0)
+                return false;
+            slots[header->data_num++] = Slot{cell_offset, key_head(suffix_of(key))};
+            return true;
+        }
+        void link(const id_t prev, const id_t next)
+        {
+            header->prev_leaf = prev;
+            header->next_leaf = next;
+        }
 
+        // equal to lower_bound
+        // return value -1 means there is no entry.
+        num_t find_value_index(std::string_view key) const
+        {
+            return search<false>(key);
+        }
+        size_t kvcell_size(std::string_view key, std::string_view value) const
+        {
+            return KEY_VALUE_CELL_HEADER_SIZE + suffix_of(key).length() + value.length();
+        }
+        bool can_hold_kvcell(std::string_view key, std::string_view value) { return can_hold(kvcell_size(key, value)); }
+        // make sure the cells of the size in total and their slots fit, one by one in any order,
+        // the page is compacted if only the fragments leave enough space, it's not logged
+        bool reserve(size_t cells_size, num_t slot_num)
+        {
+            size_t size = cells_size + slot_num * sizeof(Slot);
+            if (free_space() >= size)
+                return true;
+            if (free_space() + header->free_bytes < size)
+                return false;
+            defragment();
+            return true;
+        }
+        // an overflowing value is an OverflowRef
+        std::optional<offset_t> try_update_value(num_t index, std::string_view value, bool overflow = false)
+        {
             KeyValueCell kvcell(key_value_cell(index));
 
             // append the new value, and mark the old cell as removed
             if (value.length() > kvcell.value_len())
             {
-                if (free_space() >= kvcell.size() - kvcell.value_len() + value.length())
-                {
-                    remove_cell(index);
-                    offset_t cell_offset = insert_kvcell(kvcell.key_str(), value);
-                    if (cell_offset == 0)
-                        return std::nullopt;
-
-                    return pointers[index] = cell_offset;
-                }
-                else
+                // the key may be overwritten after the old cell is removed
+                std::string suffix(kvcell.key_str());
+                if (!can_hold(KEY_VALUE_CELL_HEADER_SIZE + suffix.length() + value.length()))
                     return std::nullopt;
+
+                log_update_value(index, value, overflow, kvcell.value_str(), kvcell.overflows());
+                // the slot is taken out while the new cell is allocated, so a compaction doesn't move the old cell
+                Slot slot = slots[index];
+                remove_cell(index);
+                std::memmove(slots + index, slots + index + 1, (header->data_num - index - 1) * sizeof(Slot));
+                header->data_num--;
+                slot.offset = insert_kvcell(suffix, value, overflow);
+                std::memmove(slots + index + 1, slots + index, (header->data_num - index) * sizeof(Slot));
+                slots[index] = slot;
+                header->data_num++;
+
+                return slot.offset;
             }
             else
             {
+                log_update_value(index, value, overflow, kvcell.value_str(), kvcell.overflows());
                 len_t len = kvcell.value_len() - value.length();
-                kvcell.write_value(value);
+                kvcell.write_value(value, overflow);
                 if (len > 0)
-                    insert_available_entry(AvailableEntry(pointers[index] + kvcell.size(), len));
-                return pointers[index];
+                    free_cell(slots[index].offset + kvcell.size(), len);
+                return slots[index].offset;
             }
         }
         // return value: the offset of the new cell
         // return 0 when there is no enough free space
-        std::optional<offset_t> try_insert_value(std::string_view key, std::string_view value)
+        std::optional<offset_t> try_insert_value(std::string_view key, std::string_view value, bool overflow = false)
         {
+            offset_t cell_offset = insert_kvcell(suffix_of(key), value, overflow);
+            if (cell_offset == 0)
+                return std::nullopt;
+
             Record *rec = LogicalRecord::new_record(wal->gen_id(), page_id,
                                                     RecordType::Insert, key.length(), value.length(),
                                                     key.data(), value.data());
-            max_wal_end_off = wal->log(*rec);
+            logical_record(*rec)->flags = overflow ? RECORD_OVERFLOW : 0;
+            log(rec);
             delete[]((char *)rec);
 
-            offset_t cell_offset = insert_kvcell(key, value);
-            if (cell_offset == 0)
-                return std::nullopt;
-
-            if (header->cell_end > cell_offset)
-                header->cell_end = cell_offset;
-
             num_t index = find_value_index(key);
-            pointers[header->data_num] = cell_offset;
+            std::memmove(slots + index + 1, slots + index, (header->data_num - index) * sizeof(Slot));
+            slots[index] = Slot{cell_offset, key_head(suffix_of(key))};
             header->data_num++;
 
-            KeyValueCell kvcell(page + cell_offset);
-
-            for (auto i : views::iota(index + 1, header->data_num) | views::reverse)
-                std::swap(pointers[i - 1], pointers[i]);
-
             return cell_offset;
         }
 
-    private:
-        struct AvailableEntry
+        // overflow pages
+        // the chunk of an overflow page, bounds-checked for an optimistic reader
+        std::string_view chunk() const
         {
-            offset_t offset;
             len_t len;
-            AvailableEntry(offset_t offset, len_t len) : offset(offset), len(len) {}
-        };
-
-        // initialize
-        bool init_check()
+            std::memcpy(&len, page + PAGE_HEADER_SIZE, sizeof(len));
+            return std::string_view(page + PAGE_HEADER_SIZE + sizeof(len_t), std::min<size_t>(len, OVERFLOW_CAPACITY));
+        }
+        // the page must be a new overflow page, the chunk is logged as the value of a SetChunk record
+        void write_chunk(std::string_view chunk)
         {
-            checksum_t old_checksum = header->checksum;
-            if (old_checksum != cal_checksum())
-            {
-                valid = false;
-                return false;
-            }
+            Record *rec = LogicalRecord::new_record(wal->gen_id(), page_id,
+                                                    RecordType::SetChunk, 0, chunk.size(),
+                                                    nullptr, chunk.data());
+            log(rec);
+            delete[]((char *)rec);
 
-            return true;
+            len_t len = chunk.size();
+            std::memcpy(page + PAGE_HEADER_SIZE, &len, sizeof(len));
+            std::memcpy(page + PAGE_HEADER_SIZE + sizeof(len_t), chunk.data(), chunk.size());
         }
-        void init_available_list()
-        {
-            std::vector<offset_t> tmp_pointers(pointers, pointers + header->data_num);
-            ranges::sort(tmp_pointers, ranges::greater());
 
-            offset_t boundary = PAGE_SIZE;
-            for (auto i : views::iota(0u, header->data_num))
-            {
-                offset_t l = tmp_pointers[i],
-                         r = tmp_pointers[i] + cell_size_at(tmp_pointers[i]);
+        // recovery
 
-                if (boundary > r)
+        inline lsn_t page_lsn() const { return header->page_lsn; }
+        // apply the record at the lsn again without logging it, the caller must check the page lsn
+        void redo(const Record &rec, lsn_t lsn)
+        {
+            LogicalRecord *record = logical_record(rec);
+            lsn_t end_lsn = lsn + RECORD_HEADER_SIZE + rec.redo_len;
+            if (rec_lsn == INVALID_LSN)
+                std::atomic_ref(rec_lsn).store(lsn, std::memory_order_relaxed);
+            redo_end_lsn = end_lsn;
+            if (record->type == RecordType::Insert)
+            {
+                std::string key = record->key_string();
+                if (type() == CellType::KeyCell)
+                    try_insert_child(key, *(id_t *)(record->record + record->key_len));
+                else
+                {
+                    std::string value = record->value_string(redo_value_len(rec));
+                    try_insert_value(key, value, record->flags & RECORD_OVERFLOW);
+                }
+            }
+            else if (record->type == RecordType::Update)
+            {
+                num_t index = *(num_t *)record->record;
+                if (type() == CellType::KeyCell)
+                    try_update_child(index, *(id_t *)(record->record + record->key_len));
+                else
                 {
-                    available_list.push_back(AvailableEntry(r, boundary - r));
-                    total_available_space += boundary - r;
+                    std::string value = record->value_string(redo_value_len(rec));
+                    try_update_value(index, value, record->flags & RECORD_OVERFLOW);
                 }
-                boundary = l;
             }
+            else if (record->type == RecordType::Remove)
+            {
+                remove(*(num_t *)record->record);
+            }
+            else if (record->type == RecordType::SetLinks)
+            {
+                id_t *links = (id_t *)(record->record + record->key_len);
+                set_links(links[0], links[1]);
+            }
+            else if (record->type == RecordType::SetFences)
+            {
+                std::string fences = record->value_string(redo_value_len(rec));
+                auto [lower, upper] = decode_fences(fences);
+                set_fences(lower, upper);
+            }
+            else if (record->type == RecordType::Format)
+            {
+                format_empty(record->value_string(redo_value_len(rec)));
+            }
+            else if (record->type == RecordType::SetChunk)
+            {
+                write_chunk(record->value_string(redo_value_len(rec)));
+            }
+            redo_end_lsn = INVALID_LSN;
+            header->page_lsn = end_lsn;
         }
-
-        // available list
-        void insert_available_entry(const AvailableEntry &entry)
+        // apply the inverse of the record, it's logged as a compensation record by the caller's action
+        void undo(const Record &rec)
         {
-            auto it = ranges::find_if(available_list, [&entry](const AvailableEntry &in_list_entry) {
-                return entry.offset > in_list_entry.len;
-            });
-            it = available_list.insert(it, entry);
-            total_available_space += entry.len;
-
-            while (it != available_list.end())
+            LogicalRecord *record = logical_record(rec);
+            std::string before(record->undo_string(rec.redo_len));
+            if (record->type == RecordType::Insert)
+            {
+                std::string key = record->key_string();
+                if (num_t index = find_value_index(key); index < data_num() && cell_key_equals(index, key))
+                    remove(index);
+            }
+            else if (record->type == RecordType::Update)
+            {
+                num_t index = *(num_t *)record->record;
+                if (type() == CellType::KeyCell)
+                    try_update_child(index, *(id_t *)before.data());
+                else
+                    try_update_value(index, before, record->flags & RECORD_OVERFLOW_BEFORE);
+            }
+            else if (record->type == RecordType::Remove)
             {
-                auto next = std::next(it);
-                if (it->offset + it->len == next->offset)
+                if (type() == CellType::KeyCell)
                 {
-                    next->offset = it->offset;
-                    next->len += it->len;
-                    it = available_list.erase(next);
+                    KeyCell kcell(before.data());
+                    try_insert_child(kcell.key_str(), kcell.child());
                 }
                 else
                 {
-                    break;
+                    KeyValueCell kvcell(before.data());
+                    try_insert_value(kvcell.key_str(), kvcell.value_str(), kvcell.overflows());
                 }
             }
-
-            while (it != available_list.begin())
+            else if (record->type == RecordType::SetLinks)
             {
-                auto prev = std::prev(it);
-                if (prev->offset + prev->len == it->offset)
-                {
-                    it->offset = prev->offset;
-                    it->len += prev->len;
-                    it = available_list.erase(prev);
-                }
-                else
-                    break;
+                id_t *links = (id_t *)before.data();
+                set_links(links[0], links[1]);
             }
-        }
-
-        // cell methods
-        inline char *raw_cell(uint32_t i) { return page + pointers[i]; }
-        inline std::string_view cell_key(uint32_t i)
-        {
-            if (header->type == CellType::KeyCell)
+            else if (record->type == RecordType::SetFences)
             {
-                return key_cell(i).key_str();
+                auto [lower, upper] = decode_fences(before);
+                set_fences(lower, upper);
             }
-            else
+            else if (record->type == RecordType::Format)
             {
-                return key_value_cell(i).key_str();
+                // the page was empty before it was formatted, the records undone later refill it
+                format_empty(before);
             }
         }
-        inline size_t cell_size(uint32_t i)
+
+    private:
+        // initialize
+        bool init_check()
         {
-            if (header->type == CellType::KeyCell)
-            {
-                return key_cell(i).size();
-            }
+            valid = header->checksum == page_checksum(page);
+            return valid;
+        }
+        // the header and slots can't be trusted by an optimistic reader
+        inline num_t safe_data_num() const { return std::min(header->data_num, MAX_CELL_NUM); }
+        inline offset_t safe_cell_offset(num_t i) const
+        {
+            offset_t off = slots[std::min(i, MAX_CELL_NUM - 1)].offset;
+            return std::clamp<offset_t>(off, PAGE_HEADER_SIZE, PAGE_SIZE - KEY_CELL_HEADER_SIZE);
+        }
+
+        // the first index whose key is not less than the key, or greater than the key if upper is true,
+        // the heads narrow the range with integer compares before any cell is read
+        template <bool upper>
+        num_t search(std::string_view key) const
+        {
+            std::string_view prefix = this->prefix();
+            if (!key.starts_with(prefix))
+                return key < prefix ? 0 : safe_data_num();
+
+            std::string_view suffix = key.substr(prefix.size());
+            std::span<const Slot> all(slots, safe_data_num());
+            auto [lo, hi] = ranges::equal_range(all, key_head(suffix), ranges::less(), &Slot::head);
+            auto ties = iota(num_t(lo - all.begin()), num_t(hi - all.begin()));
+            auto proj = [this](const num_t i) { return cell_suffix(i); };
+            if constexpr (upper)
+                return *ranges::upper_bound(ties, suffix, ranges::less(), proj);
             else
+                return *ranges::lower_bound(ties, suffix, ranges::less(), proj);
+        }
+
+        // the key without the prefix, the key must be in the fences
+        std::string_view suffix_of(std::string_view key) const { return key.substr(std::min<size_t>(header->prefix_len, key.size())); }
+        // the cell with the full key, the key size is the first field of both cell headers
+        std::string full_cell(num_t index)
+        {
+            std::string_view prefix = this->prefix();
+            std::string cell(raw_cell(index), cell_size(index));
+            len_t key_len = *(len_t *)cell.data() + prefix.size();
+            std::memcpy(cell.data(), &key_len, sizeof(key_len));
+            cell.insert(KEY_CELL_HEADER_SIZE, prefix);
+            return cell;
+        }
+        // the cell fits in a free block or the contiguous free space, or it will after a compaction
+        bool can_hold(size_t cell_size) const
+        {
+            return free_space() >= sizeof(Slot) && free_space() - sizeof(Slot) + header->free_bytes >= cell_size;
+        }
+
+        // the fences are logged as the length of the lower fence, the lower fence and the upper fence
+        static std::string encode_fences(std::string_view lower, std::string_view upper)
+        {
+            len_t lower_len = lower.size();
+            std::string fences((char *)&lower_len, sizeof(lower_len));
+            fences += lower;
+            fences += upper;
+            return fences;
+        }
+        static std::tuple<std::string_view, std::string_view> decode_fences(std::string_view fences)
+        {
+            len_t lower_len = *(len_t *)fences.data();
+            fences.remove_prefix(sizeof(lower_len));
+            return {fences.substr(0, lower_len), fences.substr(lower_len)};
+        }
+        // rewrite the fences and the cells, the free space becomes contiguous
+        // it's not logged, set_fences() is
+        void rebuild(std::string_view encoded_fences)
+        {
+            thread_local std::vector<char> cells;
+            cells.assign(page, page + PAGE_SIZE);
+            std::string old_prefix(prefix());
+            auto [lower, upper] = decode_fences(encoded_fences);
+
+            header->fence_off = PAGE_SIZE - lower.size() - upper.size();
+            header->lower_fence_len = lower.size();
+            header->upper_fence_len = upper.size();
+            header->prefix_len = prefix_len_of(lower, upper);
+            std::memcpy(page + header->fence_off, lower.data(), lower.size());
+            std::memcpy(page + header->fence_off + lower.size(), upper.data(), upper.size());
+
+            // the prefix of a cell changes from the old one to the new one
+            offset_t cell_end = header->fence_off;
+            std::string key;
+            for (auto i : iota(0u, header->data_num))
             {
-                return key_value_cell(i).size();
+                char *cell = cells.data() + slots[i].offset;
+                len_t suffix_len = *(len_t *)cell;
+                key.assign(old_prefix).append(cell + KEY_CELL_HEADER_SIZE, suffix_len);
+                std::string_view suffix = suffix_of(key);
+                size_t rest = (header->type == CellType::KeyCell ? KeyCell(cell).size() : KeyValueCell(cell).size()) - KEY_CELL_HEADER_SIZE - suffix_len;
+
+                cell_end -= KEY_CELL_HEADER_SIZE + suffix.size() + rest;
+                std::memcpy(page + cell_end, cell, KEY_CELL_HEADER_SIZE);
+                *(len_t *)(page + cell_end) = suffix.size();
+                std::memcpy(page + cell_end + KEY_CELL_HEADER_SIZE, suffix.data(), suffix.size());
+                std::memcpy(page + cell_end + KEY_CELL_HEADER_SIZE + suffix.size(), cell + KEY_CELL_HEADER_SIZE + suffix_len, rest);
+                slots[i] = Slot{cell_end, key_head(suffix)};
             }
+
+            reset_free_space(cell_end);
         }
-        inline size_t cell_size_at(offset_t off)
+
+        // the header fields and the fences of the page as if it were empty
+        std::string empty_image() const
         {
-            if (header->type == CellType::KeyCell)
+            EmptyPage empty{header->type, header->rightmost_child, header->prev_leaf, header->next_leaf};
+            std::string image((char *)&empty, sizeof(empty));
+            image += encode_fences(lower_fence(), upper_fence());
+            return image;
+        }
+        // the page becomes the empty page of the image, it's logged
+        void format_empty(std::string_view image)
+        {
+            std::string old_image = empty_image();
+            Record *rec = LogicalRecord::new_record(wal->gen_id(), page_id,
+                                                    RecordType::Format, 0, image.size(),
+                                                    nullptr, image.data(),
+                                                    old_image.size(), old_image.data());
+            log(rec);
+            delete[]((char *)rec);
+
+            EmptyPage empty;
+            std::memcpy(&empty, image.data(), sizeof(empty));
+            header->type = empty.type;
+            header->data_num = 0;
+            header->rightmost_child = empty.rightmost_child;
+            header->prev_leaf = empty.prev_leaf;
+            header->next_leaf = empty.next_leaf;
+            rebuild(image.substr(sizeof(empty)));
+        }
+
+        void log_update_value(num_t index, std::string_view value, bool overflow, std::string_view old_value, bool old_overflow)
+        {
+            Record *rec = LogicalRecord::new_record(wal->gen_id(), page_id,
+                                                    RecordType::Update, sizeof(index), value.length(),
+                                                    (char *)&index, value.data(),
+                                                    old_value.length(), old_value.data());
+            logical_record(*rec)->flags = (overflow ? RECORD_OVERFLOW : 0) | (old_overflow ? RECORD_OVERFLOW_BEFORE : 0);
+            log(rec);
+            delete[]((char *)rec);
+        }
+
+        void log(Record *rec)
+        {
+            // the record is being redone
+            if (redo_end_lsn != INVALID_LSN)
             {
-                return key_cell_at(off).size();
+                header->page_lsn = redo_end_lsn;
+                return;
             }
-            else
+
+            // set before logging, so a checkpoint never misses the record
+            if (rec_lsn == INVALID_LSN)
+                std::atomic_ref(rec_lsn).store(wal->next_lsn(), std::memory_order_relaxed);
+            header->page_lsn = log_in_context(*wal, rec) + RECORD_HEADER_SIZE + rec->redo_len;
+        }
+
+        // free space
+        // a freed cell is linked into the bin of its size class, the blocks are never merged,
+        // so neither loading a page nor freeing a cell scans the cells,
+        // and the page is compacted lazily when the fragments are the only space left for a cell
+        static size_t bin_of(size_t size) { return std::bit_width(size) - std::bit_width(FREE_BLOCK_SIZE); }
+        inline FreeBlock *free_block(offset_t off) { return (FreeBlock *)(page + off); }
+        void link_free_block(offset_t off, len_t size)
+        {
+            size_t bin = bin_of(size);
+            *free_block(off) = FreeBlock{header->free_bins[bin], size};
+            header->free_bins[bin] = off;
+        }
+        void free_cell(offset_t off, len_t size)
+        {
+            if (off == header->cell_end)
             {
-                return key_value_cell_at(off).size();
+                header->cell_end += size;
+                return;
             }
+
+            header->free_bytes += size;
+            if (size >= FREE_BLOCK_SIZE)
+                link_free_block(off, size);
         }
-        // no side effects remove
-        // pointers will not be modified
-        void remove_cell(uint32_t index)
+        // return 0 if the page can't hold the cell and its slot
+        offset_t allocate_cell(size_t size)
         {
-            insert_available_entry(AvailableEntry(pointers[index], cell_size(index)));
+            if (!can_hold(size))
+                return 0;
 
-            while (!available_list.empty() && available_list.back().offset == header->cell_end)
+            // the first block of the size class may fit, and any block of a larger class fits
+            for (size_t bin = bin_of(size); bin < FREE_BIN_NUM; bin++)
             {
-                header->cell_end += available_list.back().len;
-                total_available_space -= available_list.back().len;
-                available_list.pop_back();
+                offset_t off = header->free_bins[bin];
+                if (off == 0 || free_block(off)->size < size)
+                    continue;
+
+                FreeBlock block = *free_block(off);
+                header->free_bins[bin] = block.next;
+                header->free_bytes -= size;
+                // the rest too small for a block stays as a fragment until the next compaction
+                if (block.size - size >= FREE_BLOCK_SIZE)
+                    link_free_block(off + size, block.size - size);
+                return off;
             }
-        }
 
-        // KeyCell methods
-        // you should grantee there is enough free space
-        offset_t insert_kcell(std::string_view key, const id_t child)
+            if (free_space() < size + sizeof(Slot))
+                defragment();
+            return header->cell_end -= size;
+        }
+        void reset_free_space(offset_t cell_end)
         {
-            size_t kcell_size = KEY_CELL_HEADER_SIZE + key.length();
-            auto it = ranges::find_if(available_list, [kcell_size](const AvailableEntry &entry) {
-                return entry.len >= kcell_size;
-            });
-
-            offset_t cell_offset;
-            if (it != available_list.end() && free_space() >= sizeof(offset_t))
-            {
-                cell_offset = it->offset;
-                if (it->len > kcell_size)
-                    it->offset += kcell_size;
-                else
-                    available_list.erase(it);
+            header->cell_end = cell_end;
+            header->free_bytes = 0;
+            std::fill_n(header->free_bins, FREE_BIN_NUM, 0);
+        }
 
-                total_available_space -= kcell_size;
-            }
-            else if (free_space() >= kcell_size + sizeof(offset_t))
+        // cell methods
+        inline char *raw_cell(uint32_t i) { return page + slots[i].offset; }
+        inline size_t cell_size(uint32_t i)
+        {
+            if (header->type == CellType::KeyCell)
             {
-                cell_offset = header->cell_end - kcell_size;
+                return key_cell(i).size();
             }
             else
             {
-                return 0;
+                return key_value_cell(i).size();
             }
+        }
+        // no side effects remove
+        // slots will not be modified
+        void remove_cell(uint32_t index) { free_cell(slots[index].offset, cell_size(index)); }
+
+        // KeyCell methods
+        // slots will not be modified
+        // return 0 when there is no enough free space
+        offset_t insert_kcell(std::string_view key, const id_t child)
+        {
+            offset_t cell_offset = allocate_cell(KEY_CELL_HEADER_SIZE + key.length());
+            if (cell_offset == 0)
+                return 0;
 
             KeyCell kcell(page + cell_offset);
             kcell.write_key(key);
@@ -554,76 +1030,47 @@ namespace cyber
         }
 
         // KeyValueCell methods
-        // no side effects insert
-        // header and pointers will not be modified
-        // you should grantee there is enough free space
-        offset_t insert_kvcell(std::string_view key, std::string_view value)
-        {
-            size_t kvcell_size = KEY_VALUE_CELL_HEADER_SIZE + key.length() + value.length();
-            auto it = ranges::find_if(available_list, [kvcell_size](const AvailableEntry &entry) {
-                return entry.len >= kvcell_size;
-            });
-
-            offset_t cell_offset;
-            if (it != available_list.end() && free_space() >= sizeof(offset_t))
-            {
-                cell_offset = it->offset;
-                if (it->len > kvcell_size)
-                    it->offset += kvcell_size;
-                else
-                    available_list.erase(it);
-
-                total_available_space -= kvcell_size;
-            }
-            else if (free_space() >= kvcell_size + sizeof(offset_t))
-            {
-                cell_offset = header->cell_end - kvcell_size;
-            }
-            else
-            {
+        // slots will not be modified
+        // return 0 when there is no enough free space
+        offset_t insert_kvcell(std::string_view key, std::string_view value, bool overflow = false)
+        {
+            offset_t cell_offset = allocate_cell(KEY_VALUE_CELL_HEADER_SIZE + key.length() + value.length());
+            if (cell_offset == 0)
                 return 0;
-            }
 
             KeyValueCell kvcell(page + cell_offset, key.length());
             kvcell.write_key(key);
-            kvcell.write_value(value);
+            kvcell.write_value(value, overflow);
 
             return cell_offset;
         }
 
-        len_t defragment()
+        // move the cells to the end of the page, so the free space is contiguous
+        // it's not logged, the records refer to the cells by index or key
+        void defragment()
         {
-            offset_t total_off = 0;
-            for (auto it = available_list.begin(), next = it; it != available_list.end(); it = next)
+            thread_local std::vector<char> cells;
+            cells.assign(page, page + PAGE_SIZE);
+
+            offset_t cell_end = header->fence_off;
+            for (auto i : iota(0u, header->data_num))
             {
-                total_off += it->len;
-                next = std::next(it);
-                offset_t cell_offset;
-                if (next != available_list.end())
-                    cell_offset = next->offset + next->len;
-                else
-                    cell_offset = header->cell_end;
-                std::memmove(page + cell_offset + total_off,
-                             page + cell_offset,
-                             cell_size_at(cell_offset));
+                char *cell = cells.data() + slots[i].offset;
+                size_t size = header->type == CellType::KeyCell ? KeyCell(cell).size() : KeyValueCell(cell).size();
+                cell_end -= size;
+                std::memcpy(page + cell_end, cell, size);
+                slots[i].offset = cell_end;
             }
 
-            available_list.clear();
-            total_available_space = 0;
-
-            header->cell_end += total_off;
-
-            return total_off;
+            reset_free_space(cell_end);
         }
 
         // data members
         bool valid = true; // true iff the checksum is correct
         char *page;
         PageHeader *header;
-        offset_t *pointers;                       // point to the offset of cells.
-        std::list<AvailableEntry> available_list; // descending by offset
-        len_t total_available_space = 0;
-        offset_t max_wal_end_off = 0;
+        Slot *slots; // the offsets and the key heads of cells, sorted by key
         WriteAheadLog *wal;
+        lsn_t redo_end_lsn = INVALID_LSN; // the end lsn of the record being redone
     };
 } // namespace cyber
\ No newline at end of file
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <memory>
+
+#include "engines/type.h"
+
+#include "page.hpp"
+
+namespace cyber
+{
+    /*
+    A map from page ids to small integers, e.g. the frames holding the pages, with a capacity fixed on construction.
+    It's an open addressing table with linear probing, allocated once, and a removal shifts the probed entries back
+    instead of leaving a tombstone, so it never has to be rebuilt. INVALID_PAGE_ID is never a key.
+    */
+    class PageTable
+    {
+    public:
+        static constexpr uint32_t NONE = UINT32_MAX;
+
+        // the table is kept at most half full
+        explicit PageTable(size_t capacity)
+            : mask(std::bit_ceil(std::max<size_t>(capacity * 2, 16)) - 1),
+              keys(std::make_unique<id_t[]>(mask + 1)),
+              values(std::make_unique<uint32_t[]>(mask + 1))
+        {
+            std::fill_n(keys.get(), mask + 1, INVALID_PAGE_ID);
+        }
+        PageTable(const PageTable &) = delete;
+
+        // NONE if it's absent
+        uint32_t find(id_t page_id) const
+        {
+            for (size_t i = home(page_id);; i = (i + 1) & mask)
+            {
+                if (keys[i] == page_id)
+                    return values[i];
+                if (keys[i] == INVALID_PAGE_ID)
+                    return NONE;
+            }
+        }
+        bool contains(id_t page_id) const { return find(page_id) != NONE; }
+
+        // insert or replace, the number of the keys mustn't exceed the capacity
+        void assign(id_t page_id, uint32_t value)
+        {
+            size_t i = home(page_id);
+            while (keys[i] != page_id && keys[i] != INVALID_PAGE_ID)
+                i = (i + 1) & mask;
+            keys[i] = page_id;
+            values[i] = value;
+        }
+
+        // a no-op if it's absent, e.g. INVALID_PAGE_ID
+        void erase(id_t page_id)
+        {
+            if (page_id == INVALID_PAGE_ID)
+                return;
+
+            size_t i = home(page_id);
+            while (keys[i] != page_id)
+            {
+                if (keys[i] == INVALID_PAGE_ID)
+                    return;
+                i = (i + 1) & mask;
+            }
+
+            // move back the following entries of the run which may be probed past the hole
+            for (size_t j = (i + 1) & mask; keys[j] != INVALID_PAGE_ID; j = (j + 1) & mask)
+            {
+                size_t k = home(keys[j]);
+                // k is cyclically in (i, j], the entry is reachable without the hole
+                if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+                    continue;
+                keys[i] = keys[j];
+                values[i] = values[j];
+                i = j;
+            }
+            keys[i] = INVALID_PAGE_ID;
+        }
+
+    private:
+        // fibonacci hashing, the page ids are dense
+        size_t home(id_t page_id) const { return (uint64_t(page_id) * 0x9E3779B97F4A7C15ull >> 32) & mask; }
+
+        size_t mask;
+        std::unique_ptr<id_t[]> keys;
+        std::unique_ptr<uint32_t[]> values;
+    };
+} // namespace cyber
@@ -0,0 +1,492 @@
+#pragma once
+
+#include <tuple>
+#include <vector>
+#include <memory>
+#include <functional>
+
+#include "engines/type.h"
+
+#include "page.hpp"
+#include "page_table.hpp"
+
+namespace cyber
+{
+    enum class ReplacementPolicy : uint8_t
+    {
+        Clock,
+        LruK,
+        TwoQueue,
+    };
+
+    /*
+    Page replacement policy of the buffer pool.
+    It's not thread safe, the buffer manager calls it with its buffer latch held.
+    The state of the nodes is kept in arrays indexed by their frames, allocated on construction,
+    so neither an insertion nor an eviction calls the allocator.
+    */
+    class Replacer
+    {
+    public:
+        Replacer(BTreeNode *nodes) : nodes(nodes) {}
+        virtual ~Replacer() {}
+
+        // a resident page is accessed
+        virtual void access(BTreeNode *node) = 0;
+        // a page has been loaded into the node
+        virtual void insert(BTreeNode *node) = 0;
+        // choose an evictable node and remove it from the replacer, return nullptr if there is no one
+        virtual BTreeNode *victim(std::function<bool(BTreeNode *)> const &evictable) = 0;
+
+    protected:
+        static constexpr uint32_t NONE = UINT32_MAX;
+
+        // consume the accesses through swizzled references since the last call
+        static bool take_reference(BTreeNode *node)
+        {
+            return node->referenced.load(std::memory_order_relaxed) && node->referenced.exchange(false, std::memory_order_relaxed);
+        }
+
+        uint32_t frame_of(BTreeNode *node) const { return node - nodes; }
+
+        BTreeNode *nodes;
+    };
+
+    // a doubly linked list of indexes threaded through the link arrays of its owner, lists may share the arrays
+    class IndexList
+    {
+    public:
+        static constexpr uint32_t NONE = UINT32_MAX;
+
+        IndexList(std::vector<uint32_t> &prev, std::vector<uint32_t> &next) : prev(prev), next(next) {}
+
+        size_t size() const { return num; }
+        bool empty() const { return num == 0; }
+        uint32_t back() const { return tail; }
+        // NONE at the front
+        uint32_t before(uint32_t i) const { return prev[i]; }
+
+        void push_front(uint32_t i)
+        {
+            prev[i] = NONE;
+            next[i] = head;
+            (head != NONE ? prev[head] : tail) = i;
+            head = i;
+            num++;
+        }
+
+        void erase(uint32_t i)
+        {
+            (prev[i] != NONE ? next[prev[i]] : head) = next[i];
+            (next[i] != NONE ? prev[next[i]] : tail) = prev[i];
+            num--;
+        }
+
+    private:
+        std::vector<uint32_t> &prev, &next;
+        uint32_t head = NONE, tail = NONE;
+        size_t num = 0;
+    };
+
+    // second chance, a sweeping hand clears the reference bits
+    class ClockReplacer : public Replacer
+    {
+    public:
+        ClockReplacer(BTreeNode *nodes, size_t capacity) : Replacer(nodes), referenced(capacity), resident(capacity) {}
+
+        void access(BTreeNode *node) override
+        {
+            if (uint32_t i = frame_of(node); resident[i])
+                referenced[i] = true;
+        }
+
+        void insert(BTreeNode *node) override
+        {
+            uint32_t i = frame_of(node);
+            referenced[i] = resident[i] = true;
+        }
+
+        BTreeNode *victim(std::function<bool(BTreeNode *)> const &evictable) override
+        {
+            // every reference bit is cleared in the first round
+            for (size_t i = 0; i < resident.size() * 2; i++, hand = (hand + 1) % resident.size())
+            {
+                if (!resident[hand])
+                    continue;
+
+                if (take_reference(nodes + hand) || referenced[hand])
+                    referenced[hand] = false;
+                else if (evictable(nodes + hand))
+                {
+                    resident[hand] = false;
+                    return nodes + hand;
+                }
+            }
+
+            return nullptr;
+        }
+
+    private:
+        size_t hand = 0;
+        std::vector<bool> referenced;
+        std::vector<bool> resident;
+    };
+
+    /*
+    LRU-K evicts the page whose K-th most recent access is the oldest,
+    pages accessed less than K times go first, so a scan can't push out the hot pages.
+    Accesses within the correlated period count as one, a scan reads a leaf several times in a row.
+    The history of evicted pages is retained for a while.
+
+    The resident frames are in a binary heap, and the histories are in a pool of slots,
+    one for each frame plus one for each retained page.
+    */
+    class LruKReplacer : public Replacer
+    {
+    public:
+        LruKReplacer(BTreeNode *nodes, size_t capacity, size_t k = 2, uint64_t correlated_period = 2)
+            : Replacer(nodes), capacity(capacity), k(k), correlated_period(correlated_period),
+              ranks(capacity), position(capacity, NONE), slot_of(capacity, NONE),
+              times(capacity * 2 * k), time_num(capacity * 2), page_of(capacity * 2), owner(capacity * 2, NONE),
+              histories(capacity * 2), retired(capacity)
+        {
+            heap.reserve(capacity);
+            touched.reserve(capacity);
+            skipped.reserve(capacity);
+            free_slots.reserve(capacity * 2);
+            for (uint32_t slot = capacity * 2; slot > 0; slot--)
+                free_slots.push_back(slot - 1);
+        }
+
+        void access(BTreeNode *node) override
+        {
+            uint32_t i = frame_of(node);
+            if (position[i] == NONE) // it's being evicted
+                return;
+
+            touch(i);
+            sift_down(position[i]);
+        }
+
+        void insert(BTreeNode *node) override
+        {
+            uint32_t i = frame_of(node);
+            uint32_t slot = histories.find(node->page_id);
+            if (slot == NONE)
+            {
+                slot = free_slots.back();
+                free_slots.pop_back();
+                time_num[slot] = 0;
+                page_of[slot] = node->page_id;
+                histories.assign(node->page_id, slot);
+            }
+            else if (owner[slot] != NONE) // the page has been copied to the node
+                slot_of[owner[slot]] = NONE;
+
+            owner[slot] = i;
+            slot_of[i] = slot;
+            touch(i);
+            if (position[i] == NONE)
+                push(i);
+            else
+                sift_down(position[i]);
+        }
+
+        BTreeNode *victim(std::function<bool(BTreeNode *)> const &evictable) override
+        {
+            BTreeNode *victim = nullptr;
+            touched.clear(); // accessed through swizzled references
+            skipped.clear();
+            while (!heap.empty())
+            {
+                uint32_t i = pop();
+                if (take_reference(nodes + i))
+                {
+                    touched.push_back(i);
+                    continue;
+                }
+                if (!evictable(nodes + i))
+                {
+                    skipped.push_back(i);
+                    continue;
+                }
+
+                retire(i);
+                victim = nodes + i;
+                break;
+            }
+
+            for (uint32_t i : touched)
+            {
+                touch(i);
+                push(i);
+            }
+            for (uint32_t i : skipped)
+                push(i);
+            return victim;
+        }
+
+    private:
+        // the k-th access time, then the last access time
+        using Rank = std::pair<uint64_t, uint64_t>;
+
+        // the accesses of a node whose page has been copied to another node are no longer recorded
+        void touch(uint32_t i)
+        {
+            uint32_t slot = slot_of[i];
+            if (slot == NONE)
+                return;
+
+            uint64_t *history = &times[slot * k]; // the most recent first, at most k
+            now++;
+            if (time_num[slot] > 0 && now - history[0] <= correlated_period)
+                history[0] = now;
+            else
+            {
+                for (size_t j = std::min<size_t>(time_num[slot], k - 1); j > 0; j--)
+                    history[j] = history[j - 1];
+                history[0] = now;
+                time_num[slot] = std::min<size_t>(time_num[slot] + 1, k);
+            }
+            // 0 if it's accessed less than k times
+            ranks[i] = {time_num[slot] < k ? 0 : history[k - 1], history[0]};
+        }
+
+        void retire(uint32_t i)
+        {
+            uint32_t slot = slot_of[i];
+            if (slot == NONE)
+                return;
+
+            slot_of[i] = owner[slot] = NONE;
+            if (retired_num == capacity)
+            {
+                id_t page_id = retired[retired_head];
+                retired_head = (retired_head + 1) % capacity;
+                retired_num--;
+                if (uint32_t oldest = histories.find(page_id); oldest != NONE && owner[oldest] == NONE)
+                {
+                    histories.erase(page_id);
+                    free_slots.push_back(oldest);
+                }
+            }
+            retired[(retired_head + retired_num++) % capacity] = page_of[slot];
+        }
+
+        bool before(uint32_t a, uint32_t b) const { return std::tie(ranks[a], a) < std::tie(ranks[b], b); }
+
+        void place(size_t pos, uint32_t i)
+        {
+            heap[pos] = i;
+            position[i] = pos;
+        }
+
+        void push(uint32_t i)
+        {
+            heap.push_back(i);
+            size_t pos = heap.size() - 1;
+            for (; pos > 0 && before(i, heap[(pos - 1) / 2]); pos = (pos - 1) / 2)
+                place(pos, heap[(pos - 1) / 2]);
+            place(pos, i);
+        }
+
+        uint32_t pop()
+        {
+            uint32_t top = heap.front();
+            position[top] = NONE;
+            uint32_t last = heap.back();
+            heap.pop_back();
+            if (!heap.empty())
+            {
+                place(0, last);
+                sift_down(0);
+            }
+            return top;
+        }
+
+        // the rank of a node only grows
+        void sift_down(size_t pos)
+        {
+            uint32_t i = heap[pos];
+            for (size_t child; (child = pos * 2 + 1) < heap.size(); pos = child)
+            {
+                if (child + 1 < heap.size() && before(heap[child + 1], heap[child]))
+                    child++;
+                if (!before(heap[child], i))
+                    break;
+                place(pos, heap[child]);
+            }
+            place(pos, i);
+        }
+
+        size_t capacity, k;
+        uint64_t correlated_period;
+        uint64_t now = 0;
+
+        // by frame
+        std::vector<uint32_t> heap;
+        std::vector<Rank> ranks;
+        std::vector<uint32_t> position; // in the heap, NONE if it's not there
+        std::vector<uint32_t> slot_of;
+        std::vector<uint32_t> touched, skipped;
+
+        // by history slot
+        std::vector<uint64_t> times;
+        std::vector<uint32_t> time_num;
+        std::vector<id_t> page_of;
+        std::vector<uint32_t> owner; // the frame holding the page, NONE if it's evicted
+        std::vector<uint32_t> free_slots;
+        PageTable histories;
+
+        // a ring of the evicted pages whose history is retained
+        std::vector<id_t> retired;
+        size_t retired_head = 0, retired_num = 0;
+    };
+
+    /*
+    Full 2Q: new pages enter the FIFO a1in, a page evicted from a1in is remembered in a1out,
+    and it's promoted to the LRU am when it's loaded again.
+    Pages read only once by a scan never reach am.
+    */
+    class TwoQueueReplacer : public Replacer
+    {
+    public:
+        TwoQueueReplacer(BTreeNode *nodes, size_t capacity)
+            : Replacer(nodes), kin(std::max<size_t>(capacity / 4, 1)), kout(std::max<size_t>(capacity / 2, 1)),
+              prev(capacity), next(capacity), queue_of(capacity, Queue::None), a1in(prev, next), am(prev, next),
+              out_page(kout), out_prev(kout), out_next(kout), a1out(out_prev, out_next), a1out_index(kout)
+        {
+            free_out.reserve(kout);
+            for (uint32_t slot = kout; slot > 0; slot--)
+                free_out.push_back(slot - 1);
+        }
+
+        void access(BTreeNode *node) override
+        {
+            // an access in a1in is correlated, don't promote it
+            if (uint32_t i = frame_of(node); queue_of[i] == Queue::Am)
+            {
+                am.erase(i);
+                am.push_front(i);
+            }
+        }
+
+        void insert(BTreeNode *node) override
+        {
+            uint32_t i = frame_of(node);
+            if (uint32_t slot = a1out_index.find(node->page_id); slot != NONE)
+            {
+                forget(slot);
+                am.push_front(i);
+                queue_of[i] = Queue::Am;
+            }
+            else
+            {
+                a1in.push_front(i);
+                queue_of[i] = Queue::A1in;
+            }
+        }
+
+        BTreeNode *victim(std::function<bool(BTreeNode *)> const &evictable) override
+        {
+            BTreeNode *node = nullptr;
+            if (a1in.size() > kin || am.empty())
+                node = victim_of(a1in, evictable, false);
+            if (node != nullptr)
+            {
+                // a node whose page has been copied to another node has nothing to remember
+                if (node->page_id != INVALID_PAGE_ID)
+                    remember(node->page_id);
+                return node;
+            }
+
+            if ((node = victim_of(am, evictable, true)) == nullptr)
+                node = victim_of(a1in, evictable, false);
+            return node;
+        }
+
+    private:
+        enum class Queue : uint8_t
+        {
+            None,
+            A1in,
+            Am,
+        };
+
+        // a referenced node in am is moved to the front, it's visited again at last
+        BTreeNode *victim_of(IndexList &queue, std::function<bool(BTreeNode *)> const &evictable, bool lru)
+        {
+            for (uint32_t i = queue.back(); i != NONE;)
+            {
+                uint32_t next = queue.before(i);
+                if (take_reference(nodes + i) && lru)
+                {
+                    queue.erase(i);
+                    queue.push_front(i);
+                    if (next != NONE) // otherwise it's already at the front
+                        i = next;
+                    continue;
+                }
+                if (!evictable(nodes + i))
+                {
+                    i = next;
+                    continue;
+                }
+
+                queue.erase(i);
+                queue_of[i] = Queue::None;
+                return nodes + i;
+            }
+
+            return nullptr;
+        }
+
+        void remember(id_t page_id)
+        {
+            if (uint32_t slot = a1out_index.find(page_id); slot != NONE)
+                forget(slot);
+            if (a1out.size() == kout)
+                forget(a1out.back());
+
+            uint32_t slot = free_out.back();
+            free_out.pop_back();
+            out_page[slot] = page_id;
+            a1out.push_front(slot);
+            a1out_index.assign(page_id, slot);
+        }
+
+        void forget(uint32_t slot)
+        {
+            a1out.erase(slot);
+            a1out_index.erase(out_page[slot]);
+            free_out.push_back(slot);
+        }
+
+        size_t kin, kout;
+
+        // by frame, a1in and am share the links
+        std::vector<uint32_t> prev, next;
+        std::vector<Queue> queue_of;
+        IndexList a1in, am;
+
+        // by a1out slot
+        std::vector<id_t> out_page;
+        std::vector<uint32_t> out_prev, out_next;
+        IndexList a1out;
+        std::vector<uint32_t> free_out;
+        PageTable a1out_index;
+    };
+
+    inline std::unique_ptr<Replacer> make_replacer(ReplacementPolicy policy, BTreeNode *nodes, size_t capacity)
+    {
+        switch (policy)
+        {
+        case ReplacementPolicy::Clock:
+            return std::make_unique<ClockReplacer>(nodes, capacity);
+        case ReplacementPolicy::LruK:
+            return std::make_unique<LruKReplacer>(nodes, capacity);
+        default:
+            return std::make_unique<TwoQueueReplacer>(nodes, capacity);
+        }
+    }
+} // namespace cyber
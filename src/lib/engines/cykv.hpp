@@ -4,75 +4,1176 @@
 #include <iostream>
 #include <fstream>
 #include <unordered_map>
+#include <shared_mutex>
+#include <algorithm>
+#include <optional>
+
+#include <sys/mman.h>
 
 #include "kv_engine.hpp"
+#include "engines/write_ahead_log.hpp"
+#include "engines/btree/checksum.hpp"
+#include "engines/keydir.hpp"
 
 namespace cyber
 {
-    struct LogIndex
-    {
-        uint32_t id;
-        uint64_t offset;
-        uint64_t len;
-    };
-
     enum class CommandType : uint8_t
     {
         Set,
         Remove,
+        Batch, // the value is the commands of a WriteBatch, they're recovered all or none
+    };
+
+    // the header of a command in the log, followed by the key and the value
+    struct CommandHeader
+    {
+        uint32_t checksum; // crc32c of the rest of the command
+        CommandType type;
+        uint8_t padding[3];
+        len_t key_len;
+        len_t value_len;
     };
+    static_assert(sizeof(CommandHeader) == 16);
 
     struct Command
     {
         CommandType opt_type;
-        std::string &key;
-        std::string &value;
+        std::string_view key;
+        std::string_view value;
+
+        // append the encoded command to the buffer
+        void encode(std::string &buf) const
+        {
+            size_t start = buf.size();
+            CommandHeader header{0, opt_type, {}, len_t(key.size()), len_t(value.size())};
+            buf.append((const char *)&header, sizeof(header));
+            buf.append(key);
+            buf.append(value);
+            uint32_t checksum = crc32c(buf.data() + start + sizeof(uint32_t), buf.size() - start - sizeof(uint32_t));
+            std::memcpy(buf.data() + start, &checksum, sizeof(checksum));
+        }
+        // decode the command at the start of the data, return its length, or 0 if it's torn or corrupted
+        static size_t decode(std::string_view data, Command &command)
+        {
+            CommandHeader header;
+            if (data.size() < sizeof(header))
+                return 0;
+            std::memcpy(&header, data.data(), sizeof(header));
+            size_t len = sizeof(header) + uint64_t(header.key_len) + header.value_len;
+            if (data.size() < len || header.type > CommandType::Batch ||
+                crc32c(data.data() + sizeof(uint32_t), len - sizeof(uint32_t)) != header.checksum)
+                return 0;
+
+            command.opt_type = header.type;
+            command.key = data.substr(sizeof(header), header.key_len);
+            command.value = data.substr(sizeof(header) + header.key_len, header.value_len);
+            return len;
+        }
+    };
+
+    // the header of a hint file, which lists the commands of a sealed log file, so it's loaded without its values
+    struct HintHeader
+    {
+        uint32_t checksum; // crc32c of the rest of the hint file
+        uint32_t id;       // the log file
+        uint64_t size;     // the length of the log file, the hint is stale if it differs
+        uint64_t garbage;  // the bytes which are garbage by themselves, the headers of the batches and the tombstones,
+                           // but the tombstones kept by a compaction
+    };
+    static_assert(sizeof(HintHeader) == 24);
+
+    // an entry of a hint file, followed by the key
+    struct HintEntry
+    {
+        CommandType type; // a command of a batch is an entry by itself
+        uint8_t padding[3];
+        len_t key_len;
+        uint64_t offset;
+        uint64_t len;
     };
+    static_assert(sizeof(HintEntry) == 24);
+
+    // a larger command is rejected
+    constexpr uint64_t MAX_COMMAND_SIZE = gb;
+    // the keydir packs the length of a command into 32 bits
+    static_assert(MAX_COMMAND_SIZE + 2 * sizeof(CommandHeader) <= UINT32_MAX);
+    // the compaction writes its output in chunks of it
+    constexpr size_t COMPACTION_BUFFER_SIZE = 1 << 20;
+    // the keydir entries switched to a compacted file per hold of the latches
+    constexpr size_t COMPACTION_SWITCH_NUM = 1024;
+    // the log id of a compacted file is aliased by it while the keydir entries are switched, it's never stored
+    constexpr uint32_t ALIAS_ID = 1u << 31;
 
+    // the background compaction rewrites the sealed files with the most garbage
+    struct CompactionOptions
+    {
+        std::chrono::milliseconds interval{100};
+        double garbage_ratio = 0.5;          // compact once the garbage exceeds the ratio of the files, and the files beyond it
+        size_t thread_num = 2;               // taken by open(), 0 disables the compaction
+        uint64_t bytes_per_second = 64 * mb; // the I/O budget shared by the threads, 0 for no limit
+    };
+
+    // the compaction threads share one budget of bytes per second
+    class RateLimiter
+    {
+    public:
+        // wait until the bytes fit in the budget, 0 means no limit
+        void request(uint64_t bytes, uint64_t bytes_per_second)
+        {
+            if (bytes_per_second == 0)
+                return;
+            std::chrono::steady_clock::time_point wake;
+            {
+                std::lock_guard lock(latch);
+                wake = std::max(next, std::chrono::steady_clock::now());
+                next = wake + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                  std::chrono::duration<double>(double(bytes) / double(bytes_per_second)));
+            }
+            std::this_thread::sleep_until(wake);
+        }
+
+    private:
+        std::mutex latch;
+        std::chrono::steady_clock::time_point next;
+    };
+
+    /*
+    A log-structured hash engine like Bitcask.
+    The commands are appended to the active log file, which is sealed and replaced by a new one once it's full,
+    and the keydir in memory maps every key to its latest command, so a get is one lookup and one positioned read.
+    A sealed file never changes, it's mapped and shared by all readers, who find the values in place,
+    only the active file is read by pread.
+    The keydir is rebuilt on open by replaying the hint files of the sealed files, which are loaded by threads in parallel,
+    and the commands of the active file, a torn command at the end of the active file is cut off.
+    A sealed file is hinted by the compaction which writes it, or by a compaction thread after it's sealed,
+    one without a valid hint is scanned on open and hinted then.
+    The stale commands are counted by the writer, and the background compaction rewrites the live commands
+    of a sealed file with enough garbage into a new file, which is renamed over it, so the order of the files is kept.
+    The keydir entries of the moved commands are switched unless they've been overwritten meanwhile,
+    and the old file is unmapped once the last read of it is done.
+    */
     class CyKV : public KvEngine
     {
     public:
+        CyKV(uint64_t max_log_size = 64 * mb) : writer(this), max_log_size(max_log_size) {}
+        CyKV(const CyKV &) = delete;
+        ~CyKV()
+        {
+            compactors.clear();
+            writer.close();
+            for (auto &[id, reader] : readers)
+                reader->unref();
+        }
+
         virtual OpStatus open(const char *path)
         {
-            
-        };
+            if (!fs::exists(path))
+                fs::create_directory(path);
+            dir = fs::path(path);
+
+            std::vector<uint32_t> ids;
+            for (auto &entry : fs::directory_iterator(dir))
+            {
+                uint32_t id;
+                if (entry.path().extension() == ".compact")
+                    fs::remove(entry.path()); // the output of an unfinished compaction or hint
+                else if (entry.path().extension() == ".log" && sscanf(entry.path().filename().c_str(), "cykv.%08x.log", &id) == 1)
+                    ids.push_back(id);
+            }
+            std::sort(ids.begin(), ids.end());
+            if (ids.empty())
+            {
+                ids.push_back(0);
+                std::ofstream(log_path(0));
+            }
+
+            uint32_t active = ids.back();
+            ids.pop_back();
+            for (uint32_t id : ids)
+                readers.emplace(id, new Reader(log_path(id))).first->second->seal(fs::file_size(log_path(id)));
+            readers.emplace(active, new Reader(log_path(active)));
+            if (auto res = load_hints(ids); res.err != OpError::Ok)
+                return res;
 
-        virtual OpStatus get(std::string_view key){
+            uint64_t end = 0;
+            if (auto res = load(active, end); res.err != OpError::Ok)
+                return res;
+            logs[active].size = end;
+            total_size += end;
+            writer.open(active, end);
 
+            for (size_t i = 0; i < compaction_options.thread_num; i++)
+                compactors.emplace_back([this](std::stop_token stop) { compact_in_background(stop); });
+            return OpStatus(OpError::Ok);
         };
 
-        virtual OpStatus set(std::string_view key, std::string value){
+        virtual OpStatus get(std::string_view key)
+        {
+            std::string buf;
+            Command command;
+            Reader *reader;
+            if (OpError err = find(key, buf, command, reader); err != OpError::Ok)
+                return OpStatus(err);
+            OpStatus res(OpError::Ok);
+            if (buf.empty())
+                res.value = command.value;
+            else
+            {
+                buf.erase(0, command.value.data() - buf.data());
+                res.value = std::move(buf);
+            }
+            reader->unref();
+            return res;
+        };
+
+        // a value in a sealed file is pinned in its mapping, which is kept until the handle is released
+        virtual OpStatus get(std::string_view key, PinnedValue &value)
+        {
+            std::string buf;
+            Command command;
+            Reader *reader;
+            if (OpError err = find(key, buf, command, reader); err != OpError::Ok)
+            {
+                value.reset();
+                return OpStatus(err);
+            }
+            if (buf.empty())
+                value.pin(command.value, [](void *reader, void *) { ((Reader *)reader)->unref(); }, reader, nullptr);
+            else
+            {
+                buf.erase(0, command.value.data() - buf.data());
+                value.assign(std::move(buf));
+                reader->unref();
+            }
+            return OpStatus(OpError::Ok);
+        }
+
+        // the keys are looked up at once, then the commands are read in the order of the files
+        virtual std::vector<OpStatus> multi_get(std::span<const std::string_view> keys)
+        {
+            std::vector<OpStatus> results(keys.size());
+            std::vector<std::tuple<LogIndex, Reader *, size_t>> found;
+            {
+                std::shared_lock lock(keydir_latch);
+                for (size_t i = 0; i < keys.size(); i++)
+                {
+                    if (const KeyDir::Entry *entry = keydir.find(keys[i]); entry != nullptr)
+                    {
+                        Reader *reader = readers.at(entry->id);
+                        reader->ref();
+                        found.emplace_back(entry->index(), reader, i);
+                    }
+                    else
+                        results[i] = OpStatus(OpError::KeyNotFound);
+                }
+            }
+            std::sort(found.begin(), found.end(), [](auto &a, auto &b) {
+                auto &x = std::get<0>(a), &y = std::get<0>(b);
+                return std::tie(x.id, x.offset) < std::tie(y.id, y.offset);
+            });
 
+            std::string buf;
+            Command command;
+            for (auto &[index, reader, i] : found)
+            {
+                if (OpError err = read(index, *reader, buf, command); err != OpError::Ok)
+                    results[i] = OpStatus(err);
+                else
+                    results[i] = OpStatus(OpError::Ok, command.value);
+                reader->unref();
+            }
+            return results;
         };
 
-        virtual OpStatus remove(std::string_view key){
+        virtual OpStatus set(std::string_view key, std::string_view value)
+        {
+            return set(key, value, durability);
+        };
+
+        virtual OpStatus remove(std::string_view key)
+        {
+            return remove(key, durability);
+        };
 
+        virtual OpStatus write(const WriteBatch &batch)
+        {
+            return write(batch, durability);
         };
 
-        virtual OpStatus scan(std::string_view start_key, std::string_view end_key){
+        OpStatus set(std::string_view key, std::string_view value, Durability durability)
+        {
+            if (key.size() + value.size() > MAX_COMMAND_SIZE)
+                return OpStatus(OpError::InvalidArgument);
+
+            std::string record;
+            Command{CommandType::Set, key, value}.encode(record);
+            Position end;
+            {
+                std::lock_guard lock(write_latch);
+                LogIndex index = writer.append(record);
+                std::unique_lock dir_lock(keydir_latch);
+                apply(CommandType::Set, key, index);
+                end = writer.position();
+            }
+            writer.commit(end, durability);
+            return OpStatus(OpError::Ok);
+        }
 
+        OpStatus remove(std::string_view key, Durability durability)
+        {
+            std::string record;
+            Command{CommandType::Remove, key, {}}.encode(record);
+            Position end;
+            {
+                std::lock_guard lock(write_latch);
+                // the keydir is only modified with write_latch held
+                if (!keydir.contains(key))
+                    return OpStatus(OpError::KeyNotFound);
+                LogIndex index = writer.append(record);
+                std::unique_lock dir_lock(keydir_latch);
+                apply(CommandType::Remove, key, index);
+                end = writer.position();
+            }
+            writer.commit(end, durability);
+            return OpStatus(OpError::Ok);
+        }
+
+        // the commands of the batch are appended as the value of one Batch command
+        OpStatus write(const WriteBatch &batch, Durability durability)
+        {
+            if (batch.empty())
+                return OpStatus(OpError::Ok);
+
+            std::string commands;
+            for (auto &op : batch.operations())
+            {
+                if (op.type == WriteBatch::OpType::Set)
+                    Command{CommandType::Set, op.key, op.value}.encode(commands);
+                else
+                    Command{CommandType::Remove, op.key, {}}.encode(commands);
+                if (commands.size() > MAX_COMMAND_SIZE)
+                    return OpStatus(OpError::InvalidArgument);
+            }
+            std::string record;
+            Command{CommandType::Batch, {}, commands}.encode(record);
+
+            Position end;
+            {
+                std::lock_guard lock(write_latch);
+                LogIndex index = writer.append(record);
+                std::unique_lock dir_lock(keydir_latch);
+                apply_batch(index, std::string_view(record).substr(sizeof(CommandHeader)));
+                end = writer.position();
+            }
+            writer.commit(end, durability);
+            return OpStatus(OpError::Ok);
         };
 
+        // the value is the number of the keys in [start_key, end_key), an empty end_key means no upper bound,
+        // the keydir is unordered, so every key is compared
+        virtual OpStatus scan(std::string_view start_key, std::string_view end_key)
+        {
+            if (!end_key.empty() && end_key <= start_key)
+                return OpStatus(OpError::Ok, std::string("0"));
+            size_t num = 0;
+            std::shared_lock lock(keydir_latch);
+            keydir.for_each([&](std::string_view key, const LogIndex &) {
+                num += key >= start_key && (end_key.empty() || key < end_key);
+            });
+            return OpStatus(OpError::Ok, std::to_string(num));
+        };
+
+        void set_durability(Durability durability) { this->durability = durability; }
+        // the thread number is taken by open()
+        void set_compaction_options(const CompactionOptions &options)
+        {
+            std::lock_guard lock(compaction_latch);
+            compaction_options = options;
+        }
+        // the bytes of the commands which are overwritten or removed
+        uint64_t uncompacted()
+        {
+            std::lock_guard lock(write_latch);
+            return writer.uncompacted;
+        }
+        size_t log_num()
+        {
+            std::shared_lock lock(keydir_latch);
+            return readers.size();
+        }
+        // the total size of the log files
+        uint64_t disk_size()
+        {
+            std::lock_guard lock(write_latch);
+            return total_size;
+        }
+        // the file and the length of it made durable, the files before it are durable too,
+        // a crash may lose the rest
+        std::pair<uint32_t, uint64_t> synced() { return writer.synced_position(); }
+
     private:
+        // the log id and the offset in it
+        using Position = std::pair<uint32_t, uint64_t>;
+
+        // a sealed file is mapped and read in place by any number of threads, the active one is read by pread,
+        // it's referenced by the engine until it's replaced by compaction, and by every read of it
         class Reader
         {
+        public:
+            explicit Reader(const fs::path &path)
+            {
+                fd = ::open(path.c_str(), O_RDONLY);
+                if (fd == -1)
+                {
+                    std::cerr << "open log file: " << strerror(errno);
+                    exit(-1);
+                }
+            }
+            Reader(const Reader &) = delete;
+            ~Reader()
+            {
+                if (const char *data = mapped.load(); data != nullptr)
+                    munmap((void *)data, mapped_len);
+                ::close(fd);
+            }
+
+            void ref() { refs.fetch_add(1, std::memory_order_relaxed); }
+            void unref()
+            {
+                if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    delete this;
+            }
+
+            // the file of the length never changes from now on
+            void seal(uint64_t len)
+            {
+                if (len == 0)
+                    return;
+                void *data = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+                if (data == MAP_FAILED)
+                {
+                    std::cerr << "map log file: " << strerror(errno);
+                    exit(-1);
+                }
+                // the gets touch a command each, reading ahead around it is wasted
+                madvise(data, len, MADV_RANDOM);
+                mapped_len = len;
+                mapped.store((const char *)data, std::memory_order_release);
+            }
+
+            // the command in the mapping, std::nullopt if the file isn't sealed
+            std::optional<std::string_view> view(const LogIndex &index) const
+            {
+                const char *data = mapped.load(std::memory_order_acquire);
+                if (data == nullptr)
+                    return std::nullopt;
+                if (index.offset + index.len > mapped_len)
+                    return std::string_view();
+                return std::string_view(data + index.offset, index.len);
+            }
+            bool read(const LogIndex &index, std::string &buf) const
+            {
+                buf.resize(index.len);
+                return pread64(fd, buf.data(), index.len, index.offset) == (ssize_t)index.len;
+            }
+            // the whole sealed file, it's empty if the file is
+            std::string_view data() const
+            {
+                const char *data = mapped.load(std::memory_order_acquire);
+                return data == nullptr ? std::string_view() : std::string_view(data, mapped_len);
+            }
+
         private:
-            std::ifstream reader;
+            std::atomic<uint32_t> refs = 1;
+            int fd;
+            std::atomic<const char *> mapped = nullptr;
+            uint64_t mapped_len = 0;
         };
 
+        // the appends are serialized by write_latch
         class Writer
         {
         public:
+            explicit Writer(CyKV *cykv) : cykv(cykv) {}
+
+            // append to the log file from the offset
+            void open(uint32_t id, uint64_t offset)
+            {
+                log_id = id;
+                this->offset = offset;
+                fd = ::open(cykv->log_path(id).c_str(), O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR);
+                if (fd == -1)
+                {
+                    std::cerr << "open log file: " << strerror(errno);
+                    exit(-1);
+                }
+            }
+            void close()
+            {
+                if (fd == -1)
+                    return;
+                sync(fd);
+                ::close(fd);
+                fd = -1;
+            }
+
+            LogIndex append(std::string_view record)
+            {
+                if (offset > 0 && offset + record.size() > cykv->max_log_size)
+                    roll();
+                if (pwrite64(fd, record.data(), record.size(), offset) != (ssize_t)record.size())
+                {
+                    std::cerr << "write log file: " << strerror(errno);
+                    exit(-1);
+                }
+                LogIndex index{log_id, offset, record.size()};
+                offset += record.size();
+                cykv->logs[log_id].size += record.size();
+                cykv->total_size += record.size();
+                return index;
+            }
+            Position position() const { return Position(log_id, offset); }
+
+            // make the log durable up to the position, the committers waiting meanwhile share the next sync
+            void commit(Position end, Durability durability)
+            {
+                if (durability == Durability::Async)
+                    return;
+
+                std::lock_guard lock(sync_latch);
+                if (end <= synced)
+                    return;
+                Position target;
+                int dup_fd;
+                {
+                    // a sealed file has been synced, the active one may be sealed while it's synced
+                    std::lock_guard write_lock(cykv->write_latch);
+                    target = position();
+                    dup_fd = dup(fd);
+                }
+                sync(dup_fd);
+                ::close(dup_fd);
+                synced = target;
+            }
+            Position synced_position()
+            {
+                std::lock_guard lock(sync_latch);
+                return synced;
+            }
+
+            uint64_t uncompacted = 0;
+            uint32_t log_id = 0;
+
         private:
+            // seal the active file, and append to a new one
+            void roll()
+            {
+                close();
+                cykv->readers.at(log_id)->seal(offset);
+                open(log_id + 1, 0);
+                std::unique_lock lock(cykv->keydir_latch);
+                cykv->readers.emplace(log_id, new Reader(cykv->log_path(log_id)));
+            }
+            static void sync(int fd)
+            {
+                if (fdatasync(fd) == -1)
+                {
+                    std::cerr << "sync log file: " << strerror(errno);
+                    exit(-1);
+                }
+            }
+
             CyKV *cykv;
-            uint64_t uncompacted;
-            std::ofstream writer;
+            int fd = -1;
+            uint64_t offset = 0;
+            std::mutex sync_latch;
+            Position synced;
         };
 
-        std::string dir;
-        std::map<std::string, LogIndex> keydir;
-        std::unordered_map<uint32_t, Reader> readers;
+        // find the command of the key, in place if its file is sealed, otherwise it's read into the buffer,
+        // the reader of the file is referenced if it's found, the caller must unref it
+        OpError find(std::string_view key, std::string &buf, Command &command, Reader *&reader)
+        {
+            LogIndex index;
+            {
+                std::shared_lock lock(keydir_latch);
+                const KeyDir::Entry *entry = keydir.find(key);
+                if (entry == nullptr)
+                    return OpError::KeyNotFound;
+                index = entry->index();
+                reader = readers.at(index.id);
+                reader->ref();
+            }
+            OpError err = read(index, *reader, buf, command);
+            if (err != OpError::Ok)
+                reader->unref();
+            return err;
+        }
+        OpError read(const LogIndex &index, const Reader &reader, std::string &buf, Command &command)
+        {
+            std::string_view record;
+            buf.clear();
+            if (auto view = reader.view(index); view.has_value())
+                record = *view;
+            else if (reader.read(index, buf))
+                record = buf;
+            if (Command::decode(record, command) != index.len)
+                return OpError::Corruption;
+            return OpError::Ok;
+        }
+
+        fs::path log_path(uint32_t id) const
+        {
+            char name[32];
+            snprintf(name, sizeof(name), "cykv.%08x.log", id);
+            return dir / name;
+        }
+
+        fs::path hint_path(uint32_t id) const
+        {
+            char name[32];
+            snprintf(name, sizeof(name), "cykv.%08x.hint", id);
+            return dir / name;
+        }
+
+        // the hints of the sealed files are read by the threads ahead of the replay, which is in the order of the files
+        OpStatus load_hints(const std::vector<uint32_t> &ids)
+        {
+            std::vector<std::optional<std::string>> hints(ids.size());
+            std::vector<bool> loaded(ids.size());
+            size_t next = 0, replayed = 0;
+            size_t thread_num = std::min<size_t>(ids.size(), std::max(1u, std::thread::hardware_concurrency()));
+            std::mutex mutex;
+            std::condition_variable_any cv;
+
+            std::vector<std::jthread> loaders;
+            for (size_t t = 0; t < thread_num; t++)
+            {
+                loaders.emplace_back([&](std::stop_token stop) {
+                    while (true)
+                    {
+                        size_t i;
+                        {
+                            // a few hints per thread wait for the replay at most, the rest are read later
+                            std::unique_lock lock(mutex);
+                            cv.wait(lock, stop, [&] { return next == ids.size() || next < replayed + 2 * thread_num; });
+                            if (stop.stop_requested() || next == ids.size())
+                                return;
+                            i = next++;
+                        }
+                        auto hint = read_hint(ids[i]);
+                        {
+                            std::lock_guard lock(mutex);
+                            hints[i] = std::move(hint);
+                            loaded[i] = true;
+                        }
+                        cv.notify_all();
+                    }
+                });
+            }
+
+            for (size_t i = 0; i < ids.size(); i++)
+            {
+                std::optional<std::string> hint;
+                {
+                    std::unique_lock lock(mutex);
+                    cv.wait(lock, [&] { return loaded[i]; });
+                    hint = std::move(hints[i]);
+                    replayed = i + 1;
+                }
+                cv.notify_all();
+                if (!hint.has_value())
+                    return OpStatus(OpError::Corruption);
+                replay_hint(*hint);
+            }
+            return OpStatus(OpError::Ok);
+        }
+
+        // the hint of the sealed file, it's built from the file and written if it's missing or stale,
+        // std::nullopt if the file is corrupted
+        std::optional<std::string> read_hint(uint32_t id)
+        {
+            std::string_view data = readers.at(id)->data();
+            std::error_code ec;
+            uint64_t hint_size = fs::file_size(hint_path(id), ec);
+            if (!ec)
+            {
+                std::string hint(hint_size, '\0');
+                std::ifstream file(hint_path(id), std::ios::binary);
+                file.read(hint.data(), hint.size());
+                HintHeader header;
+                if (file && hint.size() >= sizeof(header))
+                {
+                    std::memcpy(&header, hint.data(), sizeof(header));
+                    if (header.id == id && header.size == data.size() &&
+                        crc32c(hint.data() + sizeof(uint32_t), hint.size() - sizeof(uint32_t)) == header.checksum)
+                        return hint;
+                }
+            }
+
+            auto built = build_hint(id, data);
+            if (built.has_value())
+                write_hint(id, *built);
+            return built;
+        }
+
+        // list the commands of the sealed file, std::nullopt if one of them is corrupted,
+        // the tombstones of a compacted file have been kept as the live commands are, see compact()
+        static std::optional<std::string> build_hint(uint32_t id, std::string_view data, bool compacted = false)
+        {
+            HintHeader header{0, id, data.size(), 0};
+            std::string hint(sizeof(header), '\0');
+            auto add = [&](const Command &command, uint64_t offset, uint64_t len) {
+                if (command.opt_type == CommandType::Remove && !compacted)
+                    header.garbage += len;
+                HintEntry entry{command.opt_type, {}, len_t(command.key.size()), offset, len};
+                hint.append((const char *)&entry, sizeof(entry));
+                hint.append(command.key);
+            };
+
+            Command command, inner;
+            for (uint64_t offset = 0, len; offset < data.size(); offset += len)
+            {
+                if ((len = Command::decode(data.substr(offset), command)) == 0)
+                    return std::nullopt;
+                if (command.opt_type != CommandType::Batch)
+                {
+                    add(command, offset, len);
+                    continue;
+                }
+                header.garbage += sizeof(CommandHeader);
+                std::string_view commands = command.value;
+                uint64_t inner_offset = offset + sizeof(CommandHeader);
+                for (size_t inner_len; (inner_len = Command::decode(commands, inner)) > 0; inner_offset += inner_len)
+                {
+                    add(inner, inner_offset, inner_len);
+                    commands.remove_prefix(inner_len);
+                }
+            }
+            std::memcpy(hint.data(), &header, sizeof(header));
+            header.checksum = crc32c(hint.data() + sizeof(uint32_t), hint.size() - sizeof(uint32_t));
+            std::memcpy(hint.data(), &header.checksum, sizeof(uint32_t));
+            return hint;
+        }
+
+        // a hint is only an accelerator, it's rebuilt if it's lost, so the directory isn't synced for it
+        void write_hint(uint32_t id, std::string_view hint)
+        {
+            fs::path path = hint_path(id), temp_path = path;
+            temp_path += ".compact";
+            int fd = ::open(temp_path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+            if (fd == -1)
+            {
+                std::cerr << "open hint file: " << strerror(errno);
+                exit(-1);
+            }
+            if (pwrite64(fd, hint.data(), hint.size(), 0) != (ssize_t)hint.size() || fdatasync(fd) == -1)
+            {
+                std::cerr << "write hint file: " << strerror(errno);
+                exit(-1);
+            }
+            ::close(fd);
+            fs::rename(temp_path, path);
+        }
+
+        void replay_hint(std::string_view hint)
+        {
+            HintHeader header;
+            std::memcpy(&header, hint.data(), sizeof(header));
+            LogStats &stats = logs[header.id];
+            stats.size = header.size;
+            stats.hinted = true;
+            total_size += header.size;
+            add_garbage(header.id, header.garbage);
+
+            HintEntry entry;
+            for (size_t pos = sizeof(header); pos < hint.size(); pos += sizeof(entry) + entry.key_len)
+            {
+                std::memcpy(&entry, hint.data() + pos, sizeof(entry));
+                apply(entry.type, hint.substr(pos + sizeof(entry), entry.key_len), LogIndex{header.id, entry.offset, entry.len}, true);
+            }
+        }
+
+        // replay the commands of the active file, return its valid length by end,
+        // a torn command can only be at the end of it, it's cut off there
+        OpStatus load(uint32_t id, uint64_t &end)
+        {
+            std::ifstream file(log_path(id), std::ios::binary);
+            std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            Command command;
+            end = 0;
+            for (size_t len; (len = Command::decode(std::string_view(data).substr(end), command)) > 0; end += len)
+            {
+                if (command.opt_type == CommandType::Batch)
+                    apply_batch(LogIndex{id, end, len}, command.value);
+                else
+                    apply(command.opt_type, command.key, LogIndex{id, end, len});
+            }
+
+            if (end == data.size())
+                return OpStatus(OpError::Ok);
+            fs::resize_file(log_path(id), end);
+            return OpStatus(OpError::Ok);
+        }
+
+        // the command has been appended at the index, the caller must hold write_latch and keydir_latch exclusively,
+        // the garbage of a hint has counted its tombstones
+        void apply(CommandType type, std::string_view key, const LogIndex &index, bool hinted = false)
+        {
+            KeyDir::Entry *entry = keydir.find(key);
+            if (entry != nullptr)
+                add_garbage(entry->id, entry->len);
+            if (type == CommandType::Remove)
+            {
+                // the tombstone is needed only until the commands before it are compacted
+                if (!hinted)
+                    add_garbage(index.id, index.len);
+                if (entry != nullptr)
+                    keydir.erase(key);
+            }
+            else if (entry != nullptr)
+                entry->set(index);
+            else
+                keydir.emplace(key, index);
+        }
+        void apply_batch(const LogIndex &index, std::string_view commands)
+        {
+            // nothing refers to the header of the batch
+            add_garbage(index.id, sizeof(CommandHeader));
+            Command command;
+            uint64_t offset = index.offset + sizeof(CommandHeader);
+            for (size_t len; (len = Command::decode(commands, command)) > 0; offset += len)
+            {
+                apply(command.opt_type, command.key, LogIndex{index.id, offset, len});
+                commands.remove_prefix(len);
+            }
+        }
+
+        void add_garbage(uint32_t id, uint64_t len)
+        {
+            logs[id].garbage += len;
+            writer.uncompacted += len;
+        }
+
+        // compaction
+        // the sizes of a log file, protected by write_latch
+        struct LogStats
+        {
+            uint64_t size = 0;
+            uint64_t garbage = 0; // the bytes of the stale commands
+            bool compacting = false; // or being hinted
+            bool hinted = false;
+        };
+
+        void compact_in_background(std::stop_token stop)
+        {
+            std::mutex mutex;
+            std::condition_variable_any cv;
+            while (true)
+            {
+                CompactionOptions options;
+                {
+                    std::lock_guard lock(compaction_latch);
+                    options = compaction_options;
+                }
+
+                {
+                    std::unique_lock lock(mutex);
+                    cv.wait_for(lock, stop, options.interval, [] { return false; });
+                    if (stop.stop_requested())
+                        return;
+                }
+
+                while (!stop.stop_requested())
+                {
+                    auto id = pick_compaction(options.garbage_ratio);
+                    if (!id.has_value())
+                        break;
+                    compact(*id, options.bytes_per_second, stop);
+                }
+                // the files sealed since the last round are hinted for the next open
+                while (!stop.stop_requested())
+                {
+                    auto id = pick_hint();
+                    if (!id.has_value())
+                        break;
+                    hint(*id, options.bytes_per_second);
+                }
+            }
+        }
+        // the sealed file with the largest share of garbage, if the garbage of all files and of it exceed the ratio
+        std::optional<uint32_t> pick_compaction(double garbage_ratio)
+        {
+            std::lock_guard lock(write_latch);
+            if (double(writer.uncompacted) <= garbage_ratio * double(total_size))
+                return std::nullopt;
+
+            std::optional<uint32_t> picked;
+            double picked_ratio = garbage_ratio;
+            for (auto &[id, stats] : logs)
+            {
+                double ratio = stats.size == 0 ? 1 : double(stats.garbage) / double(stats.size);
+                if (id != writer.log_id && !stats.compacting && ratio >= picked_ratio)
+                    picked = id, picked_ratio = ratio;
+            }
+            if (picked.has_value())
+                logs[*picked].compacting = true;
+            return picked;
+        }
+
+        std::optional<uint32_t> pick_hint()
+        {
+            std::lock_guard lock(write_latch);
+            for (auto &[id, stats] : logs)
+            {
+                if (id != writer.log_id && !stats.compacting && !stats.hinted)
+                {
+                    stats.compacting = true;
+                    return id;
+                }
+            }
+            return std::nullopt;
+        }
+        void hint(uint32_t id, uint64_t bytes_per_second)
+        {
+            Reader *reader;
+            {
+                std::shared_lock lock(keydir_latch);
+                reader = readers.at(id);
+                reader->ref();
+            }
+            std::string_view data = reader->data();
+            limiter.request(data.size(), bytes_per_second);
+            // a file sealed by this process is valid, it isn't hinted otherwise
+            if (auto hint = build_hint(id, data); hint.has_value())
+                write_hint(id, *hint);
+            reader->unref();
+
+            std::lock_guard lock(write_latch);
+            logs[id].compacting = false;
+            logs[id].hinted = true;
+        }
+
+        // rewrite the live commands of the sealed file into a new file, and swap it in,
+        // a tombstone is kept unless the key has been set again or no older file is left
+        void compact(uint32_t id, uint64_t bytes_per_second, std::stop_token stop)
+        {
+            // the command moved from the offset of the old file
+            struct Moved
+            {
+                std::string_view key;
+                uint64_t old_offset, offset, len;
+                bool tombstone;
+            };
+
+            Reader *reader;
+            bool oldest;
+            {
+                std::shared_lock lock(keydir_latch);
+                reader = readers.at(id);
+                reader->ref();
+                oldest = readers.begin()->first == id;
+            }
+            std::string_view data = reader->data();
+
+            fs::path path = log_path(id), compact_path = path;
+            compact_path.replace_extension(".compact");
+            int fd = ::open(compact_path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+            if (fd == -1)
+            {
+                std::cerr << "open compaction file: " << strerror(errno);
+                exit(-1);
+            }
+
+            std::vector<Moved> moved;
+            std::string buf;
+            uint64_t size = 0, scanned = 0;
+            auto flush = [&]() {
+                limiter.request(scanned + buf.size(), bytes_per_second);
+                if (pwrite64(fd, buf.data(), buf.size(), size) != (ssize_t)buf.size())
+                {
+                    std::cerr << "write compaction file: " << strerror(errno);
+                    exit(-1);
+                }
+                size += buf.size();
+                buf.clear();
+                scanned = 0;
+            };
+            auto visit = [&](std::string_view record, const Command &command, uint64_t offset) {
+                bool tombstone = command.opt_type == CommandType::Remove;
+                {
+                    std::shared_lock lock(keydir_latch);
+                    const KeyDir::Entry *entry = keydir.find(command.key);
+                    bool live = tombstone ? !oldest && entry == nullptr
+                                          : entry != nullptr && entry->id == id && entry->offset() == offset;
+                    if (!live)
+                        return;
+                }
+                moved.push_back(Moved{command.key, offset, size + buf.size(), record.size(), tombstone});
+                buf.append(record);
+            };
+
+            Command command, inner;
+            for (uint64_t offset = 0, len; offset < data.size() && !stop.stop_requested(); offset += len)
+            {
+                std::string_view record = data.substr(offset);
+                len = Command::decode(record, command);
+                record = record.substr(0, len);
+                if (command.opt_type != CommandType::Batch)
+                    visit(record, command, offset);
+                else
+                {
+                    // the commands of a batch are moved one by one, they've been applied together
+                    uint64_t inner_offset = offset + sizeof(CommandHeader);
+                    for (std::string_view commands = command.value; !commands.empty();)
+                    {
+                        size_t inner_len = Command::decode(commands, inner);
+                        visit(commands.substr(0, inner_len), inner, inner_offset);
+                        commands.remove_prefix(inner_len);
+                        inner_offset += inner_len;
+                    }
+                }
+                scanned += len;
+                if (buf.size() + scanned >= COMPACTION_BUFFER_SIZE)
+                    flush();
+            }
+            flush();
+            if (fdatasync(fd) == -1)
+            {
+                std::cerr << "sync compaction file: " << strerror(errno);
+                exit(-1);
+            }
+            ::close(fd);
+
+            if (stop.stop_requested())
+            {
+                fs::remove(compact_path);
+                std::lock_guard lock(write_latch);
+                logs[id].compacting = false;
+                reader->unref();
+                return;
+            }
+
+            // the liveness was decided by the keydir, which has the appends not synced yet,
+            // they're made durable before the dropped commands are, or a crash would lose both
+            Position end;
+            {
+                std::lock_guard lock(write_latch);
+                end = writer.position();
+            }
+            writer.commit(end, Durability::Sync);
+
+            // the new file holds the commands live before the rename, so it's as valid as the old one for recovery,
+            // the old hint is removed first, so it's never taken for the new file
+            fs::remove(hint_path(id));
+            Reader *new_reader = nullptr;
+            if (size == 0)
+                fs::remove(path);
+            else
+            {
+                fs::rename(compact_path, path);
+                new_reader = new Reader(path);
+                new_reader->seal(size);
+                if (auto hint = build_hint(id, new_reader->data(), true); hint.has_value())
+                    write_hint(id, *hint);
+            }
+            fs::remove(compact_path);
+            sync_dir();
+
+            // the entries are switched in chunks, so the foreground isn't paused for long,
+            // an entry switched to the new file refers to it by an alias until the old file is replaced
+            auto in_chunks = [&](auto switch_entry) {
+                for (size_t i = 0; i < moved.size(); i += COMPACTION_SWITCH_NUM)
+                {
+                    std::lock_guard lock(write_latch);
+                    std::unique_lock dir_lock(keydir_latch);
+                    for (size_t j = i; j < std::min(moved.size(), i + COMPACTION_SWITCH_NUM); j++)
+                        switch_entry(moved[j], keydir.find(moved[j].key));
+                }
+            };
+            uint32_t alias = id | ALIAS_ID;
+            // the commands overwritten or removed since they were moved are garbage already,
+            // a kept tombstone isn't counted until the key is set again, or it would be compacted over and over
+            uint64_t garbage = 0;
+            if (new_reader != nullptr)
+            {
+                {
+                    std::lock_guard lock(write_latch);
+                    std::unique_lock dir_lock(keydir_latch);
+                    readers.emplace(alias, new_reader);
+                    logs[alias].compacting = true;
+                }
+                in_chunks([&](const Moved &command, KeyDir::Entry *entry) {
+                    if (command.tombstone)
+                        garbage += entry != nullptr ? command.len : 0;
+                    else if (entry != nullptr && entry->id == id && entry->offset() == command.old_offset)
+                        entry->set(LogIndex{alias, command.offset, command.len});
+                    else
+                        garbage += command.len;
+                });
+            }
+
+            {
+                std::lock_guard lock(write_latch);
+                std::unique_lock dir_lock(keydir_latch);
+                LogStats &stats = logs[id];
+                writer.uncompacted = writer.uncompacted - stats.garbage + garbage;
+                total_size = total_size - stats.size + size;
+                readers.at(id)->unref();
+                if (new_reader == nullptr)
+                {
+                    logs.erase(id);
+                    readers.erase(id);
+                }
+                else
+                {
+                    // it's compacted again after the aliases are gone
+                    stats = LogStats{size, garbage, true, true};
+                    new_reader->ref();
+                    readers[id] = new_reader;
+                }
+            }
+
+            if (new_reader != nullptr)
+            {
+                in_chunks([&](const Moved &command, KeyDir::Entry *entry) {
+                    if (!command.tombstone && entry != nullptr && entry->id == alias && entry->offset() == command.offset)
+                        entry->id = id;
+                });
+                std::lock_guard lock(write_latch);
+                std::unique_lock dir_lock(keydir_latch);
+                readers.erase(alias);
+                new_reader->unref();
+                // the garbage of the aliased entries
+                logs[id].garbage += logs[alias].garbage;
+                logs[id].compacting = false;
+                logs.erase(alias);
+            }
+            reader->unref();
+        }
+
+        void sync_dir()
+        {
+            int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+            fsync(fd);
+            ::close(fd);
+        }
+
+        fs::path dir;
+        // keydir_latch protects keydir and readers, they're only modified with write_latch held as well
+        std::shared_mutex keydir_latch;
+        KeyDir keydir;
+        std::map<uint32_t, Reader *> readers;
+        std::mutex write_latch;
         Writer writer;
-        uint32_t log_id;
+        std::map<uint32_t, LogStats> logs;
+        uint64_t total_size = 0;
+        uint64_t max_log_size;
+        Durability durability = Durability::Sync;
+
+        std::mutex compaction_latch; // protects compaction_options
+        CompactionOptions compaction_options;
+        RateLimiter limiter;
+        std::vector<std::jthread> compactors;
     };
-} // namespace cyber
\ No newline at end of file
+} // namespace cyber
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "engines/type.h"
+
+namespace cyber
+{
+    // the command at the offset of a log file, len is the length of the whole command
+    struct LogIndex
+    {
+        uint32_t id;
+        uint64_t offset;
+        uint64_t len;
+    };
+
+    /*
+    The keydir of CyKV, an open addressing hash index of the keys.
+    A key is stored once in a chunked arena, in a record with the index of its command packed into 16 bytes,
+    a slot of the table is the address of the record, and a control byte per slot holds a fingerprint of the hash,
+    so a lookup compares the keys of the matching fingerprints only.
+    The table is rebuilt once it's 7/8 full, and the records of the removed keys are dropped from the arena then
+    if they take half of it.
+    The keys are unordered.
+    */
+    class KeyDir
+    {
+    public:
+        // the record of a key in the arena, it's aligned to 4 bytes
+        struct Entry
+        {
+            uint32_t id;
+            uint32_t len;
+            uint32_t offset_low, offset_high;
+            len_t key_len;
+            char key_data[1];
+
+            uint64_t offset() const { return offset_low | uint64_t(offset_high) << 32; }
+            LogIndex index() const { return LogIndex{id, offset(), len}; }
+            std::string_view key() const { return std::string_view(key_data, key_len); }
+            void set(const LogIndex &index)
+            {
+                id = index.id;
+                len = uint32_t(index.len);
+                offset_low = uint32_t(index.offset);
+                offset_high = uint32_t(index.offset >> 32);
+            }
+        };
+
+        KeyDir() { reset(MIN_CAPACITY); }
+        KeyDir(const KeyDir &) = delete;
+
+        // the entry is valid until the keydir is modified
+        const Entry *find(std::string_view key) const
+        {
+            size_t hash = std::hash<std::string_view>{}(key);
+            uint8_t fingerprint = fingerprint_of(hash);
+            for (size_t i = hash & (capacity - 1);; i = (i + 1) & (capacity - 1))
+            {
+                if (control[i] == EMPTY)
+                    return nullptr;
+                if (control[i] == fingerprint && slots[i]->key() == key)
+                    return slots[i];
+            }
+        }
+        Entry *find(std::string_view key) { return const_cast<Entry *>(std::as_const(*this).find(key)); }
+        bool contains(std::string_view key) const { return find(key) != nullptr; }
+
+        // the key must be absent
+        void emplace(std::string_view key, const LogIndex &index)
+        {
+            if (num + deleted + 1 > capacity / 8 * 7)
+                rebuild(num + 1 > capacity / 2 ? capacity * 2 : capacity);
+            Entry *entry = (Entry *)allocate(record_size(key.size()));
+            entry->set(index);
+            entry->key_len = len_t(key.size());
+            std::memcpy(entry->key_data, key.data(), key.size());
+            insert(std::hash<std::string_view>{}(key), entry);
+            num++;
+        }
+
+        void erase(std::string_view key)
+        {
+            size_t hash = std::hash<std::string_view>{}(key);
+            uint8_t fingerprint = fingerprint_of(hash);
+            for (size_t i = hash & (capacity - 1); control[i] != EMPTY; i = (i + 1) & (capacity - 1))
+            {
+                if (control[i] == fingerprint && slots[i]->key() == key)
+                {
+                    dead_size += record_size(key.size());
+                    // a slot followed by an empty one ends no probe sequence
+                    if (control[(i + 1) & (capacity - 1)] == EMPTY)
+                        control[i] = EMPTY;
+                    else
+                    {
+                        control[i] = DELETED;
+                        deleted++;
+                    }
+                    num--;
+                    return;
+                }
+            }
+        }
+
+        size_t size() const { return num; }
+
+        // call the function with every key and its index, in no order
+        template <typename Function>
+        void for_each(Function &&function) const
+        {
+            for (size_t i = 0; i < capacity; i++)
+            {
+                if (control[i] & FULL)
+                    function(slots[i]->key(), slots[i]->index());
+            }
+        }
+
+        // the bytes of the table and the arena
+        size_t memory_usage() const
+        {
+            return capacity * (sizeof(uint8_t) + sizeof(Entry *)) + arena_size + chunks.capacity() * sizeof(chunks[0]);
+        }
+
+    private:
+        // the control bytes, a full slot is FULL with 7 bits of the hash
+        static constexpr uint8_t EMPTY = 0, DELETED = 1, FULL = 0x80;
+        static constexpr size_t MIN_CAPACITY = 16;
+        static constexpr size_t CHUNK_SIZE = 1 << 20;
+
+        static uint8_t fingerprint_of(size_t hash) { return FULL | uint8_t(hash >> (sizeof(size_t) * 8 - 7)); }
+        static size_t record_size(size_t key_len) { return (offsetof(Entry, key_data) + key_len + 3) & ~size_t(3); }
+
+        void reset(size_t new_capacity)
+        {
+            capacity = new_capacity;
+            control = std::make_unique<uint8_t[]>(capacity);
+            slots = std::make_unique<Entry *[]>(capacity);
+            deleted = 0;
+        }
+
+        void insert(size_t hash, Entry *entry)
+        {
+            size_t i = hash & (capacity - 1);
+            while (control[i] & FULL)
+                i = (i + 1) & (capacity - 1);
+            if (control[i] == DELETED)
+                deleted--;
+            control[i] = fingerprint_of(hash);
+            slots[i] = entry;
+        }
+
+        // rehash the entries into a table of the capacity, and move them to a new arena if it's half dead
+        void rebuild(size_t new_capacity)
+        {
+            auto old_control = std::move(control);
+            auto old_slots = std::move(slots);
+            size_t old_capacity = capacity;
+            reset(new_capacity);
+
+            std::vector<std::unique_ptr<char[]>> old_chunks;
+            if (dead_size * 2 > arena_size)
+            {
+                old_chunks = std::move(chunks);
+                chunks.clear();
+                head = nullptr;
+                left = arena_size = dead_size = 0;
+            }
+            for (size_t i = 0; i < old_capacity; i++)
+            {
+                if (!(old_control[i] & FULL))
+                    continue;
+                Entry *entry = old_slots[i];
+                if (!old_chunks.empty())
+                {
+                    size_t size = record_size(entry->key_len);
+                    entry = (Entry *)std::memcpy(allocate(size), entry, size);
+                }
+                insert(std::hash<std::string_view>{}(entry->key()), entry);
+            }
+        }
+
+        char *allocate(size_t size)
+        {
+            // a large record has a chunk of its own, the current chunk is kept
+            if (size > CHUNK_SIZE / 4)
+            {
+                chunks.emplace_back(new char[size]);
+                arena_size += size;
+                return chunks.back().get();
+            }
+            if (size > left)
+            {
+                chunks.emplace_back(new char[CHUNK_SIZE]);
+                arena_size += CHUNK_SIZE;
+                head = chunks.back().get();
+                left = CHUNK_SIZE;
+            }
+            char *record = head;
+            head += size;
+            left -= size;
+            return record;
+        }
+
+        std::unique_ptr<uint8_t[]> control;
+        std::unique_ptr<Entry *[]> slots;
+        size_t capacity = 0;
+        size_t num = 0;
+        size_t deleted = 0; // the DELETED slots
+
+        std::vector<std::unique_ptr<char[]>> chunks;
+        char *head = nullptr;
+        size_t left = 0;
+        size_t arena_size = 0;
+        size_t dead_size = 0; // the bytes of the records of the removed keys
+    };
+} // namespace cyber
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <span>
 #include <string>
+#include <vector>
 
 namespace cyber
 {
@@ -10,6 +12,8 @@ namespace cyber
         DbNotInit,
         KeyNotFound,
         Io,
+        Corruption, // a page or a record fails its checksum
+        InvalidArgument,
         Internal,
     };
 
@@ -24,13 +28,115 @@ namespace cyber
         OpStatus(const OpError &err, std::string &&value) : err(err), value(std::move(value)) {}
     };
 
+    /*
+    The value read by KvEngine::get() without copying it, like rocksdb::PinnableSlice.
+    The engine may point it into its own memory and hold that memory, e.g. a pinned page,
+    until the handle is reset or destroyed, otherwise the value is kept in the buffer of the handle, which is reused.
+    */
+    class PinnedValue
+    {
+    public:
+        // called once with the arguments given to pin()
+        using Release = void (*)(void *, void *);
+
+        PinnedValue() = default;
+        PinnedValue(const PinnedValue &) = delete;
+        PinnedValue &operator=(const PinnedValue &) = delete;
+        ~PinnedValue() { reset(); }
+
+        std::string_view view() const { return value; }
+        size_t size() const { return value.size(); }
+        bool pinned() const { return release != nullptr; }
+        std::string to_string() const { return std::string(value); }
+
+        // the value stays in the memory of the engine until release(arg1, arg2)
+        void pin(std::string_view value, Release release, void *arg1, void *arg2)
+        {
+            reset();
+            this->value = value;
+            this->release = release;
+            this->arg1 = arg1;
+            this->arg2 = arg2;
+        }
+        void assign(std::string_view value)
+        {
+            reset();
+            buf.assign(value);
+            this->value = buf;
+        }
+        void assign(std::string &&value)
+        {
+            reset();
+            buf = std::move(value);
+            this->value = buf;
+        }
+        // release the pinned memory, the handle is empty afterwards
+        void reset()
+        {
+            if (release != nullptr)
+                release(arg1, arg2);
+            release = nullptr;
+            value = {};
+        }
+
+    private:
+        std::string_view value;
+        std::string buf;
+        Release release = nullptr;
+        void *arg1 = nullptr, *arg2 = nullptr;
+    };
+
+    // the updates applied atomically by KvEngine::write(), the last update of a key wins
+    class WriteBatch
+    {
+    public:
+        enum class OpType : uint8_t
+        {
+            Set,
+            Remove,
+        };
+
+        struct Op
+        {
+            OpType type;
+            std::string key;
+            std::string value;
+        };
+
+        void set(std::string_view key, std::string_view value) { ops.push_back(Op{OpType::Set, std::string(key), std::string(value)}); }
+        // removing a missing key is not an error
+        void remove(std::string_view key) { ops.push_back(Op{OpType::Remove, std::string(key), {}}); }
+        void clear() { ops.clear(); }
+
+        size_t size() const { return ops.size(); }
+        bool empty() const { return ops.empty(); }
+        const std::vector<Op> &operations() const { return ops; }
+
+    private:
+        std::vector<Op> ops;
+    };
+
     class KvEngine
     {
     public:
         virtual OpStatus open(const char *path) = 0;
         virtual OpStatus get(std::string_view key) = 0;
+        // the value is held by the handle until it's reset or destroyed, the returned status has no value,
+        // an engine which can't read in place copies it into the handle
+        virtual OpStatus get(std::string_view key, PinnedValue &value)
+        {
+            OpStatus res = get(key);
+            if (res.err == OpError::Ok)
+                value.assign(std::move(res.value));
+            else
+                value.reset();
+            return OpStatus(res.err);
+        }
+        // the results are in the order of the keys
+        virtual std::vector<OpStatus> multi_get(std::span<const std::string_view> keys) = 0;
         virtual OpStatus set(std::string_view key, std::string_view value) = 0;
         virtual OpStatus remove(std::string_view key) = 0;
+        virtual OpStatus write(const WriteBatch &batch) = 0;
         virtual OpStatus scan(std::string_view start_key, std::string_view end_key) = 0;
         virtual ~KvEngine() {}
     };
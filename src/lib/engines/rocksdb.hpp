@@ -5,6 +5,7 @@
 #include "kv_engine.hpp"
 
 #include "rocksdb/db.h"
+#include "rocksdb/write_batch.h"
 
 namespace cyber
 {
@@ -38,6 +39,51 @@ namespace cyber
                 return OpStatus(OpError::Internal);
         }
 
+        // the PinnableSlice is kept by the handle, it pins the block holding the value or holds a copy of it
+        virtual OpStatus get(std::string_view key, PinnedValue &value)
+        {
+            value.reset();
+            if (inner == nullptr)
+                return OpStatus(OpError::DbNotInit);
+
+            auto slice = std::make_unique<rocksdb::PinnableSlice>();
+            auto status = inner->Get(rocksdb::ReadOptions(), inner->DefaultColumnFamily(), key, slice.get());
+
+            if (status.ok())
+            {
+                std::string_view view(slice->data(), slice->size());
+                value.pin(view, [](void *slice, void *) { delete (rocksdb::PinnableSlice *)slice; }, slice.release(), nullptr);
+                return OpStatus(OpError::Ok);
+            }
+            else if (status.IsNotFound())
+                return OpStatus(OpError::KeyNotFound);
+            else
+                return OpStatus(OpError::Internal);
+        }
+
+        virtual std::vector<OpStatus> multi_get(std::span<const std::string_view> keys)
+        {
+            if (inner == nullptr)
+                return std::vector<OpStatus>(keys.size(), OpStatus(OpError::DbNotInit));
+
+            std::vector<rocksdb::Slice> slices(keys.begin(), keys.end());
+            std::vector<std::string> values;
+            auto statuses = inner->MultiGet(rocksdb::ReadOptions(), slices, &values);
+
+            std::vector<OpStatus> results;
+            results.reserve(keys.size());
+            for (size_t i = 0; i < keys.size(); i++)
+            {
+                if (statuses[i].ok())
+                    results.emplace_back(OpError::Ok, std::move(values[i]));
+                else if (statuses[i].IsNotFound())
+                    results.emplace_back(OpError::KeyNotFound);
+                else
+                    results.emplace_back(OpError::Internal);
+            }
+            return results;
+        }
+
         virtual OpStatus set(std::string_view key, std::string_view value)
         {
             if (inner == nullptr)
@@ -66,6 +112,27 @@ namespace cyber
                 return OpStatus(OpError::Internal);
         }
 
+        virtual OpStatus write(const WriteBatch &batch)
+        {
+            if (inner == nullptr)
+                return OpStatus(OpError::DbNotInit);
+
+            rocksdb::WriteBatch inner_batch;
+            for (auto &op : batch.operations())
+            {
+                if (op.type == WriteBatch::OpType::Set)
+                    inner_batch.Put(op.key, op.value);
+                else
+                    inner_batch.Delete(op.key);
+            }
+            auto status = inner->Write(rocksdb::WriteOptions(), &inner_batch);
+
+            if (status.ok())
+                return OpStatus(OpError::Ok);
+            else
+                return OpStatus(OpError::Internal);
+        }
+
         virtual OpStatus scan(std::string_view start_key, std::string_view end_key)
         {
             if (inner == nullptr)
@@ -7,6 +7,7 @@ namespace cyber
     using checksum_t = uint64_t;
     using num_t = uint32_t;
     using offset_t = uint32_t;
+    using lsn_t = uint64_t; // the offset of a log record in the write ahead log
 
     enum MemorySize : uint64_t
     {
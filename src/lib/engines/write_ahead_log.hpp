@@ -5,89 +5,432 @@
 #include <cstring>
 #include <functional>
 #include <filesystem>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <limits>
+#include <vector>
+#include <map>
+#include <set>
 
 #include "fcntl.h"
 #include "unistd.h"
 
 #include "engines/type.h"
+#include "engines/btree/checksum.hpp"
 
 #define ROUND_DOWN(v, r) ((v) / (r) * (r))
+#define ROUND_UP(v, r) (((v) + (r)-1) / (r) * (r))
 
 namespace cyber
 {
     namespace fs = std::filesystem;
     struct Record
     {
+        lsn_t lsn; // set by the log, a recycled segment holds stale records of other lsns
         id_t seq_num;
         id_t page_id;
         len_t redo_len;
+        uint32_t checksum; // set by the log, covering the header and the redo
 
         char redo[1];
     };
 
     constexpr size_t RECORD_HEADER_SIZE = offsetof(Record, redo[0]);
+    constexpr lsn_t INVALID_LSN = std::numeric_limits<lsn_t>::max();
+    // the log is truncated at this granularity
+    constexpr lsn_t LOG_SEGMENT_SIZE = 16 * mb;
+    // the dead segments kept for reuse, the others are removed
+    constexpr size_t MAX_RECYCLED_SEGMENTS = 4;
+    // a record appended to a fuller log buffer writes the buffer out
+    constexpr size_t LOG_BUFFER_SIZE = 1 << 20;
 
+    enum class Durability : uint8_t
+    {
+        Sync,      // the write returns after its record is synced
+        GroupSync, // like Sync, but the sync is delayed a little to gather more committers
+        Async,     // the write returns at once, the record is synced in the background
+    };
+
+    // crc32c of the record without its lsn, it's computed before the lsn is known
+    inline uint32_t record_body_checksum(const Record &record)
+    {
+        uint32_t crc = crc32c_extend(~0u, (const char *)&record.seq_num, offsetof(Record, checksum) - offsetof(Record, seq_num));
+        return crc32c_extend(crc, record.redo, record.redo_len);
+    }
+    // the lsn is covered last, so only its 8 bytes are hashed under the log latch
+    inline uint32_t record_checksum(uint32_t body_checksum, lsn_t lsn)
+    {
+        return ~crc32c_extend(body_checksum, (const char *)&lsn, sizeof(lsn));
+    }
+    inline uint32_t record_checksum(const Record &record)
+    {
+        return record_checksum(record_body_checksum(record), record.lsn);
+    }
+
+    /*
+    The records are appended to an in-memory buffer, the lsn of a record is its offset in the log.
+    Group commit: one of the committers waiting for the log becomes the leader,
+    it writes the whole buffer and syncs it once for all of them.
+
+    The log is stored in preallocated segments of a fixed size, named by their start lsns,
+    a record may span two segments. The segments before the minimum recovery lsn are renamed
+    to become the next segments, so appending never allocates blocks or changes a file size.
+    */
     class WriteAheadLog
     {
-        int log_file;
-        fs::path log_file_path;
-        id_t cur_seq_num = 0;
-        offset_t trim_off = 0;
+        fs::path dir;
+        lsn_t segment_size = LOG_SEGMENT_SIZE;
+        std::atomic<id_t> cur_seq_num = 0;
+        std::atomic<lsn_t> end_lsn = 0;
+        lsn_t flushed_lsn = 0; // the records before it are durable
+        std::vector<char> buffer; // the records from flushed_lsn, or from the lsn being flushed
+        bool flushing = false;    // a leader is writing the log
+        std::chrono::microseconds group_commit_delay{100};
+        std::mutex log_latch;
+        std::condition_variable flush_cv;
+
+        // the actions in progress, from the lsn before their first records to their ids
+        std::multimap<lsn_t, id_t> actions;
+        std::mutex action_latch;
+
+        std::set<lsn_t> segments;         // the start lsns of the segment files, including the recycled ones
+        std::map<lsn_t, int> segment_fds; // the opened segments
+        std::mutex segment_latch;         // protect segments and segment_fds
 
     public:
         ~WriteAheadLog()
         {
-            fs::remove(log_file_path);   
-            close(log_file);
+            flush(end_lsn);
+            for (auto [start, fd] : segment_fds)
+                close(fd);
         }
 
+        // the records are appended from the end set by set_end()
         void open(const char *dir_path)
         {
             if (!fs::exists(dir_path))
                 fs::create_directory(dir_path);
+            dir = fs::path(dir_path);
+
+            for (auto &entry : fs::directory_iterator(dir))
+            {
+                lsn_t start;
+                std::string name = entry.path().filename();
+                if (name.size() == 25 && sscanf(name.c_str(), "cydb.%16lx.log", &start) == 1)
+                    segments.insert(start);
+            }
+            // the segment size of an existing log is kept
+            if (!segments.empty())
+                segment_size = fs::file_size(segment_path(*segments.begin()));
+        }
+
+        // call it before open(), it's ignored if the log exists
+        void set_segment_size(lsn_t size) { segment_size = size; }
+
+        // append the record to the log buffer, return the lsn of the record
+        lsn_t log(const Record &record)
+        {
+            len_t len = RECORD_HEADER_SIZE + record.redo_len;
+            uint32_t body_checksum = record_body_checksum(record);
+            lsn_t lsn;
+            size_t buffered;
+            {
+                std::lock_guard lock(log_latch);
+                lsn = end_lsn;
+                size_t off = buffer.size();
+                buffer.insert(buffer.end(), (const char *)&record, (const char *)&record + len);
+                Record *copy = (Record *)(buffer.data() + off);
+                copy->lsn = lsn;
+                copy->checksum = record_checksum(body_checksum, lsn);
+                end_lsn = lsn + len;
+                buffered = buffer.size();
+            }
+
+            if (buffered >= LOG_BUFFER_SIZE)
+                flush(lsn + len);
+            return lsn;
+        }
+
+        // the lsn of the next record
+        lsn_t next_lsn() const { return end_lsn; }
+
+        // make the records before the lsn durable
+        void flush(lsn_t lsn) { commit(lsn, Durability::Sync); }
+
+        // wait for the records before the lsn to be durable as the durability requires
+        void commit(lsn_t lsn, Durability durability)
+        {
+            if (durability == Durability::Async)
+                return;
+
+            std::unique_lock lock(log_latch);
+            while (flushed_lsn < lsn)
+            {
+                if (flushing)
+                {
+                    // a follower, the leader may have taken the record
+                    flush_cv.wait(lock);
+                    continue;
+                }
+
+                flushing = true;
+                if (durability == Durability::GroupSync)
+                {
+                    // let the other committers append their records
+                    lock.unlock();
+                    std::this_thread::sleep_for(group_commit_delay);
+                    lock.lock();
+                }
+
+                std::vector<char> group;
+                group.swap(buffer);
+                lsn_t group_lsn = flushed_lsn, group_end_lsn = end_lsn;
+                lock.unlock();
+
+                write_segments(group.data(), group.size(), group_lsn);
+
+                lock.lock();
+                flushed_lsn = group_end_lsn;
+                flushing = false;
+                // reuse the capacity
+                if (buffer.empty())
+                {
+                    group.clear();
+                    buffer.swap(group);
+                }
+                flush_cv.notify_all();
+            }
+        }
+
+        void set_group_commit_delay(std::chrono::microseconds delay)
+        {
+            std::lock_guard lock(log_latch);
+            group_commit_delay = delay;
+        }
 
-            log_file_path = fs::path(dir_path) / "cydb.log";
-            log_file = open64(log_file_path.c_str(), O_CREAT | O_WRONLY | O_APPEND | O_SYNC, S_IRUSR | S_IWUSR);
+        // visit the records from the lsn to the end, return the end lsn of the last valid record
+        lsn_t for_each_record(lsn_t from, std::function<void(const Record &, lsn_t)> const &handler)
+        {
+            std::vector<char> buf;
+            lsn_t lsn = from;
+            while (read_record(lsn, buf))
+            {
+                const Record &record = *(Record *)buf.data();
+                handler(record, lsn);
+                lsn += RECORD_HEADER_SIZE + record.redo_len;
+            }
+
+            return lsn;
         }
 
-        offset_t log(const Record &record)
+        // the records from the lsn are torn by a crash, the next record is appended at the lsn
+        void set_end(lsn_t lsn)
         {
-            write(log_file, &record, RECORD_HEADER_SIZE + record.redo_len);
-            fsync(log_file);
+            {
+                std::lock_guard lock(log_latch);
+                flushed_lsn = end_lsn = lsn;
+            }
 
-            return lseek64(log_file, 0, SEEK_CUR);
+            // a valid record mustn't follow the end, it would be replayed by the next recovery
+            std::lock_guard lock(segment_latch);
+            for (auto it = segments.lower_bound(ROUND_DOWN(lsn, segment_size)); it != segments.end(); it++)
+            {
+                lsn_t off = std::max(lsn, *it) - *it;
+                if (off < segment_size)
+                    zero_fill(segment_fd(*it), off, segment_size - off);
+            }
         }
 
-        void for_each_record(std::function<void(const Record &)> const &handler)
+        // read the record at the lsn into the buffer, return false if there isn't a valid one
+        bool read_record(lsn_t lsn, std::vector<char> &buf)
         {
-            static char raw_record_header[RECORD_HEADER_SIZE];
+            Record header;
+            if (!read_segments((char *)&header, RECORD_HEADER_SIZE, lsn) || header.lsn != lsn)
+                return false;
+
+            buf.resize(RECORD_HEADER_SIZE + header.redo_len);
+            return read_segments(buf.data(), buf.size(), lsn) && record_checksum(*(Record *)buf.data()) == header.checksum;
+        }
 
-            int reader = open64(log_file_path.c_str(), O_CREAT | O_RDONLY, S_IRUSR | S_IWUSR);
-            char *raw_data = nullptr;
-            len_t max_len = 0;
-            while (true)
+        // drop the segments before the lsn, some of them are recycled as the next segments
+        void truncate(lsn_t lsn)
+        {
+            std::lock_guard lock(segment_latch);
+            lsn_t next_start = ROUND_DOWN(end_lsn.load(), segment_size) + segment_size;
+            bool changed = false;
+            while (!segments.empty() && *segments.begin() + segment_size <= lsn)
             {
-                if (read(reader, raw_record_header, RECORD_HEADER_SIZE) != RECORD_HEADER_SIZE)
-                    break;
-                Record *record = (Record *)raw_record_header;
-                if (RECORD_HEADER_SIZE + record->redo_len > max_len)
+                lsn_t start = *segments.begin();
+                segments.erase(segments.begin());
+                if (auto it = segment_fds.find(start); it != segment_fds.end())
                 {
-                    max_len = RECORD_HEADER_SIZE + record->redo_len;
-                    delete[] raw_data;
-                    raw_data = new char[max_len];
-                    std::memcpy(raw_data, raw_record_header, RECORD_HEADER_SIZE);
+                    close(it->second);
+                    segment_fds.erase(it);
                 }
 
-                read(reader, raw_data + RECORD_HEADER_SIZE, record->redo_len);
-                record = (Record *)raw_data;
-                handler(*record);
+                if (size_t(std::distance(segments.lower_bound(next_start), segments.end())) < MAX_RECYCLED_SEGMENTS)
+                {
+                    lsn_t future_start = segments.empty() ? next_start : std::max(*segments.rbegin() + segment_size, next_start);
+                    fs::rename(segment_path(start), segment_path(future_start));
+                    segments.insert(future_start);
+                }
+                else
+                    fs::remove(segment_path(start));
+                changed = true;
             }
 
-            close(reader);
+            if (changed)
+                sync_dir();
+        }
+
+        // the number of the segment files, including the recycled ones
+        size_t segment_num()
+        {
+            std::lock_guard lock(segment_latch);
+            return segments.size();
         }
 
         id_t gen_id() { return cur_seq_num++; }
 
-        void set_trim_off(offset_t off) { trim_off = off; }
+        // the records of an action follow the lsn of its start,
+        // the log mustn't be truncated after it until the action ends, or its undo would be partial
+        using ActionHandle = std::multimap<lsn_t, id_t>::iterator;
+        ActionHandle begin_action(id_t action_id)
+        {
+            std::lock_guard lock(action_latch);
+            return actions.emplace(end_lsn.load(), action_id);
+        }
+        void end_action(ActionHandle handle)
+        {
+            std::lock_guard lock(action_latch);
+            actions.erase(handle);
+        }
+        // the ids of the actions in progress and the lsns of their starts
+        template <typename Function>
+        void for_each_action(Function &&function)
+        {
+            std::lock_guard lock(action_latch);
+            for (auto [lsn, action_id] : actions)
+                function(action_id, lsn);
+        }
+
+    private:
+        fs::path segment_path(lsn_t start) const
+        {
+            char name[32];
+            snprintf(name, sizeof(name), "cydb.%016lx.log", start);
+            return dir / name;
+        }
+
+        // open the segment starting at the lsn, a new one is filled with zeros,
+        // fallocate() would leave unwritten extents, whose first writes still change the metadata
+        // the caller must hold segment_latch
+        int segment_fd(lsn_t start)
+        {
+            if (auto it = segment_fds.find(start); it != segment_fds.end())
+                return it->second;
+
+            bool created = segments.insert(start).second;
+            // synced by fdatasync() per group rather than by O_SYNC per write
+            int fd = open64(segment_path(start).c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+            if (fd == -1)
+            {
+                std::cerr << "open log segment: " << strerror(errno);
+                exit(-1);
+            }
+            if (created)
+            {
+                zero_fill(fd, 0, segment_size);
+                sync_dir();
+            }
+
+            return segment_fds[start] = fd;
+        }
+
+        // write zeros over the range and sync them, so the blocks are allocated and written
+        static void zero_fill(int fd, lsn_t off, lsn_t len)
+        {
+            static const std::vector<char> zeros(LOG_BUFFER_SIZE);
+            while (len > 0)
+            {
+                size_t n = std::min<lsn_t>(len, zeros.size());
+                if (pwrite64(fd, zeros.data(), n, off) != (ssize_t)n)
+                {
+                    std::cerr << "fill log segment: " << strerror(errno);
+                    exit(-1);
+                }
+                off += n, len -= n;
+            }
+            if (fdatasync(fd) == -1)
+            {
+                std::cerr << "sync log segment: " << strerror(errno);
+                exit(-1);
+            }
+        }
+
+        void write_segments(const char *data, size_t len, lsn_t lsn)
+        {
+            std::vector<int> fds;
+            while (len > 0)
+            {
+                lsn_t start = ROUND_DOWN(lsn, segment_size);
+                size_t n = std::min<size_t>(len, start + segment_size - lsn);
+                int fd;
+                {
+                    std::lock_guard lock(segment_latch);
+                    fd = segment_fd(start);
+                }
+
+                if (pwrite64(fd, data, n, lsn - start) != (ssize_t)n)
+                {
+                    std::cerr << "write log segment: " << strerror(errno);
+                    exit(-1);
+                }
+                fds.push_back(fd);
+                data += n, len -= n, lsn += n;
+            }
+
+            for (int fd : fds)
+            {
+                if (fdatasync(fd) == -1)
+                {
+                    std::cerr << "sync log segment: " << strerror(errno);
+                    exit(-1);
+                }
+            }
+        }
+
+        // return false if a segment is missing
+        bool read_segments(char *data, size_t len, lsn_t lsn)
+        {
+            while (len > 0)
+            {
+                lsn_t start = ROUND_DOWN(lsn, segment_size);
+                size_t n = std::min<size_t>(len, start + segment_size - lsn);
+                int fd;
+                {
+                    std::lock_guard lock(segment_latch);
+                    if (!segments.contains(start))
+                        return false;
+                    fd = segment_fd(start);
+                }
+
+                if (pread64(fd, data, n, lsn - start) != (ssize_t)n)
+                    return false;
+                data += n, len -= n, lsn += n;
+            }
+
+            return true;
+        }
+
+        void sync_dir()
+        {
+            int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+            fsync(fd);
+            close(fd);
+        }
     };
 } // namespace cyber
\ No newline at end of file
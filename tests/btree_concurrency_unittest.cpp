@@ -0,0 +1,542 @@
+#include <filesystem>
+#include <thread>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <iostream>
+#include <atomic>
+
+#include "engines/btree/btree.hpp"
+#include "gtest/gtest.h"
+
+namespace
+{
+    using namespace cyber;
+
+    std::string make_key(int i, size_t padding = 0)
+    {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "key%08d", i);
+        return buf + std::string(padding, 'k');
+    }
+
+    std::string make_value(int i) { return "value" + std::to_string(i) + std::string(24, 'v'); }
+
+    class BTreeConcurrencyTest : public ::testing::Test
+    {
+    protected:
+        void SetUp() override
+        {
+            std::filesystem::remove_all("test_db_concurrency");
+            engine = new BTree();
+            auto s = engine->open("test_db_concurrency");
+            ASSERT_EQ(s.err, OpError::Ok) << "can't open file";
+        }
+        void TearDown() override
+        {
+            delete engine;
+        }
+
+        static int thread_num() { return std::max(4u, std::thread::hardware_concurrency()); }
+
+        // long keys make the inner nodes split as well
+        void stress(const int key_num, const size_t padding);
+
+        BTree *engine;
+    };
+
+    void BTreeConcurrencyTest::stress(const int key_num, const size_t padding)
+    {
+        const int n = thread_num();
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < n; t++)
+        {
+            threads.emplace_back([&, t]() {
+                std::mt19937 rng(t);
+                for (int i = 0; i < key_num; i++)
+                {
+                    int k = i * n + t;
+                    auto s = engine->set(make_key(k, padding), make_value(k));
+                    ASSERT_EQ(s.err, OpError::Ok) << "failed at " << k;
+
+                    // read a key written by this thread before
+                    int j = std::uniform_int_distribution<int>(0, i)(rng) * n + t;
+                    s = engine->get(make_key(j, padding));
+                    ASSERT_EQ(s.err, OpError::Ok) << "failed at " << j;
+                    ASSERT_EQ(s.value, make_value(j)) << "failed at " << j;
+
+                    // read a key which may be written by other threads
+                    j = std::uniform_int_distribution<int>(0, key_num * n - 1)(rng);
+                    s = engine->get(make_key(j, padding));
+                    if (s.err == OpError::Ok)
+                        ASSERT_EQ(s.value, make_value(j)) << "failed at " << j;
+                    else
+                        ASSERT_EQ(s.err, OpError::KeyNotFound) << "failed at " << j;
+                }
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+
+        ASSERT_EQ(engine->metadata().data_num, key_num * n);
+        for (int k = 0; k < key_num * n; k++)
+        {
+            auto s = engine->get(make_key(k, padding));
+            ASSERT_EQ(s.err, OpError::Ok) << "failed at " << k;
+            ASSERT_EQ(s.value, make_value(k)) << "failed at " << k;
+        }
+
+        // remove the even keys concurrently
+        threads.clear();
+        for (int t = 0; t < n; t++)
+        {
+            threads.emplace_back([&, t]() {
+                for (int k = t * 2; k < key_num * n; k += n * 2)
+                {
+                    auto s = engine->remove(make_key(k, padding));
+                    ASSERT_EQ(s.err, OpError::Ok) << "failed at " << k;
+                }
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+
+        ASSERT_EQ(engine->metadata().data_num, key_num * n / 2);
+        for (int k = 0; k < key_num * n; k++)
+        {
+            auto s = engine->get(make_key(k, padding));
+            ASSERT_EQ(s.err, k % 2 == 0 ? OpError::KeyNotFound : OpError::Ok) << "failed at " << k;
+        }
+    }
+
+    TEST_F(BTreeConcurrencyTest, stress) { stress(2000, 0); }
+
+    TEST_F(BTreeConcurrencyTest, stress_inner_split) { stress(300, 2000); }
+
+    // pages are evicted while other threads are reading them
+    TEST_F(BTreeConcurrencyTest, stress_small_buffer)
+    {
+        delete engine;
+        std::filesystem::remove_all("test_db_concurrency");
+        engine = new BTree(64 * PAGE_SIZE);
+        ASSERT_EQ(engine->open("test_db_concurrency").err, OpError::Ok);
+        stress(300, 2000);
+    }
+
+    // the even keys are always found by multi_get() while the odd ones split the leaves
+    TEST_F(BTreeConcurrencyTest, multi_get_while_splitting)
+    {
+        const int key_num = 20000, writer_num = 2, reader_num = 2, batch_size = 100;
+        for (int k = 0; k < key_num; k += 2)
+            ASSERT_EQ(engine->set(make_key(k), make_value(k)).err, OpError::Ok);
+
+        std::atomic<int> writing = writer_num;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < writer_num; t++)
+        {
+            threads.emplace_back([&, t]() {
+                for (int k = t * 2 + 1; k < key_num; k += writer_num * 2)
+                    ASSERT_EQ(engine->set(make_key(k), make_value(k)).err, OpError::Ok) << "failed at " << k;
+                writing--;
+            });
+        }
+        for (int t = 0; t < reader_num; t++)
+        {
+            threads.emplace_back([&, t]() {
+                std::mt19937 rng(t);
+                do
+                {
+                    std::vector<int> ks;
+                    std::vector<std::string> strs;
+                    for (int i = 0; i < batch_size; i++)
+                    {
+                        ks.push_back(std::uniform_int_distribution<int>(0, key_num - 1)(rng));
+                        strs.push_back(make_key(ks.back()));
+                    }
+                    std::vector<std::string_view> keys(strs.begin(), strs.end());
+                    auto results = engine->multi_get(keys);
+                    for (int i = 0; i < batch_size; i++)
+                    {
+                        if (results[i].err == OpError::Ok)
+                            ASSERT_EQ(results[i].value, make_value(ks[i])) << "failed at " << ks[i];
+                        else
+                        {
+                            ASSERT_EQ(ks[i] % 2, 1) << "failed at " << ks[i];
+                            ASSERT_EQ(results[i].err, OpError::KeyNotFound) << "failed at " << ks[i];
+                        }
+                    }
+                } while (writing > 0);
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+    }
+
+    // the batches of the writers interleave their keys, a batch is never seen partially
+    TEST_F(BTreeConcurrencyTest, write_batch)
+    {
+        const int n = thread_num(), round_num = 200, batch_size = 20;
+        std::atomic<bool> done = false;
+
+        // every key of a round holds the round once its batch is written
+        std::thread reader([&]() {
+            std::mt19937 rng(n);
+            while (!done.load())
+            {
+                int t = std::uniform_int_distribution<int>(0, n - 1)(rng);
+                std::string first;
+                for (int i = 0; i < batch_size; i++)
+                {
+                    auto s = engine->get(make_key(i * n + t));
+                    std::string value = s.err == OpError::Ok ? s.value : "";
+                    if (i == 0)
+                        first = value;
+                    // a later key is never older than the first one
+                    else if (!first.empty())
+                    {
+                        ASSERT_FALSE(value.empty() || std::stoi(value) < std::stoi(first)) << "thread " << t << ", key " << i;
+                    }
+                }
+            }
+        });
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < n; t++)
+        {
+            threads.emplace_back([&, t]() {
+                for (int round = 0; round < round_num; round++)
+                {
+                    WriteBatch batch;
+                    // in the reverse order of the reader
+                    for (int i = batch_size - 1; i >= 0; i--)
+                        batch.set(make_key(i * n + t), std::to_string(round));
+                    ASSERT_EQ(engine->write(batch).err, OpError::Ok);
+                }
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+        done.store(true);
+        reader.join();
+
+        ASSERT_EQ(engine->metadata().data_num, n * batch_size);
+        for (int k = 0; k < n * batch_size; k++)
+            ASSERT_EQ(engine->get(make_key(k)).value, std::to_string(round_num - 1)) << "failed at " << k;
+    }
+
+    // the leaves are split under the cursors, a scan never misses or repeats a key
+    TEST_F(BTreeConcurrencyTest, scan_while_splitting)
+    {
+        const int key_num = 20000, writer_num = 2, scanner_num = 2;
+        for (int k = 0; k < key_num; k += 2)
+            ASSERT_EQ(engine->set(make_key(k), make_value(k)).err, OpError::Ok);
+
+        std::atomic<int> writing = writer_num;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < writer_num; t++)
+        {
+            threads.emplace_back([&, t]() {
+                for (int k = t * 2 + 1; k < key_num; k += writer_num * 2)
+                    ASSERT_EQ(engine->set(make_key(k), make_value(k)).err, OpError::Ok) << "failed at " << k;
+                writing--;
+            });
+        }
+        for (int t = 0; t < scanner_num; t++)
+        {
+            threads.emplace_back([&]() {
+                do
+                {
+                    int even = 0;
+                    std::string last;
+                    for (BTree::Cursor cursor(*engine, ""); cursor.valid(); cursor.next())
+                    {
+                        ASSERT_LT(last, cursor.key());
+                        last = cursor.key();
+                        int k = std::stoi(last.substr(3));
+                        ASSERT_EQ(cursor.value(), make_value(k));
+                        if (k % 2 == 0)
+                            even++;
+                    }
+                    ASSERT_EQ(even, key_num / 2);
+                } while (writing > 0);
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+
+        ASSERT_EQ(engine->scan("", "").value, std::to_string(key_num));
+    }
+
+    // the leaves emptied of the odd keys are merged and split again, the even keys are always found
+    TEST_F(BTreeConcurrencyTest, merge_while_reading)
+    {
+        const int key_num = 20000, writer_num = 2, reader_num = 2, round_num = 10;
+        // the odd keys take most of the space of a leaf
+        auto odd_value = [](int k) { return make_value(k) + std::string(300, 'o'); };
+        engine->set_durability(Durability::Async);
+        for (int k = 0; k < key_num; k++)
+            ASSERT_EQ(engine->set(make_key(k), k % 2 == 0 ? make_value(k) : odd_value(k)).err, OpError::Ok);
+
+        std::atomic<int> writing = writer_num;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < writer_num; t++)
+        {
+            threads.emplace_back([&, t]() {
+                for (int round = 0; round < round_num; round++)
+                {
+                    for (int k = t * 2 + 1; k < key_num; k += writer_num * 2)
+                        ASSERT_EQ(engine->remove(make_key(k)).err, OpError::Ok) << "failed at " << k;
+                    for (int k = t * 2 + 1; k < key_num; k += writer_num * 2)
+                        ASSERT_EQ(engine->set(make_key(k), odd_value(k)).err, OpError::Ok) << "failed at " << k;
+                }
+                writing--;
+            });
+        }
+        for (int t = 0; t < reader_num; t++)
+        {
+            threads.emplace_back([&, t]() {
+                std::mt19937 rng(t);
+                do
+                {
+                    int even = 0;
+                    std::string last;
+                    for (BTree::Cursor cursor(*engine, ""); cursor.valid(); cursor.next())
+                    {
+                        ASSERT_LT(last, cursor.key());
+                        last = cursor.key();
+                        int k = std::stoi(last.substr(3));
+                        ASSERT_EQ(cursor.value(), k % 2 == 0 ? make_value(k) : odd_value(k));
+                        if (k % 2 == 0)
+                            even++;
+                    }
+                    ASSERT_EQ(even, key_num / 2);
+
+                    for (int i = 0; i < 1000; i++)
+                    {
+                        int k = std::uniform_int_distribution<int>(0, key_num / 2 - 1)(rng) * 2;
+                        ASSERT_EQ(engine->get(make_key(k)).value, make_value(k)) << "failed at " << k;
+                    }
+                } while (writing > 0);
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+
+        ASSERT_EQ(engine->scan("", "").value, std::to_string(key_num));
+        for (int k = 0; k < key_num; k++)
+            ASSERT_EQ(engine->get(make_key(k)).value, k % 2 == 0 ? make_value(k) : odd_value(k)) << "failed at " << k;
+    }
+
+    // the large values are replaced while they're read, a reader sees a whole value or restarts,
+    // the value of a version is its byte repeated, and its length depends on the version
+    TEST_F(BTreeConcurrencyTest, overflow_while_reading)
+    {
+        const int key_num = 8, writer_num = 2, reader_num = 2, round_num = 30;
+        auto large_value = [](int version) { return std::string(MAX_INLINE_VALUE + 1 + version % 26 * 1500, char('a' + version % 26)); };
+        auto check = [&](std::string_view value) {
+            ASSERT_FALSE(value.empty());
+            ASSERT_EQ(value.size(), large_value(value[0] - 'a').size());
+            ASSERT_EQ(value.find_first_not_of(value[0]), std::string_view::npos);
+        };
+        engine->set_durability(Durability::Async);
+        for (int k = 0; k < key_num; k++)
+            ASSERT_EQ(engine->set(make_key(k), large_value(k)).err, OpError::Ok);
+
+        std::atomic<int> writing = writer_num;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < writer_num; t++)
+        {
+            threads.emplace_back([&, t]() {
+                for (int round = 0; round < round_num; round++)
+                {
+                    for (int k = t; k < key_num; k += writer_num)
+                        ASSERT_EQ(engine->set(make_key(k), large_value(round * key_num + k)).err, OpError::Ok) << "failed at " << k;
+                }
+                writing--;
+            });
+        }
+        for (int t = 0; t < reader_num; t++)
+        {
+            threads.emplace_back([&, t]() {
+                std::mt19937 rng(t);
+                do
+                {
+                    int k = std::uniform_int_distribution<int>(0, key_num - 1)(rng);
+                    auto s = engine->get(make_key(k));
+                    ASSERT_EQ(s.err, OpError::Ok) << "failed at " << k;
+                    check(s.value);
+
+                    std::string value;
+                    BTree::ValueReader reader(*engine, make_key(k));
+                    for (; reader.valid(); reader.next())
+                        value += reader.chunk();
+                    if (!reader.changed())
+                    {
+                        ASSERT_EQ(value.size(), reader.size());
+                        check(value);
+                    }
+                } while (writing > 0);
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+
+        for (int k = 0; k < key_num; k++)
+            ASSERT_EQ(engine->get(make_key(k)).value, large_value((round_num - 1) * key_num + k)) << "failed at " << k;
+    }
+
+    // the pinned values don't change while they're held, the writers of their leaves don't wait for them
+    TEST_F(BTreeConcurrencyTest, pinned_get_while_writing)
+    {
+        const int key_num = 2000, writer_num = 2, reader_num = 2, round_num = 5;
+        auto new_value = [](int k, int round) { return make_value(k) + std::string(round * 10, 'n'); };
+        engine->set_durability(Durability::Async);
+        for (int k = 0; k < key_num; k++)
+            ASSERT_EQ(engine->set(make_key(k), make_value(k)).err, OpError::Ok);
+
+        std::atomic<int> writing = writer_num;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < writer_num; t++)
+        {
+            threads.emplace_back([&, t]() {
+                for (int round = 1; round <= round_num; round++)
+                {
+                    for (int k = t; k < key_num; k += writer_num)
+                        ASSERT_EQ(engine->set(make_key(k), new_value(k, round)).err, OpError::Ok) << "failed at " << k;
+                }
+                writing--;
+            });
+        }
+        for (int t = 0; t < reader_num; t++)
+        {
+            threads.emplace_back([&, t]() {
+                std::mt19937 rng(t);
+                PinnedValue value;
+                do
+                {
+                    int k = std::uniform_int_distribution<int>(0, key_num - 1)(rng);
+                    ASSERT_EQ(engine->get(make_key(k), value).err, OpError::Ok) << "failed at " << k;
+                    std::string copy(value.view());
+                    ASSERT_EQ(copy.rfind(make_value(k), 0), 0) << "failed at " << k;
+                    std::this_thread::yield();
+                    ASSERT_EQ(value.view(), copy) << "failed at " << k;
+                    value.reset();
+                } while (writing > 0);
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+
+        for (int k = 0; k < key_num; k++)
+            ASSERT_EQ(engine->get(make_key(k)).value, new_value(k, round_num)) << "failed at " << k;
+    }
+
+    TEST_F(BTreeConcurrencyTest, bench_get)
+    {
+        const int key_num = 10000, op_num = 200000;
+        for (int k = 0; k < key_num; k++)
+            ASSERT_EQ(engine->set(make_key(k), make_value(k)).err, OpError::Ok);
+
+        for (int n = 1; n <= thread_num(); n *= 2)
+        {
+            std::vector<std::thread> threads;
+            auto start = std::chrono::steady_clock::now();
+            for (int t = 0; t < n; t++)
+            {
+                threads.emplace_back([&, t]() {
+                    std::mt19937 rng(t);
+                    std::uniform_int_distribution<int> dist(0, key_num - 1);
+                    for (int i = 0; i < op_num / n; i++)
+                    {
+                        int k = dist(rng);
+                        auto s = engine->get(make_key(k));
+                        ASSERT_EQ(s.err, OpError::Ok) << "failed at " << k;
+                    }
+                });
+            }
+            for (auto &thread : threads)
+                thread.join();
+
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << "[ BENCH    ] get, " << n << " threads: " << op_num / elapsed.count() << " ops/s" << std::endl;
+        }
+    }
+
+    // the working set is larger than the buffer, every thread keeps reads in flight
+    TEST(BTreeIoTest, bench_io_backend)
+    {
+        const int key_num = 10000, op_num = 20000, thread_num = 16;
+        const std::string value(200, 'v');
+
+        for (auto [backend, name] : {std::make_pair(IoBackend::ThreadPool, "thread pool"),
+                                     std::make_pair(IoBackend::IoUring, "io_uring")})
+        {
+            std::filesystem::remove_all("test_db_io");
+            BTree engine(64 * PAGE_SIZE, ReplacementPolicy::TwoQueue, HugePages::Transparent, backend);
+            ASSERT_EQ(engine.open("test_db_io").err, OpError::Ok);
+            for (int k = 0; k < key_num; k++)
+                ASSERT_EQ(engine.set(make_key(k), value).err, OpError::Ok);
+
+            engine.reset_buffer_stats();
+            std::vector<std::thread> threads;
+            auto start = std::chrono::steady_clock::now();
+            for (int t = 0; t < thread_num; t++)
+            {
+                threads.emplace_back([&, t]() {
+                    std::mt19937 rng(t);
+                    std::uniform_int_distribution<int> dist(0, key_num - 1);
+                    for (int i = 0; i < op_num / thread_num; i++)
+                    {
+                        int k = dist(rng);
+                        auto s = engine.get(make_key(k));
+                        ASSERT_EQ(s.err, OpError::Ok) << "failed at " << k;
+                        ASSERT_EQ(s.value, value) << "failed at " << k;
+                    }
+                });
+            }
+            for (auto &thread : threads)
+                thread.join();
+
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << "[ BENCH    ] get, " << name << ", " << thread_num << " threads: " << op_num / elapsed.count() << " ops/s, "
+                      << engine.buffer_stats().misses << " misses" << std::endl;
+        }
+        std::filesystem::remove_all("test_db_io");
+    }
+
+    // concurrent committers share the syncs of the log
+    TEST(BTreeWalTest, bench_group_commit)
+    {
+        const int op_num = 4000;
+
+        for (auto [durability, name] : {std::make_pair(Durability::Sync, "sync"),
+                                        std::make_pair(Durability::GroupSync, "group sync"),
+                                        std::make_pair(Durability::Async, "async")})
+        {
+            for (int n = 1; n <= 16; n *= 2)
+            {
+                std::filesystem::remove_all("test_db_wal");
+                BTree engine;
+                engine.set_durability(durability);
+                ASSERT_EQ(engine.open("test_db_wal").err, OpError::Ok);
+
+                std::vector<std::thread> threads;
+                auto start = std::chrono::steady_clock::now();
+                for (int t = 0; t < n; t++)
+                {
+                    threads.emplace_back([&, t]() {
+                        for (int k = t; k < op_num; k += n)
+                            ASSERT_EQ(engine.set(make_key(k), make_value(k)).err, OpError::Ok) << "failed at " << k;
+                    });
+                }
+                for (auto &thread : threads)
+                    thread.join();
+
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                std::cout << "[ BENCH    ] commit, " << name << ", " << n << " threads: " << op_num / elapsed.count() << " commits/s" << std::endl;
+            }
+        }
+        std::filesystem::remove_all("test_db_wal");
+    }
+} // namespace
\ No newline at end of file
@@ -1,8 +1,36 @@
 #include <filesystem>
+#include <fstream>
+#include <map>
+#include <random>
+#include <cmath>
+#include <numeric>
+#include <iostream>
+#include <chrono>
+#include <thread>
+
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "engines/btree/btree.hpp"
 #include "gtest/gtest.h"
 
+// count the allocations of the calling thread
+thread_local size_t allocations = 0;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void *operator new(size_t size)
+{
+    allocations++;
+    if (void *p = std::malloc(size))
+        return p;
+    throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+#pragma GCC diagnostic pop
+
 namespace
 {
     using namespace cyber;
@@ -96,8 +124,9 @@ namespace
 
     TEST_F(BTreeTest, get_set)
     {
+        // the leaves emptied by the split test have been merged, and the root has collapsed into the first leaf
         ASSERT_EQ(engine->metadata().node_num, 3) << "metadata.data_num = " << engine->metadata().node_num;
-        ASSERT_EQ(engine->metadata().root_id, 2) << "metadata.data_num = " << engine->metadata().root_id;
+        ASSERT_EQ(engine->metadata().root_id, 0) << "metadata.data_num = " << engine->metadata().root_id;
 
         auto s = engine->get("hello");
         ASSERT_EQ(s.err, OpError::KeyNotFound);
@@ -134,4 +163,1662 @@ namespace
         ASSERT_EQ(s.err, OpError::Ok);
         ASSERT_STREQ(s.value.data(), "yah2er0ne") << "s.value = " << s.value;
     }
+
+    // the ranks of keys are drawn from a Zipfian distribution
+    class ZipfianKeys
+    {
+    public:
+        ZipfianKeys(int n, double theta = 0.99) : n(n), cdf(n)
+        {
+            double sum = 0;
+            for (int i = 0; i < n; i++)
+                cdf[i] = sum += 1 / std::pow(i + 1, theta);
+            for (double &p : cdf)
+                p /= sum;
+        }
+
+        int next()
+        {
+            return std::lower_bound(cdf.begin(), cdf.end(), dist(rng)) - cdf.begin();
+        }
+
+    private:
+        int n;
+        std::vector<double> cdf;
+        std::mt19937 rng{42};
+        std::uniform_real_distribution<double> dist{0, 1};
+    };
+
+    TEST(BTreeBufferTest, replacement_policy)
+    {
+        const int key_num = 8000, op_num = 20000;
+        const std::string value(200, 'v');
+        // the hot keys are adjacent
+        auto key = [](int i) {
+            char buf[16];
+            snprintf(buf, sizeof(buf), "%08d", i);
+            return std::string(buf);
+        };
+
+        for (auto [policy, name] : {std::make_pair(ReplacementPolicy::Clock, "CLOCK"),
+                                    std::make_pair(ReplacementPolicy::LruK, "LRU-2"),
+                                    std::make_pair(ReplacementPolicy::TwoQueue, "2Q")})
+        {
+            std::filesystem::remove_all("test_db_buffer");
+            BTree engine(32 * PAGE_SIZE, policy);
+            // every access reaches the replacer
+            engine.set_swizzling(false);
+            ASSERT_EQ(engine.open("test_db_buffer").err, OpError::Ok);
+            for (int i = 0; i < key_num; i++)
+                ASSERT_EQ(engine.set(key(i), value).err, OpError::Ok);
+
+            ZipfianKeys keys(key_num);
+            for (int i = 0; i < op_num; i++) // warm up
+                ASSERT_EQ(engine.get(key(keys.next())).err, OpError::Ok);
+
+            engine.reset_buffer_stats();
+            for (int i = 0; i < op_num; i++)
+                ASSERT_EQ(engine.get(key(keys.next())).err, OpError::Ok);
+            BufferStats before = engine.buffer_stats();
+
+            // a large scan touches every leaf once
+            engine.reset_buffer_stats();
+            for (int i = 0; i < key_num; i++)
+                ASSERT_EQ(engine.get(key(i)).err, OpError::Ok);
+            BufferStats scan = engine.buffer_stats();
+
+            engine.reset_buffer_stats();
+            for (int i = 0; i < op_num / 40; i++)
+                ASSERT_EQ(engine.get(key(keys.next())).err, OpError::Ok);
+            BufferStats after = engine.buffer_stats();
+
+            std::cout << "[ BENCH    ] " << name
+                      << ": zipfian hit ratio " << before.hit_ratio() << " (" << before.hits << " hits, " << before.misses << " misses)"
+                      << ", scan misses " << scan.misses
+                      << ", zipfian hit ratio after scan " << after.hit_ratio() << " (" << after.hits << " hits, " << after.misses << " misses)"
+                      << std::endl;
+            // the hot pages survive the scan
+            if (policy != ReplacementPolicy::Clock)
+            {
+                ASSERT_GT(after.hit_ratio(), before.hit_ratio() * 0.95);
+            }
+        }
+        std::filesystem::remove_all("test_db_buffer");
+    }
+
+    TEST(BTreeBufferTest, huge_pages)
+    {
+        // the pool falls back to transparent huge pages if none is reserved
+        for (HugePages huge_pages : {HugePages::None, HugePages::Transparent, HugePages::Explicit})
+        {
+            std::filesystem::remove_all("test_db_buffer");
+            {
+                BTree engine(16 * PAGE_SIZE, ReplacementPolicy::TwoQueue, huge_pages);
+                ASSERT_EQ(engine.open("test_db_buffer").err, OpError::Ok);
+                for (int i = 0; i < 2000; i++)
+                    ASSERT_EQ(engine.set(std::to_string(i), std::string(200, 'v')).err, OpError::Ok);
+                for (int i = 0; i < 2000; i++)
+                    ASSERT_EQ(engine.get(std::to_string(i)).err, OpError::Ok) << "failed at " << i;
+                ASSERT_GT(engine.buffer_stats().evictions, 0u);
+            }
+
+            // no swizzled reference is written to the disk
+            BTree engine(16 * PAGE_SIZE, ReplacementPolicy::TwoQueue, huge_pages);
+            ASSERT_EQ(engine.open("test_db_buffer").err, OpError::Ok);
+            for (int i = 0; i < 2000; i++)
+                ASSERT_EQ(engine.get(std::to_string(i)).err, OpError::Ok) << "failed at " << i;
+        }
+        std::filesystem::remove_all("test_db_buffer");
+    }
+
+    TEST(BTreeBufferTest, allocation_free_misses)
+    {
+        const int key_num = 50000, op_num = 20000;
+        // the keys and values fit in the small string buffer
+        std::vector<std::string> keys(key_num);
+        for (int i = 0; i < key_num; i++)
+        {
+            char buf[16];
+            snprintf(buf, sizeof(buf), "%08d", i);
+            keys[i] = buf;
+        }
+
+        for (ReplacementPolicy policy : {ReplacementPolicy::Clock, ReplacementPolicy::LruK, ReplacementPolicy::TwoQueue})
+        {
+            std::filesystem::remove_all("test_db_buffer");
+            BTree engine(16 * PAGE_SIZE, policy);
+            ASSERT_EQ(engine.open("test_db_buffer").err, OpError::Ok);
+            for (const std::string &key : keys)
+                ASSERT_EQ(engine.set(key, "value").err, OpError::Ok);
+            // write back the dirty pages
+            for (const std::string &key : keys)
+                ASSERT_EQ(engine.get(key).err, OpError::Ok);
+
+            std::mt19937 rng(42);
+            engine.reset_buffer_stats();
+            size_t before = allocations;
+            for (int i = 0; i < op_num; i++)
+            {
+                OpStatus status = engine.get(keys[rng() % key_num]);
+                ASSERT_EQ(status.err, OpError::Ok);
+            }
+            size_t allocated = allocations - before;
+
+            ASSERT_GT(engine.buffer_stats().misses, uint64_t(op_num / 2));
+            ASSERT_EQ(allocated, 0u) << "policy " << int(policy);
+        }
+        std::filesystem::remove_all("test_db_buffer");
+    }
+
+    // point lookups on a tree fitting in memory
+    TEST(BTreeBufferTest, bench_swizzling)
+    {
+        const int key_num = 20000, op_num = 1000000;
+
+        for (bool swizzling : {false, true})
+        {
+            std::filesystem::remove_all("test_db_buffer");
+            BTree engine(64 * mb);
+            engine.set_swizzling(swizzling);
+            ASSERT_EQ(engine.open("test_db_buffer").err, OpError::Ok);
+            for (int i = 0; i < key_num; i++)
+                ASSERT_EQ(engine.set(std::to_string(i), std::to_string(i)).err, OpError::Ok);
+
+            std::mt19937 rng(42);
+            std::uniform_int_distribution<int> dist(0, key_num - 1);
+            std::vector<std::string> keys(op_num);
+            for (auto &key : keys)
+                key = std::to_string(dist(rng));
+
+            auto start = std::chrono::steady_clock::now();
+            for (auto &key : keys)
+                ASSERT_EQ(engine.get(key).err, OpError::Ok);
+            std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+            std::cout << "[ BENCH    ] get, swizzling " << (swizzling ? "on" : "off") << ": "
+                      << elapsed.count() / op_num << " ns/op, " << engine.buffer_stats().hits << " buffer lookups" << std::endl;
+        }
+        std::filesystem::remove_all("test_db_buffer");
+    }
+
+    std::string scan_key(int i)
+    {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "key%08d", i);
+        return buf;
+    }
+
+    // the cursor walks the leaves by their sibling links
+    TEST(BTreeScanTest, scan)
+    {
+        const int key_num = 20000;
+        std::filesystem::remove_all("test_db_scan");
+        {
+            BTree engine(64 * PAGE_SIZE);
+            engine.set_durability(Durability::Async);
+            ASSERT_EQ(engine.open("test_db_scan").err, OpError::Ok);
+            // in a random order, so the leaves are split everywhere
+            std::vector<int> keys(key_num);
+            std::iota(keys.begin(), keys.end(), 0);
+            std::shuffle(keys.begin(), keys.end(), std::mt19937(42));
+            for (int k : keys)
+                ASSERT_EQ(engine.set(scan_key(k), std::to_string(k)).err, OpError::Ok);
+
+            int k = 0;
+            for (BTree::Cursor cursor(engine, ""); cursor.valid(); cursor.next(), k++)
+            {
+                ASSERT_EQ(cursor.key(), scan_key(k));
+                ASSERT_EQ(cursor.value(), std::to_string(k));
+            }
+            ASSERT_EQ(k, key_num);
+
+            ASSERT_EQ(engine.scan(scan_key(100), scan_key(12345)).value, std::to_string(12345 - 100));
+            ASSERT_EQ(engine.scan("key", "").value, std::to_string(key_num));
+            ASSERT_EQ(engine.scan(scan_key(key_num), "").value, "0");
+            ASSERT_EQ(engine.scan(scan_key(500), scan_key(500)).value, "0");
+
+            for (int k = 0; k < key_num; k += 2)
+                ASSERT_EQ(engine.remove(scan_key(k)).err, OpError::Ok);
+        }
+
+        // the links are persistent
+        {
+            BTree engine(64 * PAGE_SIZE);
+            ASSERT_EQ(engine.open("test_db_scan").err, OpError::Ok);
+            int k = 1;
+            for (BTree::Cursor cursor(engine, scan_key(0), "", 0); cursor.valid(); cursor.next(), k += 2)
+                ASSERT_EQ(cursor.key(), scan_key(k));
+            ASSERT_EQ(k, key_num + 1);
+            ASSERT_EQ(engine.scan(scan_key(1000), scan_key(2000)).value, "500");
+        }
+        std::filesystem::remove_all("test_db_scan");
+    }
+
+    // a full scan of a tree larger than the buffer, the leaves are read from the disk
+    TEST(BTreeScanTest, bench_scan)
+    {
+        const int key_num = 100000;
+        const std::string value(100, 'v');
+        std::filesystem::remove_all("test_db_scan");
+        {
+            BTree engine;
+            engine.set_durability(Durability::Async);
+            ASSERT_EQ(engine.open("test_db_scan").err, OpError::Ok);
+            for (int k = 0; k < key_num; k++)
+                ASSERT_EQ(engine.set(scan_key(k), value).err, OpError::Ok);
+        }
+
+        for (size_t prefetch_num : {0, 8, 32})
+        {
+            BTree engine(256 * PAGE_SIZE);
+            ASSERT_EQ(engine.open("test_db_scan").err, OpError::Ok);
+
+            size_t n = 0, bytes = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (BTree::Cursor cursor(engine, "", "", prefetch_num); cursor.valid(); cursor.next())
+            {
+                n++;
+                bytes += cursor.key().size() + cursor.value().size();
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            ASSERT_EQ(n, key_num);
+
+            BufferStats stats = engine.buffer_stats();
+            std::cout << "[ BENCH    ] scan, prefetch " << prefetch_num << ": " << n / elapsed.count() << " keys/s, "
+                      << bytes / elapsed.count() / double(mb) << " MB/s, " << stats.misses << " misses, " << stats.prefetches << " prefetches" << std::endl;
+        }
+        std::filesystem::remove_all("test_db_scan");
+    }
+
+    // keys sharing long prefixes, like the rows of the tables of tenants
+    TEST(BTreeLayoutTest, bench_prefix_compression)
+    {
+        const int tenant_num = 10, table_num = 10, row_num = 1000;
+        std::vector<std::string> keys;
+        char buf[64];
+        for (int tenant = 0; tenant < tenant_num; tenant++)
+            for (int table = 0; table < table_num; table++)
+                for (int row = 0; row < row_num; row++)
+                {
+                    snprintf(buf, sizeof(buf), "tenant%04d/table%04d/row%08d", tenant, table, row);
+                    keys.push_back(buf);
+                }
+        std::shuffle(keys.begin(), keys.end(), std::mt19937(42));
+
+        std::filesystem::remove_all("test_db_layout");
+        size_t key_bytes = 0;
+        {
+            BTree engine;
+            engine.set_durability(Durability::Async);
+            ASSERT_EQ(engine.open("test_db_layout").err, OpError::Ok);
+            for (auto &key : keys)
+            {
+                ASSERT_EQ(engine.set(key, key.substr(key.size() - 8)).err, OpError::Ok);
+                key_bytes += key.size();
+            }
+
+            std::cout << "[ BENCH    ] " << keys.size() << " keys of " << key_bytes / keys.size() << " bytes: height " << engine.height()
+                      << ", " << engine.metadata().node_num << " pages, " << double(engine.metadata().node_num) * PAGE_SIZE / keys.size() << " bytes/key" << std::endl;
+        }
+
+        {
+            BTree engine;
+            ASSERT_EQ(engine.open("test_db_layout").err, OpError::Ok);
+            for (auto &key : keys)
+            {
+                auto s = engine.get(key);
+                ASSERT_EQ(s.err, OpError::Ok) << key;
+                ASSERT_EQ(s.value, key.substr(key.size() - 8));
+            }
+            ASSERT_EQ(engine.scan("tenant0003/", "tenant0004/").value, std::to_string(table_num * row_num));
+            ASSERT_EQ(engine.scan("tenant0005/table0002/row00000100", "tenant0005/table0002/row00000200").value, "100");
+        }
+        std::filesystem::remove_all("test_db_layout");
+    }
+
+    // a leaf without the buffer manager and the latches
+    class BTreePageTest : public ::testing::Test
+    {
+    protected:
+        void SetUp() override
+        {
+            std::filesystem::remove_all("test_db_page");
+            wal = std::make_unique<WriteAheadLog>();
+            wal->open("test_db_page");
+
+            frame = (char *)operator new(PAGE_SIZE, (std::align_val_t)BLOCK_SIZE);
+            std::memset(frame, 0, PAGE_SIZE);
+            PageHeader *header = (PageHeader *)frame;
+            header->type = CellType::KeyValueCell;
+            header->cell_end = header->fence_off = PAGE_SIZE;
+            header->prev_leaf = header->next_leaf = INVALID_PAGE_ID;
+            node = std::make_unique<BTreeNode>(frame, wal.get());
+            node->cal_checksum();
+            node->reload(0);
+        }
+        void TearDown() override
+        {
+            node.reset();
+            wal.reset();
+            operator delete(frame, (std::align_val_t)BLOCK_SIZE);
+            std::filesystem::remove_all("test_db_page");
+        }
+
+        std::unique_ptr<WriteAheadLog> wal;
+        char *frame;
+        std::unique_ptr<BTreeNode> node;
+    };
+
+    // the lookups in one full leaf
+    TEST_F(BTreePageTest, bench_search)
+    {
+        std::vector<std::string> keys;
+        std::mt19937_64 rng(42);
+        char buf[64];
+        while (true)
+        {
+            snprintf(buf, sizeof(buf), "%016lx", rng());
+            if (!node->try_insert_value(buf, "v").has_value())
+                break;
+            keys.push_back(buf);
+        }
+
+        const int round_num = 200;
+        num_t sum = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int round = 0; round < round_num; round++)
+            for (auto &key : keys)
+                sum += node->find_value_index(key);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "[ BENCH    ] " << keys.size() << " keys in a page: " << round_num * keys.size() / elapsed.count() << " lookups/s" << std::endl;
+
+        ASSERT_EQ(sum, round_num * keys.size() * (keys.size() - 1) / 2);
+        for (auto &key : keys)
+            ASSERT_TRUE(node->cell_key_equals(node->find_value_index(key), key));
+        ASSERT_EQ(node->find_value_index(""), 0);
+        ASSERT_EQ(node->find_value_index("g"), keys.size());
+    }
+
+    // replace random cells of a nearly full leaf by cells of other sizes, the free space gets fragmented
+    TEST_F(BTreePageTest, bench_fragmented_insert)
+    {
+        std::map<std::string, std::string> expected;
+        std::mt19937_64 rng(42);
+        char buf[64];
+        auto insert = [&]() {
+            snprintf(buf, sizeof(buf), "%016lx", rng());
+            std::string value(8 + rng() % 120, 'a' + rng() % 26);
+            if (!node->try_insert_value(buf, value).has_value())
+                return false;
+            expected[buf] = value;
+            return true;
+        };
+        auto remove = [&]() {
+            auto it = expected.begin();
+            std::advance(it, rng() % expected.size());
+            node->remove(node->find_value_index(it->first));
+            expected.erase(it);
+        };
+        while (insert())
+            ;
+        for (size_t n = expected.size() / 10; n > 0; n--)
+            remove();
+
+        const int op_num = 200000;
+        int full = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < op_num; i++)
+        {
+            remove();
+            while (!insert())
+            {
+                remove();
+                full++;
+            }
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "[ BENCH    ] fragmented page: " << op_num / elapsed.count() << " replacements/s, "
+                  << expected.size() << " keys, " << full << " times full" << std::endl;
+
+        // the free space is kept in the page
+        node->cal_checksum();
+        node->reload(0);
+        ASSERT_EQ(node->data_num(), expected.size());
+        num_t i = 0;
+        for (auto &[key, value] : expected)
+        {
+            ASSERT_TRUE(node->cell_key_equals(i, key));
+            ASSERT_EQ(node->cell_value(i++), value);
+        }
+        while (insert())
+            ;
+    }
+
+    // a page failing its checksum is reported rather than read
+    TEST(BTreeChecksumTest, corruption)
+    {
+        ASSERT_EQ(crc32c("123456789", 9), 0xe3069283);
+        ASSERT_EQ(~crc32c_extend_portable(~0u, "123456789", 9), 0xe3069283);
+        std::vector<char> page(PAGE_SIZE);
+        std::mt19937 rng(42);
+        for (char &c : page)
+            c = rng();
+        for (size_t n : {size_t(0), size_t(7), size_t(1000), PAGE_SIZE - sizeof(checksum_t), PAGE_SIZE})
+            ASSERT_EQ(crc32c(page.data(), n), ~crc32c_extend_portable(~0u, page.data(), n)) << n;
+
+        std::filesystem::remove_all("test_db_checksum");
+        {
+            BTree engine;
+            ASSERT_EQ(engine.open("test_db_checksum").err, OpError::Ok);
+            for (int i = 0; i < 10; i++)
+                ASSERT_EQ(engine.set(std::to_string(i), std::to_string(i)).err, OpError::Ok);
+        }
+
+        // flip a byte of the root, the only page
+        {
+            std::fstream data("test_db_checksum/data", std::ios::in | std::ios::out | std::ios::binary);
+            char c;
+            data.seekg(PAGE_SIZE - 1);
+            data.read(&c, 1);
+            c ^= 1;
+            data.seekp(PAGE_SIZE - 1);
+            data.write(&c, 1);
+        }
+
+        {
+            BTree engine;
+            ASSERT_EQ(engine.open("test_db_checksum").err, OpError::Ok);
+            ASSERT_EQ(engine.get("1").err, OpError::Corruption);
+            ASSERT_EQ(engine.set("1", "2").err, OpError::Corruption);
+            ASSERT_EQ(engine.remove("1").err, OpError::Corruption);
+            ASSERT_EQ(engine.scan("", "").err, OpError::Corruption);
+        }
+        std::filesystem::remove_all("test_db_checksum");
+    }
+
+    TEST(BTreeChecksumTest, bench_checksum)
+    {
+        const int round_num = 20000;
+        std::vector<char> page(PAGE_SIZE);
+        std::mt19937 rng(42);
+        for (char &c : page)
+            c = rng();
+
+        auto bench = [&](const char *name, auto &&checksum) {
+            uint64_t sum = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (int round = 0; round < round_num; round++)
+            {
+                page[round % PAGE_SIZE]++;
+                sum += checksum(page.data());
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << "[ BENCH    ] " << name << ": " << double(round_num) * PAGE_SIZE / elapsed.count() / double(gb) << " GB/s"
+                      << " (" << sum % 10 << ")" << std::endl;
+        };
+
+        // the former checksum, the xor of the 8-byte words
+        bench("xor", [](const char *data) {
+            checksum_t checksum = 0;
+            for (size_t i = 0; i < PAGE_SIZE; i += sizeof(checksum_t))
+            {
+                checksum_t word;
+                std::memcpy(&word, data + i, sizeof(word));
+                checksum ^= word;
+            }
+            return checksum;
+        });
+        bench("crc32c, portable", [](const char *data) { return crc32c_extend_portable(~0u, data, PAGE_SIZE); });
+        if (crc32c_hardware_supported())
+            bench("crc32c, sse4.2", [](const char *data) { return crc32c(data, PAGE_SIZE); });
+    }
+
+    TEST(BTreeBulkLoadTest, bulk_load)
+    {
+        const int key_num = 100000;
+        std::filesystem::remove_all("test_db_bulk");
+        {
+            BTree engine;
+            ASSERT_EQ(engine.open("test_db_bulk").err, OpError::Ok);
+            ASSERT_EQ(engine.set("old", "old").err, OpError::Ok);
+
+            BTree::BulkLoader loader(engine, 1.0);
+            for (int i = 0; i < key_num; i++)
+                ASSERT_EQ(loader.add(std::to_string(1000000 + i * 2), std::to_string(i)).err, OpError::Ok);
+            ASSERT_EQ(loader.add("1000000", "").err, OpError::InvalidArgument);
+            ASSERT_EQ(loader.finish().err, OpError::Ok);
+            ASSERT_EQ(loader.finish().err, OpError::InvalidArgument);
+
+            // the loaded tree replaces the old one
+            ASSERT_EQ(engine.get("old").err, OpError::KeyNotFound);
+            ASSERT_EQ(engine.scan("", "").value, std::to_string(key_num));
+            ASSERT_GT(engine.height(), 1);
+
+            // the full pages are split by the keys set between the loaded ones
+            for (int i = 0; i < key_num; i += 7)
+                ASSERT_EQ(engine.set(std::to_string(1000001 + i * 2), "odd").err, OpError::Ok);
+            ASSERT_EQ(engine.remove(std::to_string(1000000)).err, OpError::Ok);
+        }
+
+        {
+            BTree engine;
+            ASSERT_EQ(engine.open("test_db_bulk").err, OpError::Ok);
+            for (int i = 1; i < key_num; i++)
+            {
+                auto s = engine.get(std::to_string(1000000 + i * 2));
+                ASSERT_EQ(s.err, OpError::Ok) << i;
+                ASSERT_EQ(s.value, std::to_string(i));
+            }
+            ASSERT_EQ(engine.get(std::to_string(1000001 + 7 * 2)).value, "odd");
+            ASSERT_EQ(engine.scan("", "").value, std::to_string(key_num - 1 + (key_num + 6) / 7));
+        }
+
+        // the pages of the replaced tree are freed, the writes after the load reuse them
+        {
+            BTree engine;
+            ASSERT_EQ(engine.open("test_db_bulk").err, OpError::Ok);
+            BTree::BulkLoader loader(engine);
+            for (int i = 0; i < key_num / 10; i++)
+                ASSERT_EQ(loader.add(std::to_string(1000000 + i), "new").err, OpError::Ok);
+            ASSERT_EQ(loader.finish().err, OpError::Ok);
+            ASSERT_NE(engine.metadata().free_head, INVALID_PAGE_ID);
+
+            uint32_t node_num = engine.metadata().node_num;
+            for (int i = 0; i < key_num / 2; i++)
+                ASSERT_EQ(engine.set(std::to_string(3000000 + i), std::to_string(i)).err, OpError::Ok);
+            ASSERT_EQ(engine.metadata().node_num, node_num);
+        }
+        {
+            BTree engine;
+            ASSERT_EQ(engine.open("test_db_bulk").err, OpError::Ok);
+            ASSERT_EQ(engine.scan("", "").value, std::to_string(key_num / 10 + key_num / 2));
+            ASSERT_EQ(engine.get("1000001").value, "new");
+            ASSERT_EQ(engine.get("3000001").value, "1");
+        }
+
+        // an empty tree
+        {
+            BTree engine;
+            ASSERT_EQ(engine.open("test_db_bulk").err, OpError::Ok);
+            ASSERT_EQ(BTree::BulkLoader(engine).finish().err, OpError::Ok);
+            ASSERT_EQ(engine.scan("", "").value, "0");
+            ASSERT_EQ(engine.set("a", "b").err, OpError::Ok);
+            ASSERT_EQ(engine.get("a").value, "b");
+        }
+        std::filesystem::remove_all("test_db_bulk");
+    }
+
+    TEST(BTreeBulkLoadTest, bench_bulk_load)
+    {
+        const int tenant_num = 10, table_num = 10, row_num = 5000;
+        std::vector<std::string> keys;
+        char buf[64];
+        for (int tenant = 0; tenant < tenant_num; tenant++)
+            for (int table = 0; table < table_num; table++)
+                for (int row = 0; row < row_num; row++)
+                {
+                    snprintf(buf, sizeof(buf), "tenant%04d/table%04d/row%08d", tenant, table, row);
+                    keys.push_back(buf);
+                }
+
+        auto bench = [&](const char *name, auto &&load) {
+            std::filesystem::remove_all("test_db_bulk");
+            double seconds;
+            {
+                BTree engine;
+                engine.set_durability(Durability::Async);
+                ASSERT_EQ(engine.open("test_db_bulk").err, OpError::Ok);
+                auto start = std::chrono::steady_clock::now();
+                load(engine);
+                seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                ASSERT_EQ(engine.scan("", "").value, std::to_string(keys.size()));
+                std::cout << "[ BENCH    ] " << name << ": " << keys.size() << " keys in " << seconds << " s, height " << engine.height()
+                          << ", " << engine.metadata().node_num << " pages, ";
+            }
+            std::cout << std::filesystem::file_size("test_db_bulk/data") / double(mb) << " MiB" << std::endl;
+        };
+
+        bench("set, async", [&](BTree &engine) {
+            for (auto &key : keys)
+                engine.set(key, key.substr(key.size() - 8));
+        });
+        for (double fill_factor : {0.9, 1.0})
+        {
+            std::string name = "bulk load, fill factor " + std::to_string(fill_factor).substr(0, 3);
+            bench(name.c_str(), [&](BTree &engine) {
+                BTree::BulkLoader loader(engine, fill_factor);
+                for (auto &key : keys)
+                    loader.add(key, key.substr(key.size() - 8));
+                loader.finish();
+            });
+        }
+        std::filesystem::remove_all("test_db_bulk");
+    }
+
+    TEST(BTreeMultiGetTest, multi_get)
+    {
+        const int key_num = 20000;
+        std::filesystem::remove_all("test_db_multi_get");
+        {
+            BTree engine;
+            ASSERT_EQ(engine.open("test_db_multi_get").err, OpError::Ok);
+            ASSERT_TRUE(engine.multi_get({}).empty());
+            for (int i = 0; i < key_num; i += 2)
+                ASSERT_EQ(engine.set(std::to_string(i), std::to_string(i)).err, OpError::Ok);
+        }
+
+        // the leaves are read by multi_get() in a small buffer
+        {
+            BTree engine(64 * PAGE_SIZE);
+            ASSERT_EQ(engine.open("test_db_multi_get").err, OpError::Ok);
+            std::mt19937 rng(42);
+            for (int t = 0; t < 100; t++)
+            {
+                std::vector<std::string> keys;
+                for (int i = 0; i < 300; i++)
+                    keys.push_back(std::to_string(std::uniform_int_distribution<int>(0, key_num)(rng)));
+                keys.push_back(keys.front());
+                keys.push_back("missing");
+
+                std::vector<std::string_view> views(keys.begin(), keys.end());
+                auto results = engine.multi_get(views);
+                ASSERT_EQ(results.size(), keys.size());
+                for (size_t i = 0; i < keys.size(); i++)
+                {
+                    if (keys[i] != "missing" && std::stoi(keys[i]) % 2 == 0)
+                    {
+                        ASSERT_EQ(results[i].err, OpError::Ok) << keys[i];
+                        ASSERT_EQ(results[i].value, keys[i]);
+                    }
+                    else
+                        ASSERT_EQ(results[i].err, OpError::KeyNotFound) << keys[i];
+                }
+            }
+        }
+        std::filesystem::remove_all("test_db_multi_get");
+    }
+
+    TEST(BTreeMultiGetTest, bench_multi_get)
+    {
+        const int key_num = 200000, batch_size = 200, batch_num = 500;
+        std::filesystem::remove_all("test_db_multi_get");
+        {
+            BTree engine;
+            engine.set_durability(Durability::Async);
+            ASSERT_EQ(engine.open("test_db_multi_get").err, OpError::Ok);
+            for (int i = 0; i < key_num; i++)
+                engine.set(std::to_string(i), std::string(100, 'v'));
+        }
+
+        std::mt19937 rng(42);
+        std::vector<std::vector<std::string>> batches(batch_num);
+        for (auto &batch : batches)
+            for (int i = 0; i < batch_size; i++)
+                batch.push_back(std::to_string(std::uniform_int_distribution<int>(0, key_num - 1)(rng)));
+
+        // cold: the buffer holds a few of the leaves, so most of them are read from the file
+        for (bool cold : {true, false})
+        {
+            BTree engine;
+            ASSERT_EQ(engine.open("test_db_multi_get").err, OpError::Ok);
+            if (!cold)
+                engine.scan("", "");
+            auto bench = [&](const char *name, auto &&read) {
+                BTree reopened(4 * mb);
+                BTree &e = cold ? reopened : engine;
+                if (cold)
+                {
+                    ASSERT_EQ(e.open("test_db_multi_get").err, OpError::Ok);
+                }
+                auto start = std::chrono::steady_clock::now();
+                for (auto &batch : batches)
+                    read(e, batch);
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                std::cout << "[ BENCH    ] " << name << (cold ? ", cold" : ", warm") << ": "
+                          << seconds * 1e9 / (batch_num * batch_size) << " ns/key" << std::endl;
+            };
+
+            bench("get", [](BTree &e, std::vector<std::string> &batch) {
+                for (auto &key : batch)
+                    ASSERT_EQ(e.get(key).err, OpError::Ok);
+            });
+            bench("multi_get", [](BTree &e, std::vector<std::string> &batch) {
+                std::vector<std::string_view> keys(batch.begin(), batch.end());
+                for (auto &s : e.multi_get(keys))
+                    ASSERT_EQ(s.err, OpError::Ok);
+            });
+        }
+        std::filesystem::remove_all("test_db_multi_get");
+    }
+
+    TEST(BTreeWriteBatchTest, write_batch)
+    {
+        const int key_num = 20000;
+        std::filesystem::remove_all("test_db_batch");
+        {
+            BTree engine;
+            ASSERT_EQ(engine.open("test_db_batch").err, OpError::Ok);
+            ASSERT_EQ(engine.write(WriteBatch()).err, OpError::Ok);
+
+            // an empty leaf is split by the keys of the batch
+            WriteBatch batch;
+            for (int i = key_num - 1; i >= 0; i--)
+                batch.set(std::to_string(i), std::string(100, 'v'));
+            ASSERT_EQ(engine.write(batch).err, OpError::Ok);
+            ASSERT_EQ(engine.metadata().data_num, key_num);
+            ASSERT_GT(engine.height(), 1);
+
+            // the last update of a key wins
+            batch.clear();
+            for (int i = 0; i < key_num; i += 2)
+                batch.remove(std::to_string(i));
+            for (int i = 1; i < key_num; i += 4)
+                batch.set(std::to_string(i), std::string(200, 'u'));
+            batch.set("0", "first");
+            batch.remove("missing");
+            batch.set("0", "zero");
+            ASSERT_EQ(engine.write(batch).err, OpError::Ok);
+            ASSERT_EQ(engine.metadata().data_num, key_num / 2 + 1);
+        }
+
+        {
+            BTree engine;
+            ASSERT_EQ(engine.open("test_db_batch").err, OpError::Ok);
+            ASSERT_EQ(engine.get("0").value, "zero");
+            for (int i = 1; i < key_num; i++)
+            {
+                auto s = engine.get(std::to_string(i));
+                if (i % 2 == 0)
+                    ASSERT_EQ(s.err, OpError::KeyNotFound) << "failed at " << i;
+                else
+                {
+                    ASSERT_EQ(s.err, OpError::Ok) << "failed at " << i;
+                    ASSERT_EQ(s.value, i % 4 == 1 ? std::string(200, 'u') : std::string(100, 'v')) << "failed at " << i;
+                }
+            }
+            ASSERT_EQ(engine.scan("", "").value, std::to_string(key_num / 2 + 1));
+        }
+        std::filesystem::remove_all("test_db_batch");
+    }
+
+    TEST(BTreeWriteBatchTest, bench_write_batch)
+    {
+        const int key_num = 100000, batch_size = 100;
+        std::vector<std::string> keys;
+        std::mt19937_64 rng(42);
+        char buf[32];
+        for (int i = 0; i < key_num; i++)
+        {
+            snprintf(buf, sizeof(buf), "%016lx", (unsigned long)rng());
+            keys.push_back(buf);
+        }
+
+        auto bench = [&](const char *name, auto &&load) {
+            std::filesystem::remove_all("test_db_batch");
+            BTree engine;
+            ASSERT_EQ(engine.open("test_db_batch").err, OpError::Ok);
+            auto start = std::chrono::steady_clock::now();
+            load(engine);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            ASSERT_EQ(engine.metadata().data_num, keys.size());
+            std::cout << "[ BENCH    ] " << name << ": " << keys.size() / seconds << " keys/s" << std::endl;
+        };
+
+        for (Durability durability : {Durability::Sync, Durability::Async})
+        {
+            std::string suffix = durability == Durability::Sync ? ", sync" : ", async";
+            bench(("set" + suffix).c_str(), [&](BTree &engine) {
+                for (auto &key : keys)
+                    engine.set(key, key, durability);
+            });
+            bench(("write batch of " + std::to_string(batch_size) + suffix).c_str(), [&](BTree &engine) {
+                WriteBatch batch;
+                for (size_t i = 0; i < keys.size(); i++)
+                {
+                    batch.set(keys[i], keys[i]);
+                    if (batch.size() == batch_size || i + 1 == keys.size())
+                    {
+                        engine.write(batch, durability);
+                        batch.clear();
+                    }
+                }
+            });
+        }
+        std::filesystem::remove_all("test_db_batch");
+    }
+
+    // the leaves emptied by removals are merged, the tree shrinks and the freed pages are reused
+    TEST(BTreeMergeTest, merge)
+    {
+        const int key_num = 50000;
+        auto key = [](int i) {
+            char buf[16];
+            snprintf(buf, sizeof(buf), "%08d", i);
+            return std::string(buf);
+        };
+        std::filesystem::remove_all("test_db_merge");
+        uint32_t node_num;
+        {
+            BTree engine;
+            engine.set_durability(Durability::Async);
+            ASSERT_EQ(engine.open("test_db_merge").err, OpError::Ok);
+            for (int i = 0; i < key_num; i++)
+                ASSERT_EQ(engine.set(key(i), std::string(300, 'v')).err, OpError::Ok);
+            node_num = engine.metadata().node_num;
+            size_t height = engine.height();
+            ASSERT_GT(height, 2);
+
+            // the leaves fall below a quarter full, and so do their parents after the merges
+            for (int i = 0; i < key_num; i++)
+            {
+                if (i % 16 != 0)
+                {
+                    ASSERT_EQ(engine.remove(key(i)).err, OpError::Ok);
+                }
+            }
+            ASSERT_LT(engine.height(), height);
+            ASSERT_EQ(engine.scan("", "").value, std::to_string(key_num / 16));
+            for (int i = 0; i < key_num; i++)
+                ASSERT_EQ(engine.get(key(i)).err, i % 16 == 0 ? OpError::Ok : OpError::KeyNotFound) << "failed at " << i;
+
+            // the file doesn't grow while there are free pages
+            for (int i = 0; i < key_num; i++)
+            {
+                if (i % 16 != 0)
+                {
+                    ASSERT_EQ(engine.set(key(i), std::string(300, 'v')).err, OpError::Ok);
+                }
+            }
+            ASSERT_LE(engine.metadata().node_num, node_num * 11 / 10);
+            node_num = engine.metadata().node_num;
+
+            WriteBatch batch;
+            for (int i = 0; i < key_num; i++)
+                batch.remove(key(i));
+            ASSERT_EQ(engine.write(batch).err, OpError::Ok);
+            ASSERT_EQ(engine.height(), 1);
+            ASSERT_EQ(engine.scan("", "").value, "0");
+        }
+
+        // the free list is persistent
+        {
+            BTree engine;
+            engine.set_durability(Durability::Async);
+            ASSERT_EQ(engine.open("test_db_merge").err, OpError::Ok);
+            ASSERT_EQ(engine.height(), 1);
+            for (int i = key_num - 1; i >= 0; i--)
+                ASSERT_EQ(engine.set(key(i), std::string(300, 'v')).err, OpError::Ok);
+            ASSERT_LE(engine.metadata().node_num, node_num);
+            ASSERT_EQ(engine.scan("", "").value, std::to_string(key_num));
+        }
+        std::filesystem::remove_all("test_db_merge");
+    }
+
+    // a scan over a tree purged of most of its keys, it visits as many leaves as the keys need
+    TEST(BTreeMergeTest, bench_scan_after_purge)
+    {
+        const int key_num = 200000;
+        std::filesystem::remove_all("test_db_merge");
+        {
+            BTree engine;
+            engine.set_durability(Durability::Async);
+            ASSERT_EQ(engine.open("test_db_merge").err, OpError::Ok);
+            std::mt19937 rng(42);
+            std::vector<int> order(key_num);
+            std::iota(order.begin(), order.end(), 0);
+            std::shuffle(order.begin(), order.end(), rng);
+            for (int i : order)
+                engine.set(std::to_string(1000000 + i), std::string(100, 'v'));
+            uint32_t node_num = engine.metadata().node_num;
+
+            // keep one key in 20
+            auto start = std::chrono::steady_clock::now();
+            for (int i : order)
+            {
+                if (i % 20 != 0)
+                    engine.remove(std::to_string(1000000 + i));
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            start = std::chrono::steady_clock::now();
+            const int scan_num = 20;
+            for (int i = 0; i < scan_num; i++)
+                ASSERT_EQ(engine.scan("", "").value, std::to_string(key_num / 20));
+            double scan_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / scan_num;
+
+            // the pages freed by the purge take the keys set again
+            for (int i : order)
+            {
+                if (i % 20 != 0)
+                    engine.set(std::to_string(1000000 + i), std::string(100, 'v'));
+            }
+            std::cout << "[ BENCH    ] purge of 95% keys: " << (key_num - key_num / 20) / seconds << " removes/s, height "
+                      << engine.height() << ", scan of the rest " << scan_seconds * 1000 << " ms, " << node_num
+                      << " pages before, " << engine.metadata().node_num << " pages after setting the keys again" << std::endl;
+        }
+        std::filesystem::remove_all("test_db_merge");
+    }
+
+    std::string large_value(size_t size, int seed)
+    {
+        std::string value(size, 0);
+        for (size_t i = 0; i < size; i++)
+            value[i] = char('a' + (i * 7 + seed) % 26);
+        return value;
+    }
+
+    // the values longer than MAX_INLINE_VALUE are stored in overflow pages, the cells hold the references
+    TEST(BTreeOverflowTest, overflow)
+    {
+        const std::vector<size_t> sizes = {MAX_INLINE_VALUE, MAX_INLINE_VALUE + 1, OVERFLOW_CAPACITY, OVERFLOW_CAPACITY + 1, 50 * kb, 3 * mb};
+        auto key = [](size_t i) { return "large" + std::to_string(i); };
+        std::filesystem::remove_all("test_db_overflow");
+        {
+            // smaller than the largest value
+            BTree engine(64 * PAGE_SIZE);
+            ASSERT_EQ(engine.open("test_db_overflow").err, OpError::Ok);
+            for (int i = 0; i < 1000; i++)
+                ASSERT_EQ(engine.set(std::to_string(i), std::to_string(i)).err, OpError::Ok);
+            for (size_t i = 0; i < sizes.size(); i++)
+                ASSERT_EQ(engine.set(key(i), large_value(sizes[i], i)).err, OpError::Ok);
+            for (size_t i = 0; i < sizes.size(); i++)
+                ASSERT_EQ(engine.get(key(i)).value, large_value(sizes[i], i)) << "failed at " << i;
+
+            // large to large, large to small, and small to large
+            ASSERT_EQ(engine.set(key(4), large_value(sizes[4] * 2, 1)).err, OpError::Ok);
+            ASSERT_EQ(engine.set(key(3), "small").err, OpError::Ok);
+            ASSERT_EQ(engine.set("7", large_value(sizes[4], 7)).err, OpError::Ok);
+            ASSERT_EQ(engine.get(key(4)).value, large_value(sizes[4] * 2, 1));
+            ASSERT_EQ(engine.get(key(3)).value, "small");
+            ASSERT_EQ(engine.get("7").value, large_value(sizes[4], 7));
+
+            // the chunks are streamed one page at a time
+            {
+                BTree::ValueReader reader(engine, key(5));
+                ASSERT_EQ(reader.error(), OpError::Ok);
+                ASSERT_EQ(reader.size(), sizes[5]);
+                std::string value;
+                size_t chunk_num = 0;
+                for (; reader.valid(); reader.next(), chunk_num++)
+                {
+                    ASSERT_LE(reader.chunk().size(), OVERFLOW_CAPACITY);
+                    value += reader.chunk();
+                }
+                ASSERT_FALSE(reader.changed());
+                ASSERT_EQ(chunk_num, (sizes[5] + OVERFLOW_CAPACITY - 1) / OVERFLOW_CAPACITY);
+                ASSERT_EQ(value, large_value(sizes[5], 5));
+
+                BTree::ValueReader small(engine, key(3));
+                ASSERT_TRUE(small.valid());
+                ASSERT_EQ(small.chunk(), "small");
+                small.next();
+                ASSERT_FALSE(small.valid());
+                ASSERT_EQ(BTree::ValueReader(engine, "missing").error(), OpError::KeyNotFound);
+            }
+
+            // the cursor and multi_get() read the large values too
+            size_t n = 0;
+            for (BTree::Cursor cursor(engine, "large", "largf"); cursor.valid(); cursor.next(), n++)
+                ASSERT_EQ(cursor.value(), engine.get(cursor.key()).value) << "failed at " << cursor.key();
+            ASSERT_EQ(n, sizes.size());
+            std::vector<std::string> keys = {key(0), key(1), "7", key(5), "missing"};
+            std::vector<std::string_view> views(keys.begin(), keys.end());
+            auto results = engine.multi_get(views);
+            for (size_t i = 0; i < keys.size(); i++)
+            {
+                auto s = engine.get(keys[i]);
+                ASSERT_EQ(results[i].err, s.err) << "failed at " << keys[i];
+                ASSERT_EQ(results[i].value, s.value) << "failed at " << keys[i];
+            }
+
+            WriteBatch batch;
+            batch.set(key(0), large_value(100 * kb, 0));
+            batch.set("8", large_value(20 * kb, 8));
+            batch.remove(key(1));
+            ASSERT_EQ(engine.write(batch).err, OpError::Ok);
+            ASSERT_EQ(engine.get(key(0)).value, large_value(100 * kb, 0));
+            ASSERT_EQ(engine.get("8").value, large_value(20 * kb, 8));
+            ASSERT_EQ(engine.get(key(1)).err, OpError::KeyNotFound);
+
+            ASSERT_EQ(engine.set("huge", std::string(MAX_VALUE_SIZE + 1, 'h')).err, OpError::InvalidArgument);
+
+            // the pages of the replaced values are reused
+            ASSERT_EQ(engine.set(key(5), large_value(sizes[5], 0)).err, OpError::Ok);
+            uint32_t node_num = engine.metadata().node_num;
+            for (int round = 1; round <= 5; round++)
+                ASSERT_EQ(engine.set(key(5), large_value(sizes[5], round)).err, OpError::Ok);
+            ASSERT_LE(engine.metadata().node_num, node_num + 2);
+            ASSERT_EQ(engine.remove(key(2)).err, OpError::Ok);
+            ASSERT_EQ(engine.get(key(2)).err, OpError::KeyNotFound);
+            for (int i = 0; i < 1000; i++)
+                ASSERT_EQ(engine.get(std::to_string(i)).value,
+                          i == 7   ? large_value(sizes[4], 7)
+                          : i == 8 ? large_value(20 * kb, 8)
+                                   : std::to_string(i))
+                    << "failed at " << i;
+        }
+
+        {
+            BTree engine(64 * PAGE_SIZE);
+            ASSERT_EQ(engine.open("test_db_overflow").err, OpError::Ok);
+            ASSERT_EQ(engine.get(key(0)).value, large_value(100 * kb, 0));
+            ASSERT_EQ(engine.get(key(4)).value, large_value(sizes[4] * 2, 1));
+            ASSERT_EQ(engine.get(key(5)).value, large_value(sizes[5], 5));
+            ASSERT_EQ(engine.get(key(2)).err, OpError::KeyNotFound);
+        }
+        std::filesystem::remove_all("test_db_overflow");
+    }
+
+    // large values kept out of the leaves, a scan of the keys visits few leaves
+    TEST(BTreeOverflowTest, bench_large_values)
+    {
+        const int key_num = 400;
+        const size_t value_size = 256 * kb;
+        std::filesystem::remove_all("test_db_overflow");
+        {
+            BTree engine(256 * mb);
+            engine.set_durability(Durability::Async);
+            ASSERT_EQ(engine.open("test_db_overflow").err, OpError::Ok);
+            std::vector<std::string> values;
+            for (int i = 0; i < 4; i++)
+                values.push_back(large_value(value_size, i));
+
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < key_num; i++)
+                ASSERT_EQ(engine.set(std::to_string(1000000 + i), values[i % 4]).err, OpError::Ok);
+            double set_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            start = std::chrono::steady_clock::now();
+            for (int i = 0; i < key_num; i++)
+                ASSERT_EQ(engine.get(std::to_string(1000000 + i)).value.size(), value_size);
+            double get_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            start = std::chrono::steady_clock::now();
+            size_t bytes = 0;
+            for (int i = 0; i < key_num; i++)
+                for (BTree::ValueReader reader(engine, std::to_string(1000000 + i)); reader.valid(); reader.next())
+                    bytes += reader.chunk().size();
+            double stream_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            ASSERT_EQ(bytes, key_num * value_size);
+
+            double mb_num = double(key_num) * value_size / double(mb);
+            std::cout << "[ BENCH    ] " << value_size / kb << " KiB values: set " << mb_num / set_seconds << " MB/s, get "
+                      << mb_num / get_seconds << " MB/s, stream " << mb_num / stream_seconds << " MB/s, height "
+                      << engine.height() << std::endl;
+        }
+        std::filesystem::remove_all("test_db_overflow");
+    }
+
+    TEST(BTreePinnedTest, pinned_get)
+    {
+        std::filesystem::remove_all("test_db_pinned");
+        {
+            // every page but the pinned leaf is evicted by the reads below
+            BTree engine(MIN_FRAME_NUM * PAGE_SIZE);
+            ASSERT_EQ(engine.open("test_db_pinned").err, OpError::Ok);
+            for (int i = 0; i < 5000; i++)
+                ASSERT_EQ(engine.set(std::to_string(i), std::to_string(i) + std::string(100, 'v')).err, OpError::Ok);
+            ASSERT_EQ(engine.set("large", large_value(20 * kb, 1)).err, OpError::Ok);
+
+            PinnedValue value;
+            ASSERT_EQ(engine.get("42", value).err, OpError::Ok);
+            ASSERT_TRUE(value.pinned());
+            ASSERT_EQ(value.view(), "42" + std::string(100, 'v'));
+            for (int i = 0; i < 5000; i += 7)
+                ASSERT_EQ(engine.get(std::to_string(i)).value, std::to_string(i) + std::string(100, 'v')) << "failed at " << i;
+            ASSERT_EQ(value.view(), "42" + std::string(100, 'v'));
+
+            // the writers of the leaf don't wait for the handle, they modify a copy of the page
+            ASSERT_EQ(engine.set("42", "new").err, OpError::Ok);
+            ASSERT_EQ(engine.set("45", "new").err, OpError::Ok);
+            ASSERT_EQ(engine.remove("44").err, OpError::Ok);
+            ASSERT_EQ(value.view(), "42" + std::string(100, 'v'));
+            ASSERT_EQ(engine.get("42").value, "new");
+            ASSERT_EQ(engine.get("44").err, OpError::KeyNotFound);
+
+            // the leaf is split and merged while another handle is held
+            PinnedValue other;
+            ASSERT_EQ(engine.get("420", other).err, OpError::Ok);
+            for (int i = 0; i < 500; i++)
+                ASSERT_EQ(engine.set("420." + std::to_string(i), std::string(100, 'w')).err, OpError::Ok);
+            for (int i = 0; i < 500; i++)
+                ASSERT_EQ(engine.remove("420." + std::to_string(i)).err, OpError::Ok);
+            ASSERT_EQ(value.view(), "42" + std::string(100, 'v'));
+            ASSERT_EQ(other.view(), "420" + std::string(100, 'v'));
+            other.reset();
+            value.reset();
+            ASSERT_TRUE(value.view().empty());
+
+            // the released frames are reused
+            for (int i = 1; i < 5000; i += 7)
+                ASSERT_EQ(engine.get(std::to_string(i)).value, std::to_string(i) + std::string(100, 'v')) << "failed at " << i;
+            ASSERT_EQ(engine.get("42", value).err, OpError::Ok);
+            ASSERT_EQ(value.view(), "new");
+
+            // the handle is reused, a large value is copied into it
+            ASSERT_EQ(engine.get("large", value).err, OpError::Ok);
+            ASSERT_FALSE(value.pinned());
+            ASSERT_EQ(value.view(), large_value(20 * kb, 1));
+            ASSERT_EQ(engine.get("missing", value).err, OpError::KeyNotFound);
+            ASSERT_TRUE(value.view().empty());
+
+            // the default of KvEngine copies the value
+            KvEngine &kv = engine;
+            ASSERT_EQ(kv.KvEngine::get("43", value).err, OpError::Ok);
+            ASSERT_FALSE(value.pinned());
+            ASSERT_EQ(value.view(), "43" + std::string(100, 'v'));
+        }
+        std::filesystem::remove_all("test_db_pinned");
+    }
+
+    TEST(BTreePinnedTest, bench_pinned_get)
+    {
+        const int key_num = 20000, op_num = 500000;
+        std::filesystem::remove_all("test_db_pinned");
+        {
+            BTree engine;
+            engine.set_durability(Durability::Async);
+            ASSERT_EQ(engine.open("test_db_pinned").err, OpError::Ok);
+            for (int i = 0; i < key_num; i++)
+                ASSERT_EQ(engine.set(std::to_string(i), large_value(400, i)).err, OpError::Ok);
+            std::vector<std::string> keys;
+            std::mt19937 rng(0);
+            for (int i = 0; i < op_num; i++)
+                keys.push_back(std::to_string(std::uniform_int_distribution<int>(0, key_num - 1)(rng)));
+
+            size_t bytes = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (auto &key : keys)
+                bytes += engine.get(key).value.size();
+            double copy_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            PinnedValue value;
+            start = std::chrono::steady_clock::now();
+            for (auto &key : keys)
+            {
+                engine.get(key, value);
+                bytes -= value.size();
+            }
+            value.reset();
+            double pinned_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            ASSERT_EQ(bytes, 0);
+
+            std::cout << "[ BENCH    ] 400 byte values: get " << op_num / copy_seconds << " ops/s, pinned get "
+                      << op_num / pinned_seconds << " ops/s" << std::endl;
+        }
+        std::filesystem::remove_all("test_db_pinned");
+    }
+
+    // a record is checked by its crc32c, which covers its lsn
+    TEST(WriteAheadLogTest, checksum)
+    {
+        std::filesystem::remove_all("test_db_wal");
+        std::vector<lsn_t> lsns;
+        {
+            WriteAheadLog wal;
+            wal.set_segment_size(64 * kb);
+            wal.open("test_db_wal");
+            for (id_t i = 0; i < 100; i++)
+            {
+                std::string redo = "redo" + std::to_string(i);
+                std::vector<char> buf(RECORD_HEADER_SIZE + redo.size());
+                Record *record = (Record *)buf.data();
+                record->seq_num = i;
+                record->page_id = i;
+                record->redo_len = redo.size();
+                std::memcpy(record->redo, redo.data(), redo.size());
+                lsns.push_back(wal.log(*record));
+            }
+            wal.flush(wal.next_lsn());
+
+            std::vector<char> buf;
+            for (id_t i = 0; i < 100; i++)
+            {
+                ASSERT_TRUE(wal.read_record(lsns[i], buf));
+                const Record &record = *(Record *)buf.data();
+                ASSERT_EQ(record.checksum, record_checksum(record));
+                ASSERT_EQ(std::string(record.redo, record.redo_len), "redo" + std::to_string(i));
+            }
+            ASSERT_FALSE(wal.read_record(lsns[1] + 1, buf));
+        }
+
+        auto segment = std::filesystem::path("test_db_wal") / "cydb.0000000000000000.log";
+        ASSERT_EQ(std::filesystem::file_size(segment), 64 * kb);
+        {
+            // a byte of the redo of the record 50 is flipped
+            std::fstream file(segment, std::ios::in | std::ios::out | std::ios::binary);
+            file.seekg(lsns[50] + RECORD_HEADER_SIZE);
+            char c = file.get();
+            file.seekp(lsns[50] + RECORD_HEADER_SIZE);
+            file.put(c ^ 1);
+        }
+        WriteAheadLog wal;
+        wal.open("test_db_wal");
+        size_t num = 0;
+        ASSERT_EQ(wal.for_each_record(0, [&](const Record &, lsn_t) { num++; }), lsns[50]);
+        ASSERT_EQ(num, 50);
+        std::filesystem::remove_all("test_db_wal");
+    }
+
+    // the writer cleans the pages in the background, a checkpoint truncates the log
+    TEST(BTreeWriterTest, checkpoint)
+    {
+        std::filesystem::remove_all("test_db_writer");
+        {
+            BTree engine(16 * PAGE_SIZE);
+            WriterOptions options;
+            options.interval = std::chrono::milliseconds(10);
+            options.pages_per_second = 100000;
+            options.checkpoint_interval = std::chrono::hours(1);
+            engine.set_writer_options(options);
+            engine.set_log_segment_size(64 * kb);
+            ASSERT_EQ(engine.open("test_db_writer").err, OpError::Ok);
+
+            for (int i = 0; i < 2000; i++)
+                ASSERT_EQ(engine.set(std::to_string(i), std::string(100, 'v')).err, OpError::Ok);
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            engine.checkpoint();
+            ASSERT_NE(engine.metadata().checkpoint_lsn, INVALID_LSN);
+
+            // the first segments are recycled, at most 2 segments are live
+            ASSERT_FALSE(std::filesystem::exists("test_db_writer/cydb.0000000000000000.log"));
+            ASSERT_LE(engine.log_segment_num(), 2 + MAX_RECYCLED_SEGMENTS);
+
+            for (int i = 2000; i < 3000; i++)
+            {
+                ASSERT_EQ(engine.set(std::to_string(i), std::string(100, 'v')).err, OpError::Ok);
+                if (i % 100 == 0)
+                    engine.checkpoint();
+            }
+            ASSERT_LE(engine.log_segment_num(), 2 + MAX_RECYCLED_SEGMENTS);
+        }
+
+        {
+            BTree engine(16 * PAGE_SIZE);
+            ASSERT_EQ(engine.open("test_db_writer").err, OpError::Ok);
+            for (int i = 0; i < 3000; i++)
+                ASSERT_EQ(engine.get(std::to_string(i)).err, OpError::Ok) << "failed at " << i;
+        }
+        std::filesystem::remove_all("test_db_writer");
+    }
+
+    // the dirty pages are written continuously rather than in bursts
+    TEST(BTreeWriterTest, bench_set_latency)
+    {
+        const int op_num = 20000;
+        std::filesystem::remove_all("test_db_writer");
+        std::vector<double> latencies(op_num);
+        {
+            BTree engine(64 * PAGE_SIZE);
+            ASSERT_EQ(engine.open("test_db_writer").err, OpError::Ok);
+            for (int i = 0; i < op_num; i++)
+            {
+                auto start = std::chrono::steady_clock::now();
+                ASSERT_EQ(engine.set(std::to_string(i), std::string(100, 'v')).err, OpError::Ok);
+                latencies[i] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+            }
+        }
+
+        std::sort(latencies.begin(), latencies.end());
+        std::cout << "[ BENCH    ] set latency: p50 " << latencies[op_num / 2] << " us, p99 " << latencies[op_num * 99 / 100]
+                  << " us, max " << latencies.back() << " us" << std::endl;
+        std::filesystem::remove_all("test_db_writer");
+    }
+
+    // the log segment files in the order of their lsns
+    std::vector<std::filesystem::path> log_segments(const std::filesystem::path &dir)
+    {
+        std::vector<std::filesystem::path> segments;
+        for (auto &entry : std::filesystem::directory_iterator(dir))
+        {
+            if (entry.path().extension() == ".log")
+                segments.push_back(entry.path());
+        }
+        std::sort(segments.begin(), segments.end());
+        return segments;
+    }
+
+    // run the writes in a child process, which exits without destroying the engine
+    template <typename F>
+    void crash_after(const size_t buffer_size, const WriterOptions &options, F &&write, const lsn_t segment_size = LOG_SEGMENT_SIZE)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            BTree *engine = new BTree(buffer_size);
+            engine->set_writer_options(options);
+            engine->set_log_segment_size(segment_size);
+            if (engine->open("test_db_recovery").err != OpError::Ok)
+                _exit(1);
+            write(*engine);
+            _exit(0);
+        }
+
+        int status;
+        ASSERT_EQ(waitpid(pid, &status, 0), pid);
+        ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    // a checkpoint keeps the log of the actions in progress, an action open at the crash is undone as a whole
+    TEST(BTreeRecoveryTest, checkpoint_during_action)
+    {
+        std::filesystem::remove_all("test_db_recovery");
+        id_t root_id;
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            BufferManager *buffer_manager = new BufferManager(16 * PAGE_SIZE);
+            buffer_manager->set_log_segment_size(64 * kb);
+            buffer_manager->open("test_db_recovery");
+            ActionScope *action = new ActionScope(buffer_manager->begin_action());
+            buffer_manager->set_root_id(buffer_manager->root_id() + 1000);
+            // the actions ended after it fill a few segments
+            for (int i = 0; i < 10000; i++)
+            {
+                ActionScope inner = buffer_manager->begin_action();
+                buffer_manager->set_root_id(buffer_manager->root_id());
+                inner.end();
+            }
+            buffer_manager->checkpoint();
+            _exit(buffer_manager->log_segment_num() > 1 && action != nullptr ? 0 : 1);
+        }
+        int status;
+        ASSERT_EQ(waitpid(pid, &status, 0), pid);
+        ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+        {
+            BufferManager buffer_manager(16 * PAGE_SIZE);
+            buffer_manager.open("test_db_recovery");
+            root_id = buffer_manager.root_id();
+        }
+        ASSERT_EQ(root_id, 0);
+        std::filesystem::remove_all("test_db_recovery");
+    }
+
+    // the evicted pages have been written with some records, the others are redone
+    TEST(BTreeRecoveryTest, crash)
+    {
+        const int key_num = 5000;
+        std::filesystem::remove_all("test_db_recovery");
+        crash_after(16 * PAGE_SIZE, WriterOptions(), [&](BTree &engine) {
+            for (int i = 0; i < key_num; i++)
+                engine.set(std::to_string(i), std::string(100, 'v'));
+            for (int i = 0; i < key_num; i += 2)
+                engine.remove(std::to_string(i));
+            for (int i = 1; i < key_num; i += 4)
+                engine.set(std::to_string(i), std::string(200, 'u'));
+        });
+
+        auto start = std::chrono::steady_clock::now();
+        {
+            BTree engine(16 * PAGE_SIZE);
+            ASSERT_EQ(engine.open("test_db_recovery").err, OpError::Ok);
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << "[ BENCH    ] restart: " << elapsed.count() << " ms, "
+                      << log_segments("test_db_recovery").size() << " log segments" << std::endl;
+
+            for (int i = 0; i < key_num; i++)
+            {
+                auto s = engine.get(std::to_string(i));
+                if (i % 2 == 0)
+                    ASSERT_EQ(s.err, OpError::KeyNotFound) << "failed at " << i;
+                else
+                {
+                    ASSERT_EQ(s.err, OpError::Ok) << "failed at " << i;
+                    ASSERT_EQ(s.value, i % 4 == 1 ? std::string(200, 'u') : std::string(100, 'v')) << "failed at " << i;
+                }
+            }
+        }
+        std::filesystem::remove_all("test_db_recovery");
+    }
+
+    // a crash at any point of the log, the interrupted splits are undone
+    TEST(BTreeRecoveryTest, torn_log)
+    {
+        const int key_num = 3000;
+        std::filesystem::remove_all("test_db_recovery");
+        // no page is written back
+        WriterOptions options;
+        options.interval = std::chrono::hours(1);
+        // the records span the segments
+        const lsn_t segment_size = 64 * kb;
+        crash_after(
+            64 * mb, options,
+            [&](BTree &engine) {
+                for (int i = 0; i < key_num; i++)
+                    engine.set(std::to_string(i), std::string(100, 'v'));
+            },
+            segment_size);
+
+        auto log_size = log_segments("test_db_recovery").size() * segment_size;
+        std::mt19937 rng(42);
+        for (int t = 0; t < 30; t++)
+        {
+            std::filesystem::remove_all("test_db_recovery_torn");
+            std::filesystem::copy("test_db_recovery", "test_db_recovery_torn");
+            // the log after the cut is zeroed, the segments keep their sizes
+            auto cut = std::uniform_int_distribution<uintmax_t>(0, log_size)(rng);
+            auto segments = log_segments("test_db_recovery_torn");
+            for (size_t i = 0; i < segments.size(); i++)
+            {
+                if (cut < (i + 1) * segment_size)
+                {
+                    std::filesystem::resize_file(segments[i], cut > i * segment_size ? cut - i * segment_size : 0);
+                    std::filesystem::resize_file(segments[i], segment_size);
+                }
+            }
+
+            // the keys written before the cut are a prefix
+            BTree engine;
+            ASSERT_EQ(engine.open("test_db_recovery_torn").err, OpError::Ok);
+            int n = 0;
+            while (n < key_num && engine.get(std::to_string(n)).err == OpError::Ok)
+                n++;
+            for (int i = n; i < key_num; i++)
+                ASSERT_EQ(engine.get(std::to_string(i)).err, OpError::KeyNotFound) << "failed at " << i << ", cut at " << cut;
+            // the links of the undone splits are restored
+            ASSERT_EQ(engine.scan("", "").value, std::to_string(n)) << "cut at " << cut;
+            for (int i = 0; i < 100; i++)
+                ASSERT_EQ(engine.set("new" + std::to_string(i), "v").err, OpError::Ok);
+        }
+        std::filesystem::remove_all("test_db_recovery_torn");
+        std::filesystem::remove_all("test_db_recovery");
+    }
+
+    // a batch cut by a crash is undone as a whole
+    TEST(BTreeRecoveryTest, torn_batch)
+    {
+        const int batch_num = 30, batch_size = 100;
+        std::filesystem::remove_all("test_db_recovery");
+        WriterOptions options;
+        options.interval = std::chrono::hours(1);
+        const lsn_t segment_size = 64 * kb;
+        crash_after(
+            64 * mb, options,
+            [&](BTree &engine) {
+                for (int b = 0; b < batch_num; b++)
+                {
+                    // the keys of a batch are spread over the tree
+                    WriteBatch batch;
+                    for (int i = 0; i < batch_size; i++)
+                        batch.set(std::to_string(i * batch_num + b), std::string(100, 'v'));
+                    engine.write(batch);
+                }
+            },
+            segment_size);
+
+        auto log_size = log_segments("test_db_recovery").size() * segment_size;
+        std::mt19937 rng(42);
+        for (int t = 0; t < 30; t++)
+        {
+            std::filesystem::remove_all("test_db_recovery_torn");
+            std::filesystem::copy("test_db_recovery", "test_db_recovery_torn");
+            auto cut = std::uniform_int_distribution<uintmax_t>(0, log_size)(rng);
+            auto segments = log_segments("test_db_recovery_torn");
+            for (size_t i = 0; i < segments.size(); i++)
+            {
+                if (cut < (i + 1) * segment_size)
+                {
+                    std::filesystem::resize_file(segments[i], cut > i * segment_size ? cut - i * segment_size : 0);
+                    std::filesystem::resize_file(segments[i], segment_size);
+                }
+            }
+
+            // the batches written before the cut are a prefix, and each of them is whole
+            BTree engine;
+            ASSERT_EQ(engine.open("test_db_recovery_torn").err, OpError::Ok);
+            int n = 0;
+            while (n < batch_num && engine.get(std::to_string(n)).err == OpError::Ok)
+                n++;
+            for (int b = 0; b < batch_num; b++)
+                for (int i = 0; i < batch_size; i++)
+                    ASSERT_EQ(engine.get(std::to_string(i * batch_num + b)).err, b < n ? OpError::Ok : OpError::KeyNotFound)
+                        << "batch " << b << ", key " << i << ", cut at " << cut;
+            ASSERT_EQ(engine.scan("", "").value, std::to_string(n * batch_size)) << "cut at " << cut;
+        }
+        std::filesystem::remove_all("test_db_recovery_torn");
+        std::filesystem::remove_all("test_db_recovery");
+    }
+
+    // a crash in the middle of the merges, the interrupted ones are undone with the free list
+    TEST(BTreeRecoveryTest, torn_merge)
+    {
+        const int key_num = 3000;
+        std::filesystem::remove_all("test_db_recovery");
+        WriterOptions options;
+        options.interval = std::chrono::hours(1);
+        const lsn_t segment_size = 64 * kb;
+        crash_after(
+            64 * mb, options,
+            [&](BTree &engine) {
+                for (int i = 0; i < key_num; i++)
+                    engine.set(std::to_string(i), std::string(100, 'v'));
+                for (int i = 0; i < key_num; i++)
+                    engine.remove(std::to_string(i));
+            },
+            segment_size);
+
+        auto log_size = log_segments("test_db_recovery").size() * segment_size;
+        std::mt19937 rng(42);
+        for (int t = 0; t < 30; t++)
+        {
+            std::filesystem::remove_all("test_db_recovery_torn");
+            std::filesystem::copy("test_db_recovery", "test_db_recovery_torn");
+            auto cut = std::uniform_int_distribution<uintmax_t>(0, log_size)(rng);
+            auto segments = log_segments("test_db_recovery_torn");
+            for (size_t i = 0; i < segments.size(); i++)
+            {
+                if (cut < (i + 1) * segment_size)
+                {
+                    std::filesystem::resize_file(segments[i], cut > i * segment_size ? cut - i * segment_size : 0);
+                    std::filesystem::resize_file(segments[i], segment_size);
+                }
+            }
+
+            // the keys are set and then removed in order, so the keys left are a range
+            BTree engine;
+            ASSERT_EQ(engine.open("test_db_recovery_torn").err, OpError::Ok);
+            int first = 0;
+            while (first < key_num && engine.get(std::to_string(first)).err != OpError::Ok)
+                first++;
+            int last = first;
+            while (last < key_num && engine.get(std::to_string(last)).err == OpError::Ok)
+                last++;
+            for (int i = last; i < key_num; i++)
+                ASSERT_EQ(engine.get(std::to_string(i)).err, OpError::KeyNotFound) << "failed at " << i << ", cut at " << cut;
+            ASSERT_EQ(engine.scan("", "").value, std::to_string(last - first)) << "cut at " << cut;
+
+            // the pages on the free list are reused
+            for (int i = 0; i < key_num; i++)
+                ASSERT_EQ(engine.set(std::to_string(i), std::string(100, 'n')).err, OpError::Ok);
+            for (int i = 0; i < key_num; i++)
+                ASSERT_EQ(engine.get(std::to_string(i)).value, std::string(100, 'n')) << "failed at " << i << ", cut at " << cut;
+            ASSERT_EQ(engine.scan("", "").value, std::to_string(key_num)) << "cut at " << cut;
+        }
+        std::filesystem::remove_all("test_db_recovery_torn");
+        std::filesystem::remove_all("test_db_recovery");
+    }
+
+    // a crash while large values are set, replaced and removed, a value is either whole or missing
+    TEST(BTreeRecoveryTest, torn_overflow)
+    {
+        const int key_num = 40;
+        const size_t value_size = 40 * kb;
+        std::filesystem::remove_all("test_db_recovery");
+        WriterOptions options;
+        options.interval = std::chrono::hours(1);
+        const lsn_t segment_size = 256 * kb;
+        crash_after(
+            64 * mb, options,
+            [&](BTree &engine) {
+                for (int i = 0; i < key_num; i++)
+                    engine.set(std::to_string(i), large_value(value_size, i));
+                for (int i = 0; i < key_num; i++)
+                    engine.set(std::to_string(i), large_value(value_size / 2, -i));
+                for (int i = 0; i < key_num; i += 2)
+                    engine.remove(std::to_string(i));
+            },
+            segment_size);
+
+        // the states of the keys after each prefix of the updates
+        std::vector<std::vector<int>> prefixes = {std::vector<int>(key_num, 0)};
+        for (int state : {1, 2})
+        {
+            for (int i = 0; i < key_num; i++)
+            {
+                prefixes.push_back(prefixes.back());
+                prefixes.back()[i] = state;
+            }
+        }
+        for (int i = 0; i < key_num; i += 2)
+        {
+            prefixes.push_back(prefixes.back());
+            prefixes.back()[i] = 0;
+        }
+
+        auto log_size = log_segments("test_db_recovery").size() * segment_size;
+        std::mt19937 rng(42);
+        for (int t = 0; t < 30; t++)
+        {
+            std::filesystem::remove_all("test_db_recovery_torn");
+            std::filesystem::copy("test_db_recovery", "test_db_recovery_torn");
+            auto cut = std::uniform_int_distribution<uintmax_t>(0, log_size)(rng);
+            auto segments = log_segments("test_db_recovery_torn");
+            for (size_t i = 0; i < segments.size(); i++)
+            {
+                if (cut < (i + 1) * segment_size)
+                {
+                    std::filesystem::resize_file(segments[i], cut > i * segment_size ? cut - i * segment_size : 0);
+                    std::filesystem::resize_file(segments[i], segment_size);
+                }
+            }
+
+            // the state of a key is missing, the first value or the second one, and the states are those of a prefix
+            BTree engine;
+            ASSERT_EQ(engine.open("test_db_recovery_torn").err, OpError::Ok);
+            std::vector<int> states;
+            for (int i = 0; i < key_num; i++)
+            {
+                auto s = engine.get(std::to_string(i));
+                if (s.err == OpError::KeyNotFound)
+                    states.push_back(0);
+                else if (s.value == large_value(value_size, i))
+                    states.push_back(1);
+                else
+                {
+                    ASSERT_EQ(s.value, large_value(value_size / 2, -i)) << "failed at " << i << ", cut at " << cut;
+                    states.push_back(2);
+                }
+            }
+            ASSERT_NE(std::find(prefixes.begin(), prefixes.end(), states), prefixes.end()) << "cut at " << cut;
+
+            // the pages of the undone values are back on the free list
+            for (int i = 0; i < key_num; i++)
+                ASSERT_EQ(engine.set(std::to_string(i), large_value(value_size, i + 1)).err, OpError::Ok);
+            for (int i = 0; i < key_num; i++)
+                ASSERT_EQ(engine.get(std::to_string(i)).value, large_value(value_size, i + 1)) << "failed at " << i << ", cut at " << cut;
+        }
+        std::filesystem::remove_all("test_db_recovery_torn");
+        std::filesystem::remove_all("test_db_recovery");
+    }
 } // namespace
\ No newline at end of file
@@ -0,0 +1,551 @@
+#include <filesystem>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <iostream>
+#include <map>
+
+#include <malloc.h>
+
+#include "engines/cykv.hpp"
+#include "engines/btree/btree.hpp"
+#include "engines/rocksdb.hpp"
+#include "gtest/gtest.h"
+
+namespace
+{
+    using namespace cyber;
+
+    class CyKVTest : public ::testing::Test
+    {
+    protected:
+        void SetUp() override
+        {
+            std::filesystem::remove_all("test_db_cykv");
+            engine = new CyKV();
+            engine->set_compaction_options(no_compaction());
+            auto s = engine->open("test_db_cykv");
+            ASSERT_EQ(s.err, OpError::Ok) << "can't open file";
+        }
+        void TearDown() override
+        {
+            delete engine;
+            std::filesystem::remove_all("test_db_cykv");
+        }
+
+        // reopen the engine on the same directory
+        void reopen(uint64_t max_log_size = 64 * mb, const CompactionOptions &options = no_compaction())
+        {
+            delete engine;
+            engine = new CyKV(max_log_size);
+            engine->set_compaction_options(options);
+            ASSERT_EQ(engine->open("test_db_cykv").err, OpError::Ok);
+        }
+
+        // the stale commands are kept where the tests count them
+        static CompactionOptions no_compaction()
+        {
+            CompactionOptions options;
+            options.thread_num = 0;
+            return options;
+        }
+        static CompactionOptions eager_compaction()
+        {
+            CompactionOptions options;
+            options.interval = std::chrono::milliseconds(1);
+            options.bytes_per_second = 0;
+            return options;
+        }
+
+        CyKV *engine;
+    };
+
+    TEST_F(CyKVTest, get_set)
+    {
+        for (int i = 0; i < 1000; i++)
+            ASSERT_EQ(engine->set(std::to_string(i), std::to_string(i)).err, OpError::Ok);
+        for (int i = 0; i < 1000; i++)
+        {
+            auto s = engine->get(std::to_string(i));
+            ASSERT_EQ(s.err, OpError::Ok) << "failed at " << i;
+            ASSERT_EQ(s.value, std::to_string(i)) << "failed at " << i;
+        }
+        ASSERT_EQ(engine->get("missing").err, OpError::KeyNotFound);
+
+        ASSERT_EQ(engine->set("0", "new").err, OpError::Ok);
+        ASSERT_EQ(engine->get("0").value, "new");
+        ASSERT_EQ(engine->set("empty", "").err, OpError::Ok);
+        ASSERT_EQ(engine->get("empty").err, OpError::Ok);
+        ASSERT_EQ(engine->get("empty").value, "");
+
+        PinnedValue value;
+        ASSERT_EQ(engine->get("1", value).err, OpError::Ok);
+        ASSERT_EQ(value.view(), "1");
+        ASSERT_EQ(engine->scan("", "").value, "1001");
+        ASSERT_EQ(engine->scan("1", "2").value, std::to_string(1 + 10 + 100));
+        ASSERT_EQ(engine->scan("2", "1").value, "0");
+    }
+
+    TEST_F(CyKVTest, remove)
+    {
+        for (int i = 0; i < 100; i++)
+            ASSERT_EQ(engine->set(std::to_string(i), std::to_string(i)).err, OpError::Ok);
+        ASSERT_EQ(engine->uncompacted(), 0);
+        for (int i = 0; i < 100; i += 2)
+            ASSERT_EQ(engine->remove(std::to_string(i)).err, OpError::Ok);
+        ASSERT_EQ(engine->remove("0").err, OpError::KeyNotFound);
+        for (int i = 0; i < 100; i++)
+            ASSERT_EQ(engine->get(std::to_string(i)).err, i % 2 == 0 ? OpError::KeyNotFound : OpError::Ok) << "failed at " << i;
+        // the removed commands and their tombstones
+        ASSERT_GT(engine->uncompacted(), 0);
+    }
+
+    TEST_F(CyKVTest, reopen)
+    {
+        engine->set_durability(Durability::Async);
+        for (int i = 0; i < 1000; i++)
+            ASSERT_EQ(engine->set(std::to_string(i), std::to_string(i)).err, OpError::Ok);
+        for (int i = 0; i < 1000; i += 3)
+            ASSERT_EQ(engine->set(std::to_string(i), "new" + std::to_string(i)).err, OpError::Ok);
+        for (int i = 1; i < 1000; i += 3)
+            ASSERT_EQ(engine->remove(std::to_string(i)).err, OpError::Ok);
+        uint64_t uncompacted = engine->uncompacted();
+
+        // the small files are sealed one after another
+        reopen(4 * kb);
+        ASSERT_EQ(engine->uncompacted(), uncompacted);
+        for (int i = 0; i < 1000; i++)
+            ASSERT_EQ(engine->set("key" + std::to_string(i), std::string(100, 'v')).err, OpError::Ok);
+        ASSERT_GT(engine->log_num(), 20);
+
+        reopen(4 * kb);
+        for (int i = 0; i < 1000; i++)
+        {
+            auto s = engine->get(std::to_string(i));
+            if (i % 3 == 1)
+                ASSERT_EQ(s.err, OpError::KeyNotFound) << "failed at " << i;
+            else
+                ASSERT_EQ(s.value, i % 3 == 0 ? "new" + std::to_string(i) : std::to_string(i)) << "failed at " << i;
+            ASSERT_EQ(engine->get("key" + std::to_string(i)).value, std::string(100, 'v')) << "failed at " << i;
+        }
+
+        // the sealed files are read in place, the active one is copied from
+        PinnedValue value;
+        ASSERT_EQ(engine->get("key0", value).err, OpError::Ok);
+        ASSERT_TRUE(value.pinned());
+        ASSERT_EQ(value.view(), std::string(100, 'v'));
+        ASSERT_EQ(engine->set("active", "a").err, OpError::Ok);
+        ASSERT_EQ(engine->get("active", value).err, OpError::Ok);
+        ASSERT_FALSE(value.pinned());
+        ASSERT_EQ(value.view(), "a");
+    }
+
+    // the sealed files are loaded from their hints, a missing or stale hint is rebuilt from its file
+    TEST_F(CyKVTest, hints)
+    {
+        reopen(4 * kb);
+        engine->set_durability(Durability::Async);
+        for (int i = 0; i < 2000; i++)
+            ASSERT_EQ(engine->set(std::to_string(i % 500), std::to_string(i)).err, OpError::Ok);
+        for (int i = 0; i < 500; i += 5)
+            ASSERT_EQ(engine->remove(std::to_string(i)).err, OpError::Ok);
+        WriteBatch batch;
+        batch.set("b", "2");
+        batch.remove("1");
+        ASSERT_EQ(engine->write(batch).err, OpError::Ok);
+        for (int i = 0; i < 100; i++)
+            ASSERT_EQ(engine->set("key" + std::to_string(i), std::string(100, 'v')).err, OpError::Ok);
+        uint64_t uncompacted = engine->uncompacted(), disk_size = engine->disk_size();
+        size_t log_num = engine->log_num();
+        ASSERT_GT(log_num, 10);
+
+        auto check = [&]() {
+            ASSERT_EQ(engine->uncompacted(), uncompacted);
+            ASSERT_EQ(engine->disk_size(), disk_size);
+            ASSERT_EQ(engine->log_num(), log_num);
+            for (int i = 0; i < 500; i++)
+            {
+                auto s = engine->get(std::to_string(i));
+                if (i % 5 == 0 || i == 1)
+                    ASSERT_EQ(s.err, OpError::KeyNotFound) << "failed at " << i;
+                else
+                    ASSERT_EQ(s.value, std::to_string(1500 + i)) << "failed at " << i;
+            }
+            ASSERT_EQ(engine->get("b").value, "2");
+            ASSERT_EQ(engine->get("key99").value, std::string(100, 'v'));
+        };
+        auto hint_num = []() {
+            size_t num = 0;
+            for (auto &entry : std::filesystem::directory_iterator("test_db_cykv"))
+                num += entry.path().extension() == ".hint";
+            return num;
+        };
+
+        // the files are scanned and hinted by the first open
+        reopen(4 * kb);
+        check();
+        ASSERT_EQ(hint_num(), log_num - 1);
+        reopen(4 * kb);
+        check();
+
+        // a stale hint looks like the one of a compacted file
+        auto dir = std::filesystem::path("test_db_cykv");
+        std::filesystem::copy_file(dir / "cykv.00000002.hint", dir / "cykv.00000003.hint",
+                                   std::filesystem::copy_options::overwrite_existing);
+        std::filesystem::remove(dir / "cykv.00000004.hint");
+        std::filesystem::resize_file(dir / "cykv.00000005.hint", std::filesystem::file_size(dir / "cykv.00000005.hint") - 1);
+        reopen(4 * kb);
+        check();
+        ASSERT_EQ(hint_num(), log_num - 1);
+
+        // the files sealed by this process are hinted in the background
+        reopen(4 * kb, eager_compaction());
+        for (int i = 100; i < 200; i++)
+            ASSERT_EQ(engine->set("key" + std::to_string(i), std::string(100, 'v')).err, OpError::Ok);
+        for (int i = 0; i < 500 && hint_num() < engine->log_num() - 1; i++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        ASSERT_EQ(hint_num(), engine->log_num() - 1);
+    }
+
+    // a command torn by a crash is cut off the active file, a torn batch is lost as a whole
+    TEST_F(CyKVTest, torn_log)
+    {
+        ASSERT_EQ(engine->set("a", "1").err, OpError::Ok);
+        WriteBatch batch;
+        batch.set("b", "2");
+        batch.set("c", "3");
+        batch.remove("a");
+        ASSERT_EQ(engine->write(batch).err, OpError::Ok);
+        delete engine;
+        engine = nullptr;
+
+        auto path = std::filesystem::path("test_db_cykv") / "cykv.00000000.log";
+        std::filesystem::resize_file(path, std::filesystem::file_size(path) - 1);
+        reopen();
+        ASSERT_EQ(engine->get("a").value, "1");
+        ASSERT_EQ(engine->get("b").err, OpError::KeyNotFound);
+        ASSERT_EQ(engine->get("c").err, OpError::KeyNotFound);
+
+        // appended after the valid commands
+        ASSERT_EQ(engine->set("d", "4").err, OpError::Ok);
+        reopen();
+        ASSERT_EQ(engine->get("a").value, "1");
+        ASSERT_EQ(engine->get("d").value, "4");
+    }
+
+    TEST_F(CyKVTest, write_batch)
+    {
+        ASSERT_EQ(engine->set("a", "1").err, OpError::Ok);
+        WriteBatch batch;
+        batch.set("b", "2");
+        batch.set("c", "3");
+        batch.remove("a");
+        batch.remove("missing");
+        batch.set("b", "22");
+        ASSERT_EQ(engine->write(batch).err, OpError::Ok);
+        ASSERT_EQ(engine->get("a").err, OpError::KeyNotFound);
+        ASSERT_EQ(engine->get("b").value, "22");
+        ASSERT_EQ(engine->get("c").value, "3");
+
+        std::vector<std::string_view> keys = {"c", "a", "b", "missing"};
+        auto results = engine->multi_get(keys);
+        ASSERT_EQ(results[0].value, "3");
+        ASSERT_EQ(results[1].err, OpError::KeyNotFound);
+        ASSERT_EQ(results[2].value, "22");
+        ASSERT_EQ(results[3].err, OpError::KeyNotFound);
+
+        reopen();
+        ASSERT_EQ(engine->get("a").err, OpError::KeyNotFound);
+        ASSERT_EQ(engine->get("b").value, "22");
+        ASSERT_EQ(engine->get("c").value, "3");
+    }
+
+    // the files are sealed and compacted while they're read, the value of a key starts with the key
+    TEST_F(CyKVTest, concurrency)
+    {
+        const int key_num = 2000, thread_num = 4, round_num = 5;
+        reopen(16 * kb, eager_compaction());
+        engine->set_durability(Durability::Async);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < thread_num; t++)
+        {
+            threads.emplace_back([&, t]() {
+                std::mt19937 rng(t);
+                PinnedValue value;
+                for (int round = 0; round < round_num; round++)
+                {
+                    for (int i = t; i < key_num; i += thread_num)
+                    {
+                        ASSERT_EQ(engine->set(std::to_string(i), std::to_string(i) + ":" + std::to_string(round)).err, OpError::Ok);
+                        int k = std::uniform_int_distribution<int>(0, key_num - 1)(rng);
+                        auto s = engine->get(std::to_string(k), value);
+                        if (s.err == OpError::Ok)
+                            ASSERT_EQ(value.view().substr(0, value.view().find(':')), std::to_string(k));
+                        else
+                            ASSERT_EQ(s.err, OpError::KeyNotFound);
+                    }
+                }
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+        ASSERT_EQ(engine->scan("", "").value, std::to_string(key_num));
+        for (int i = 0; i < key_num; i++)
+            ASSERT_EQ(engine->get(std::to_string(i)).value, std::to_string(i) + ":" + std::to_string(round_num - 1)) << "failed at " << i;
+    }
+
+    // the counters are overwritten over and over, the disk usage stays bounded by the live data
+    TEST_F(CyKVTest, compaction)
+    {
+        const int key_num = 200, round_num = 200;
+        auto counter = [](int k, int round) { return std::to_string(k) + ":" + std::to_string(round) + std::string(100, 'c'); };
+        reopen(16 * kb, eager_compaction());
+        engine->set_durability(Durability::Async);
+        for (int round = 0; round < round_num; round++)
+        {
+            for (int k = 0; k < key_num; k++)
+                ASSERT_EQ(engine->set("counter" + std::to_string(k), counter(k, round)).err, OpError::Ok);
+        }
+        for (int k = 0; k < key_num; k += 2)
+            ASSERT_EQ(engine->remove("counter" + std::to_string(k)).err, OpError::Ok);
+
+        // about 5MB has been written for 25KB of live data
+        uint64_t live_size = key_num * (sizeof(CommandHeader) + 10 + counter(key_num, round_num).size());
+        for (int i = 0; i < 500 && engine->disk_size() > 8 * live_size; i++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        ASSERT_LE(engine->disk_size(), 8 * live_size);
+        ASSERT_LE(engine->uncompacted(), engine->disk_size());
+
+        auto check = [&]() {
+            for (int k = 0; k < key_num; k++)
+            {
+                auto s = engine->get("counter" + std::to_string(k));
+                if (k % 2 == 0)
+                    ASSERT_EQ(s.err, OpError::KeyNotFound) << "failed at " << k;
+                else
+                    ASSERT_EQ(s.value, counter(k, round_num - 1)) << "failed at " << k;
+            }
+        };
+        check();
+        // the tombstones are kept while the older sets may be left
+        reopen(16 * kb);
+        check();
+    }
+
+    // the tombstones kept by a compaction aren't counted as garbage again when the hints are loaded,
+    // or the files would be compacted after every restart
+    TEST_F(CyKVTest, kept_tombstones)
+    {
+        const int key_num = 50;
+        reopen(16 * kb);
+        // the oldest file stays, so the tombstones are kept
+        ASSERT_EQ(engine->set("base", std::string(12 * kb, 'b')).err, OpError::Ok);
+        for (int k = 0; k < key_num; k++)
+            ASSERT_EQ(engine->set("key" + std::to_string(k), std::string(100, 'v')).err, OpError::Ok);
+        for (int k = 0; k < key_num; k++)
+            ASSERT_EQ(engine->remove("key" + std::to_string(k)).err, OpError::Ok);
+        for (int i = 0; i < 2; i++)
+            ASSERT_EQ(engine->set("pad" + std::to_string(i), std::string(12 * kb, 'p')).err, OpError::Ok);
+
+        CompactionOptions options = eager_compaction();
+        options.garbage_ratio = 0.1;
+        reopen(16 * kb, options);
+        // the compaction is done once the garbage stays put
+        uint64_t uncompacted = engine->uncompacted();
+        for (int i = 0, still = 0; i < 500 && still < 20; i++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            uint64_t now = engine->uncompacted();
+            still = now == uncompacted ? still + 1 : 0;
+            uncompacted = now;
+        }
+        ASSERT_LT(uncompacted, key_num * 100);
+
+        reopen(16 * kb);
+        ASSERT_EQ(engine->uncompacted(), uncompacted);
+        ASSERT_EQ(engine->get("key0").err, OpError::KeyNotFound);
+        ASSERT_EQ(engine->get("base").value, std::string(12 * kb, 'b'));
+    }
+
+    // a command overwritten by an unsynced write is dropped by the compaction only after the write is made durable,
+    // the part of the log not synced is cut off to simulate a crash
+    TEST_F(CyKVTest, compaction_with_async_writes)
+    {
+        CompactionOptions options = eager_compaction();
+        options.garbage_ratio = 0.2;
+        reopen(16 * kb, options);
+        engine->set_durability(Durability::Sync);
+        ASSERT_EQ(engine->set("key", std::string(12 * kb, 'a')).err, OpError::Ok);
+        ASSERT_EQ(engine->set("filler", std::string(12 * kb, 'b')).err, OpError::Ok);
+        ASSERT_EQ(engine->set("filler2", std::string(12 * kb, 'c')).err, OpError::Ok);
+        ASSERT_EQ(engine->log_num(), 3);
+
+        engine->set_durability(Durability::Async);
+        ASSERT_EQ(engine->set("key", "new").err, OpError::Ok);
+        for (int i = 0; i < 500 && engine->log_num() > 2; i++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        ASSERT_EQ(engine->log_num(), 2);
+
+        auto [id, size] = engine->synced();
+        delete engine;
+        engine = nullptr;
+        char name[32];
+        snprintf(name, sizeof(name), "cykv.%08x.log", id);
+        std::filesystem::resize_file(std::filesystem::path("test_db_cykv") / name, size);
+        reopen(16 * kb);
+        ASSERT_EQ(engine->get("key").value, "new");
+        ASSERT_EQ(engine->get("filler2").value, std::string(12 * kb, 'c'));
+    }
+
+    // the keydir is checked against a map while the keys are set, overwritten and removed,
+    // so the table is rebuilt and the arena is compacted over and over
+    TEST(CyKVKeyDirTest, keydir)
+    {
+        KeyDir keydir;
+        std::map<std::string, LogIndex> expected;
+        std::mt19937 rng(0);
+        for (uint64_t i = 0; i < 200000; i++)
+        {
+            int k = std::uniform_int_distribution<int>(0, 20000)(rng);
+            // the long keys have chunks of their own
+            std::string key = k % 1000 == 0 ? std::string(300 * kb, 'k') + std::to_string(k) : "key" + std::to_string(k);
+            LogIndex index{uint32_t(i % 7), i << 20, i % 4096};
+            KeyDir::Entry *entry = keydir.find(key);
+            ASSERT_EQ(entry != nullptr, expected.contains(key)) << "failed at " << i;
+            if (std::uniform_int_distribution<int>(0, 2)(rng) == 0)
+            {
+                if (entry != nullptr)
+                    keydir.erase(key);
+                expected.erase(key);
+            }
+            else
+            {
+                if (entry != nullptr)
+                    entry->set(index);
+                else
+                    keydir.emplace(key, index);
+                expected[key] = index;
+            }
+        }
+
+        ASSERT_EQ(keydir.size(), expected.size());
+        size_t num = 0;
+        keydir.for_each([&](std::string_view key, const LogIndex &index) {
+            auto &e = expected.at(std::string(key));
+            ASSERT_EQ(std::tie(index.id, index.offset, index.len), std::tie(e.id, e.offset, e.len));
+            num++;
+        });
+        ASSERT_EQ(num, expected.size());
+        for (auto &[key, index] : expected)
+            ASSERT_EQ(keydir.find(key)->offset(), index.offset);
+    }
+
+    TEST(CyKVRateLimiterTest, rate_limiter)
+    {
+        RateLimiter limiter;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < 11; i++)
+            limiter.request(100 * kb, 10 * mb);
+        // the first request isn't delayed
+        ASSERT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(90));
+    }
+
+    // the memory and the lookups of the keydir against the ordered map it replaced
+    TEST(CyKVBenchTest, bench_keydir)
+    {
+        const int key_num = 1000000, op_num = 2000000;
+        std::vector<std::string> keys;
+        for (int i = 0; i < key_num; i++)
+            keys.push_back("user" + std::to_string(i * 7919ull % 1000000007));
+        std::vector<std::string_view> lookups;
+        std::mt19937 rng(0);
+        for (int i = 0; i < op_num; i++)
+            lookups.push_back(keys[std::uniform_int_distribution<int>(0, key_num - 1)(rng)]);
+
+        auto bench = [&](const char *name, auto &keydir, auto insert, auto lookup) {
+            // the large blocks are mapped by malloc
+            auto allocated = []() { return mallinfo2().uordblks + mallinfo2().hblkhd; };
+            size_t start_allocated = allocated();
+            for (int i = 0; i < key_num; i++)
+                insert(keydir, keys[i], LogIndex{uint32_t(i % 64), uint64_t(i) * 128, 128});
+            double bytes = double(allocated() - start_allocated) / key_num;
+
+            uint64_t sum = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (auto key : lookups)
+                sum += lookup(keydir, key);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            ASSERT_GT(sum, 0);
+            std::cout << "[ BENCH    ] " << name << ": " << bytes << " bytes/key, " << op_num / seconds << " lookups/s" << std::endl;
+        };
+
+        {
+            std::map<std::string, LogIndex, std::less<>> keydir;
+            bench(
+                "std::map", keydir, [](auto &keydir, auto &key, const LogIndex &index) { keydir.emplace(key, index); },
+                [](auto &keydir, std::string_view key) { return keydir.find(key)->second.offset; });
+        }
+        {
+            KeyDir keydir;
+            bench(
+                "KeyDir", keydir, [](auto &keydir, auto &key, const LogIndex &index) { keydir.emplace(key, index); },
+                [](auto &keydir, std::string_view key) { return keydir.find(key)->offset(); });
+        }
+    }
+
+    // the counters are overwritten in place by BTree and RocksDB, and appended by CyKV
+    TEST(CyKVBenchTest, bench_engines)
+    {
+        const int key_num = 20000, op_num = 200000;
+        const std::string value(100, 'v');
+        std::vector<std::string> keys;
+        std::mt19937 rng(0);
+        for (int i = 0; i < op_num; i++)
+            keys.push_back("counter" + std::to_string(std::uniform_int_distribution<int>(0, key_num - 1)(rng)));
+
+        auto bench = [&](const char *name, KvEngine &engine) {
+            auto start = std::chrono::steady_clock::now();
+            for (auto &key : keys)
+                ASSERT_EQ(engine.set(key, value).err, OpError::Ok);
+            double set_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            start = std::chrono::steady_clock::now();
+            for (auto &key : keys)
+                ASSERT_EQ(engine.get(key).err, OpError::Ok);
+            double get_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            PinnedValue pinned;
+            start = std::chrono::steady_clock::now();
+            for (auto &key : keys)
+                ASSERT_EQ(engine.get(key, pinned).err, OpError::Ok);
+            pinned.reset();
+            double pinned_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "[ BENCH    ] " << name << ": set " << op_num / set_seconds << " ops/s, get "
+                      << op_num / get_seconds << " ops/s, pinned get " << op_num / pinned_seconds << " ops/s" << std::endl;
+        };
+
+        std::filesystem::remove_all("test_db_bench");
+        {
+            // most of the commands are in the sealed files
+            CyKV engine(4 * mb);
+            engine.set_durability(Durability::Async);
+            ASSERT_EQ(engine.open("test_db_bench").err, OpError::Ok);
+            bench("CyKV", engine);
+        }
+        std::filesystem::remove_all("test_db_bench");
+        {
+            BTree engine;
+            engine.set_durability(Durability::Async);
+            ASSERT_EQ(engine.open("test_db_bench").err, OpError::Ok);
+            bench("BTree", engine);
+        }
+        std::filesystem::remove_all("test_db_bench");
+        {
+            // no sync per write by default
+            RocksDB engine;
+            ASSERT_EQ(engine.open("test_db_bench").err, OpError::Ok);
+            bench("RocksDB", engine);
+        }
+        std::filesystem::remove_all("test_db_bench");
+    }
+} // namespace